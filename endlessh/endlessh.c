@@ -6,6 +6,7 @@
 #  define _BSD_SOURCE  /* for pledge(2) and unveil(2) */
 #else
 #  define _XOPEN_SOURCE 600
+#  define _GNU_SOURCE  /* for accept4(2) */
 #endif
 
 #include <time.h>
@@ -46,6 +47,7 @@
 #define XSTR(s) STR(s)
 #define STR(s) #s
 
+/* Wall clock for log timestamps. Scheduling uses the monotonic currentTimeMs(). */
 static long long
 epochms(void)
 {
@@ -111,6 +113,8 @@ static struct {
     long long connects;
     long long milliseconds;
     long long bytes_sent;
+    long long stalls;
+    long long dead_peers;
 } statistics;
 
 struct client {
@@ -119,20 +123,40 @@ struct client {
     long long send_next;
     long long bytes_sent;
     struct client *next;
+    struct client *prev;
+    struct timerNode timer;
     int port;
     int fd;
+    int stalls; /* writes in a row that found the send buffer full */
+    uint32_t prefix; /* network of ipaddr, for admission control */
+    struct pacingClient pacing;
 };
 
+/* Client records are recycled through a slab instead of malloc/free. */
+static struct slabPool client_pool;
+
+/* Learns how much silence clients put up with, see shared/pacing.h. */
+static struct pacing pacing;
+
+/* Finds peers that are gone between two lines, see shared/peersweep.h. */
+static struct peerSweep sweep;
+
+/* Evicts a client for a new one once full, see shared/admission.h. */
+static struct admission admission;
+
 static struct client *
 client_new(int fd, long long send_next)
 {
-    struct client *c = malloc(sizeof(*c));
+    struct client *c = slab_alloc(&client_pool);
     if (c) {
         c->ipaddr[0] = 0;
-        c->connect_time = epochms();
+        c->connect_time = currentTimeMs();
         c->send_next = send_next;
         c->bytes_sent = 0;
+        c->stalls = 0;
         c->next = 0;
+        c->prev = 0;
+        timerwheel_node_init(&c->timer);
         c->fd = fd;
         c->port = 0;
 
@@ -144,6 +168,7 @@ client_new(int fd, long long send_next)
         logmsg(log_debug, "setsockopt(%d, SO_RCVBUF, %d) = %d", fd, value, r);
         if (r == -1)
             logmsg(log_debug, "errno = %d, %s", errno, strerror(errno));
+        peersweep_configure(&sweep, fd);
 
         /* Get IP address */
         struct sockaddr_storage addr;
@@ -161,6 +186,10 @@ client_new(int fd, long long send_next)
                           c->ipaddr, sizeof(c->ipaddr));
             }
         }
+        /* With the default dual-stack bind IPv4 peers show up as
+         * ::ffff:a.b.c.d, addressPrefix keys those by their /24 too.
+         */
+        c->prefix = addressPrefix(c->ipaddr);
     }
     return c;
 }
@@ -169,7 +198,7 @@ static void
 client_destroy(struct client *client)
 {
     logmsg(log_debug, "close(%d)", client->fd);
-    long long dt = epochms() - client->connect_time;
+    long long dt = currentTimeMs() - client->connect_time;
     logmsg(log_info,
             "CLOSE host=%s port=%d fd=%d "
             "time=%lld.%03lld bytes=%lld",
@@ -178,76 +207,165 @@ client_destroy(struct client *client)
             client->bytes_sent);
     statistics.milliseconds += dt;
 
-    char msg[256];
-    snprintf(msg, sizeof(msg), "%s disconnect %s %lld\n",
-        SERVER_ID, client->ipaddr, dt);
-    printf("%s", msg);
-    sendMetric(msg);
+    printf("%s disconnect %s %lld\n", SERVER_ID, client->ipaddr, dt);
+    metric_disconnect(client->ipaddr, dt);
 
     close(client->fd);
-    free(client);
+    slab_free(&client_pool, client);
 }
 
 static void
 statistics_log_totals(struct client *clients)
 {
     long long milliseconds = statistics.milliseconds;
-    for (long long now = epochms(); clients; clients = clients->next)
+    for (long long now = currentTimeMs(); clients; clients = clients->next)
         milliseconds += now - clients->connect_time;
-    logmsg(log_info, "TOTALS connects=%lld seconds=%lld.%03lld bytes=%lld",
+    logmsg(log_info, "TOTALS connects=%lld seconds=%lld.%03lld bytes=%lld stalls=%lld dead=%lld",
            statistics.connects,
            milliseconds / 1000,
            milliseconds % 1000,
-           statistics.bytes_sent);
+           statistics.bytes_sent,
+           statistics.stalls,
+           statistics.dead_peers);
+    logmsg(log_info, "POOL clients=%zu high_water=%zu capacity=%zu chunks=%zu",
+           client_pool.inUse,
+           client_pool.highWater,
+           client_pool.capacity,
+           client_pool.chunkCount);
+    logmsg(log_info, "METRICS dropped=%lu", metrics_dropped());
+    logmsg(log_info, "ADMISSION evicted=%lu refused=%lu",
+           admission.evictions,
+           admission.refusals);
 }
 
-struct fifo {
+/* Clients ordered by when they are due. With adaptive pacing every client
+ * has its own delay, so appending to a FIFO would no longer keep it in order.
+ * All clients are also linked in a list for the totals.
+ */
+struct queue {
+    struct timerWheel wheel;
     struct client *head;
-    struct client *tail;
+    struct client *swept; /* next client the peer sweep checks, 0 for head */
+    struct client *sampled; /* next client looked at for eviction, 0 for head */
     int length;
 };
 
 static void
-fifo_init(struct fifo *q)
+queue_init(struct queue *q)
 {
-    q->head = q->tail = 0;
+    timerwheel_init(&q->wheel, currentTimeMs());
+    q->head = 0;
+    q->swept = 0;
+    q->sampled = 0;
     q->length = 0;
 }
 
+/* Remove and return a client that is due, or 0 */
 static struct client *
-fifo_pop(struct fifo *q)
+queue_pop(struct queue *q, long long now)
 {
-    struct client *removed = q->head;
-    q->head = q->head->next;
-    removed->next = 0;
-    if (!--q->length)
-        q->tail = 0;
-    return removed;
+    struct timerNode *node = timerwheel_pop(&q->wheel, now);
+    return node ? timer_entry(node, struct client, timer) : 0;
 }
 
 static void
-fifo_append(struct fifo *q, struct client *c)
+queue_schedule(struct queue *q, struct client *c)
 {
-    if (!q->tail) {
-        q->head = q->tail = c;
-    } else {
-        q->tail->next = c;
-        q->tail = c;
-    }
+    timerwheel_schedule(&q->wheel, &c->timer, c->send_next);
+}
+
+static void
+queue_append(struct queue *q, struct client *c)
+{
+    c->prev = 0;
+    c->next = q->head;
+    if (q->head)
+        q->head->prev = c;
+    q->head = c;
     q->length++;
+    admission_add(&admission, c->prefix, sizeof(*c));
+    queue_schedule(q, c);
 }
 
 static void
-fifo_destroy(struct fifo *q)
+queue_remove(struct queue *q, struct client *c)
 {
-    struct client *c = q->head;
-    while (c) {
-        struct client *dead = c;
-        c = c->next;
+    timerwheel_cancel(&q->wheel, &c->timer);
+    if (q->swept == c)
+        q->swept = c->next;
+    if (q->sampled == c)
+        q->sampled = c->next;
+    admission_remove(&admission, c->prefix, sizeof(*c));
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        q->head = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    c->next = c->prev = 0;
+    q->length--;
+}
+
+/* Check the next slice of clients for peers that are gone */
+static void
+queue_sweep(struct queue *q, long long now)
+{
+    uint32_t first;
+    uint32_t count = peersweep_slice(&sweep, q->length, &first);
+    for (uint32_t k = 0; k < count && q->head; k++) {
+        struct client *c = q->swept ? q->swept : q->head;
+        q->swept = c->next;
+        if (!peersweep_alive(&sweep, c->fd)) {
+            logmsg(log_debug, "dead peer fd=%d", c->fd);
+            statistics.dead_peers++;
+            queue_remove(q, c);
+            client_destroy(c);
+        }
+    }
+    peersweep_report(&sweep, now);
+}
+
+/* Evict a client picked from a few in a row by the eviction policy.
+ * Returns 0 if there is none to evict.
+ */
+static int
+queue_evict(struct queue *q)
+{
+    struct client *victim = 0;
+    struct admissionCandidate best;
+    if (admission.policy != EVICT_NONE && q->head) {
+        long long now = currentTimeMs();
+        struct client *c = q->sampled ? q->sampled : q->head;
+        for (int n = 0; n < ADMISSION_SAMPLES; n++) {
+            struct admissionCandidate candidate = {c->prefix, now - c->connect_time};
+            if (admission_prefer(&admission, &candidate, victim ? &best : 0)) {
+                best = candidate;
+                victim = c;
+            }
+            c = c->next ? c->next : q->head;
+        }
+        q->sampled = c;
+    }
+    if (!victim) {
+        admission_refused(&admission);
+        return 0;
+    }
+    admission_evicted(&admission);
+    logmsg(log_info, "EVICT host=%s port=%d fd=%d",
+           victim->ipaddr, victim->port, victim->fd);
+    queue_remove(q, victim);
+    client_destroy(victim);
+    return 1;
+}
+
+static void
+queue_destroy(struct queue *q)
+{
+    while (q->head) {
+        struct client *dead = q->head;
+        queue_remove(q, dead);
         client_destroy(dead);
     }
-    q->head = q->tail = 0;
-    q->length = 0;
 }
 
 static void
@@ -309,6 +427,7 @@ struct config {
     int delay;
     int max_line_length;
     int max_clients;
+    int accept_budget;
     int bind_family;
 };
 
@@ -317,6 +436,7 @@ struct config {
     .delay           = DEFAULT_DELAY, \
     .max_line_length = DEFAULT_MAX_LINE_LENGTH, \
     .max_clients     = DEFAULT_MAX_CLIENTS, \
+    .accept_budget   = DEFAULT_ACCEPT_BUDGET, \
     .bind_family     = DEFAULT_BIND_FAMILY, \
 }
 
@@ -365,6 +485,21 @@ config_set_max_clients(struct config *c, const char *s, int hardfail)
     }
 }
 
+static void
+config_set_accept_budget(struct config *c, const char *s, int hardfail)
+{
+    errno = 0;
+    char *end;
+    long tmp = strtol(s, &end, 10);
+    if (errno || *end || tmp < 1 || tmp > INT_MAX) {
+        fprintf(stderr, "endlessh: Invalid accept budget: %s\n", s);
+        if (hardfail)
+            exit(EXIT_FAILURE);
+    } else {
+        c->accept_budget = tmp;
+    }
+}
+
 static void
 config_set_max_line_length(struct config *c, const char *s, int hardfail)
 {
@@ -407,6 +542,7 @@ enum config_key {
     KEY_DELAY,
     KEY_MAX_LINE_LENGTH,
     KEY_MAX_CLIENTS,
+    KEY_ACCEPT_BUDGET,
     KEY_LOG_LEVEL,
     KEY_BIND_FAMILY,
 };
@@ -419,6 +555,7 @@ config_key_parse(const char *tok)
         [KEY_DELAY]           = "Delay",
         [KEY_MAX_LINE_LENGTH] = "MaxLineLength",
         [KEY_MAX_CLIENTS]     = "MaxClients",
+        [KEY_ACCEPT_BUDGET]   = "AcceptBudget",
         [KEY_LOG_LEVEL]       = "LogLevel",
         [KEY_BIND_FAMILY]     = "BindFamily"
     };
@@ -487,6 +624,9 @@ config_load(struct config *c, const char *file, int hardfail)
                 case KEY_MAX_CLIENTS:
                     config_set_max_clients(c, tokens[1], hardfail);
                     break;
+                case KEY_ACCEPT_BUDGET:
+                    config_set_accept_budget(c, tokens[1], hardfail);
+                    break;
                 case KEY_BIND_FAMILY:
                     config_set_bind_family(c, tokens[1], hardfail);
                     break;
@@ -516,6 +656,7 @@ config_log(const struct config *c)
     logmsg(log_info, "Delay %d", c->delay);
     logmsg(log_info, "MaxLineLength %d", c->max_line_length);
     logmsg(log_info, "MaxClients %d", c->max_clients);
+    logmsg(log_info, "AcceptBudget %d", c->accept_budget);
     logmsg(log_info, "BindFamily %s",
         c->bind_family == AF_INET6 ? "IPv6 Only" :
         c->bind_family == AF_INET  ? "IPv4 Only" :
@@ -525,10 +666,12 @@ config_log(const struct config *c)
 static void
 usage(FILE *f)
 {
-    fprintf(f, "Usage: endlessh [-vh] [-46] [-d MS] [-f CONFIG] [-l LEN] "
-                               "[-m LIMIT] [-p PORT]\n");
+    fprintf(f, "Usage: endlessh [-vh] [-46] [-a N] [-d MS] [-f CONFIG] "
+                               "[-l LEN] [-m LIMIT] [-p PORT]\n");
     fprintf(f, "  -4        Bind to IPv4 only\n");
     fprintf(f, "  -6        Bind to IPv6 only\n");
+    fprintf(f, "  -a INT    Connections accepted per wakeup ["
+            XSTR(DEFAULT_ACCEPT_BUDGET) "]\n");
     fprintf(f, "  -d INT    Message millisecond delay ["
             XSTR(DEFAULT_DELAY) "]\n");
     fprintf(f, "  -f        Set and load config file ["
@@ -555,7 +698,9 @@ server_create(int port, int family)
 {
     int r, s, value;
 
-    s = socket(family == AF_UNSPEC ? AF_INET6 : family, SOCK_STREAM, 0);
+    /* Non-blocking so the backlog can be drained until EAGAIN */
+    s = socket(family == AF_UNSPEC ? AF_INET6 : family,
+               SOCK_STREAM | SOCK_NONBLOCK, 0);
     logmsg(log_debug, "socket() = %d", s);
     if (s == -1) die();
 
@@ -620,13 +765,15 @@ sendline(struct client *client, int max_line_length, unsigned long *rng)
             if (errno == EINTR) {
                 continue;      /* try again */
             } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                return client; /* don't care */
+                client->stalls++;
+                statistics.stalls++;
+                return client; /* not reading, caller backs off */
             } else {
-                client_destroy(client);
-                return 0;
+                return 0;      /* caller drops it from the queue */
             }
         } else {
             client->bytes_sent += out;
+            client->stalls = 0;
             statistics.bytes_sent += out;
             return client;
         }
@@ -650,7 +797,7 @@ main(int argc, char **argv)
     config_load(&config, config_file, 1);
 
     int option;
-    while ((option = getopt(argc, argv, "46d:f:hl:m:p:svV")) != -1) {
+    while ((option = getopt(argc, argv, "46a:d:f:hl:m:p:svV")) != -1) {
         switch (option) {
             case '4':
                 config_set_bind_family(&config, "4", 1);
@@ -658,6 +805,9 @@ main(int argc, char **argv)
             case '6':
                 config_set_bind_family(&config, "6", 1);
                 break;
+            case 'a':
+                config_set_accept_budget(&config, optarg, 1);
+                break;
             case 'd':
                 config_set_delay(&config, optarg, 1);
                 break;
@@ -720,6 +870,9 @@ main(int argc, char **argv)
     /* Log configuration */
     config_log(&config);
 
+    slab_init(&client_pool, SERVER_ID, sizeof(struct client), SLAB_CHUNK_OBJECTS);
+    metrics_init(PIT_SSH);
+
     /* Install the signal handlers */
     signal(SIGPIPE, SIG_IGN);
     {
@@ -741,11 +894,20 @@ main(int argc, char **argv)
             die();
     }
 
-    struct fifo fifo[1];
-    fifo_init(fifo);
+    /* Static, the timer wheel is too large for the stack */
+    static struct queue queue[1];
+    queue_init(queue);
 
     unsigned long rng = epochms();
 
+    /* Lateness, clients served and work per round for the exporter */
+    static struct loopHistograms histograms;
+    pacing_init(&pacing, config.delay);
+    peersweep_init(&sweep);
+    long long sweep_at = 0;
+    admission_init(&admission, SERVER_ID, config.max_clients);
+    int evicting = admission.policy != EVICT_NONE;
+
     int server = server_create(config.port, config.bind_family);
 
     while (running) {
@@ -755,6 +917,8 @@ main(int argc, char **argv)
             int oldfamily = config.bind_family;
             config_load(&config, config_file, 0);
             config_log(&config);
+            pacing.base = config.delay;
+            admission.maxClients = config.max_clients;
             if (oldport != config.port || oldfamily != config.bind_family) {
                 close(server);
                 server = server_create(config.port, config.bind_family);
@@ -763,29 +927,59 @@ main(int argc, char **argv)
         }
         if (dumpstats) {
             /* print stats requested (SIGUSR1) */
-            statistics_log_totals(fifo->head);
+            statistics_log_totals(queue->head);
             dumpstats = 0;
         }
 
         /* Enqueue clients that are due for another message */
-        int timeout = -1;
-        long long now = epochms();
-        while (fifo->head) {
-            if (fifo->head->send_next <= now) {
-                struct client *c = fifo_pop(fifo);
-                if (sendline(c, config.max_line_length, &rng)) {
-                    c->send_next = now + config.delay;
-                    fifo_append(fifo, c);
+        long long now = currentTimeMs();
+        long long work_start = currentTimeUs();
+        unsigned served = 0;
+        struct client *c;
+        while ((c = queue_pop(queue, now))) {
+            histogram_record(&histograms.lateness, now - c->send_next);
+            served++;
+            long long bytes_before = c->bytes_sent;
+            int stalled = c->stalls;
+            if (sendline(c, config.max_line_length, &rng)) {
+                if (c->stalls) {
+                    /* Not reading, double the wait instead of writing every delay */
+                    c->send_next = now + backoffDelay(config.delay, c->stalls);
+                } else {
+                    if (stalled)
+                        pacing_resume(&c->pacing, now);
+                    c->send_next = now + pacing_next(&pacing, &c->pacing, now,
+                                                     c->bytes_sent - bytes_before);
                 }
+                queue_schedule(queue, c);
             } else {
-                timeout = fifo->head->send_next - now;
-                break;
+                if (!c->stalls)
+                    pacing_refused(&pacing, &c->pacing, now);
+                queue_remove(queue, c);
+                client_destroy(c);
+            }
+        }
+        int timeout = timerwheel_timeout(&queue->wheel, now);
+
+        /* Look for vanished peers once a tick */
+        if (sweep.timeoutMs > 0) {
+            if (now >= sweep_at) {
+                queue_sweep(queue, now);
+                sweep_at = now + PEER_SWEEP_TICK_MS;
             }
+            if (timeout == -1 || timeout > sweep_at - now)
+                timeout = sweep_at - now;
         }
 
+        /* Send the metrics of this round as one datagram */
+        histogram_record(&histograms.served, served);
+        histogram_record(&histograms.iteration, currentTimeUs() - work_start);
+        metrics_send_loop(&histograms, now);
+        metrics_flush();
+
         /* Wait for next event */
         struct pollfd fds = {server, POLLIN, 0};
-        int nfds = fifo->length < config.max_clients;
+        int nfds = queue->length < config.max_clients || evicting;
         logmsg(log_debug, "poll(%d, %d)", nfds, timeout);
         int r = poll(&fds, nfds, timeout);
         logmsg(log_debug, "= %d", r);
@@ -800,20 +994,26 @@ main(int argc, char **argv)
             }
         }
 
-        /* Check for new incoming connections */
-        if (fds.revents & POLLIN) {
-            int fd = accept(server, 0, 0);
-            logmsg(log_debug, "accept() = %d", fd);
+        /* Drain new incoming connections, up to the accept budget */
+        for (int n = 0; (fds.revents & POLLIN) && n < config.accept_budget
+                        && (queue->length < config.max_clients || evicting); n++) {
+            int fd = accept4(server, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            logmsg(log_debug, "accept4() = %d", fd);
+            if (fd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
             statistics.connects++;
             if (fd == -1) {
                 const char *msg = strerror(errno);
                 switch (errno) {
                     case EMFILE:
                     case ENFILE:
-                        config.max_clients = fifo->length;
+                        /* Out of descriptors, make one free and try again */
+                        if (evicting && queue_evict(queue))
+                            continue;
+                        config.max_clients = queue->length;
                         logmsg(log_info,
                                 "MaxClients %d",
-                                fifo->length);
+                                queue->length);
                         break;
                     case ECONNABORTED:
                     case EINTR:
@@ -826,30 +1026,31 @@ main(int argc, char **argv)
                         fprintf(stderr, "endlessh: fatal: %s\n", msg);
                         exit(EXIT_FAILURE);
                 }
+                break;
+            } else if (!admission_fits(&admission, sizeof(struct client))
+                       && !queue_evict(queue)) {
+                close(fd);
             } else {
-                long long send_next = epochms() + config.delay;
-                struct client *client = client_new(fd, send_next);
-                int flags = fcntl(fd, F_GETFL, 0);      /* cannot fail */
-                fcntl(fd, F_SETFL, flags | O_NONBLOCK); /* cannot fail */
+                long long accepted = currentTimeMs();
+                struct client *client = client_new(fd, accepted + config.delay);
                 if (!client) {
                     fprintf(stderr, "endlessh: warning: out of memory\n");
                     close(fd);
                 } else {
-                    fifo_append(fifo, client);
+                    client->send_next = accepted +
+                        pacing_start(&pacing, &client->pacing, client->ipaddr, accepted);
+                    queue_append(queue, client);
                     logmsg(log_info, "ACCEPT host=%s port=%d fd=%d n=%d/%d",
                             client->ipaddr, client->port, client->fd,
-                            fifo->length, config.max_clients);
-                    char msg[256];
-                    snprintf(msg, sizeof(msg), "%s connect %s\n",
-                        SERVER_ID, client->ipaddr);
-                    printf("%s", msg);
-                    sendMetric(msg);
+                            queue->length, config.max_clients);
+                    printf("%s connect %s\n", SERVER_ID, client->ipaddr);
+                    metric_address(METRIC_CONNECT, client->ipaddr);
                 }
             }
         }
     }
 
-    fifo_destroy(fifo);
+    queue_destroy(queue);
     statistics_log_totals(0);
 
     if (logmsg == logsyslog)
@@ -0,0 +1,110 @@
+package main
+
+import (
+	"github.com/prometheus/client_golang/prometheus"
+)
+
+// Log-linear histograms sent by the loops of the pits, see shared/histogram.h. Every
+// record holds the counts since the previous one, they are summed here and exposed
+// with one bucket per power of two, which the pits' buckets never straddle
+const (
+	histogramSubBits = 3
+	histogramMaxBits = 32
+	histogramBuckets = (histogramMaxBits - histogramSubBits + 1) << histogramSubBits
+)
+
+const (
+	histogramLatenessMs = iota + 1
+	histogramIterationUs
+	histogramServed
+	histogramPeerRttUs
+	histogramPeerRetransmits
+)
+
+type loopHistogram struct {
+	counts [histogramBuckets]uint64
+	count  uint64
+	sum    float64
+}
+
+type histogramKey struct {
+	pit  byte
+	kind byte
+}
+
+type histogramCollector struct {
+	descs      map[byte]*prometheus.Desc
+	histograms map[histogramKey]*loopHistogram
+}
+
+func newHistogramCollector() *histogramCollector {
+	return &histogramCollector{
+		descs: map[byte]*prometheus.Desc{
+			histogramLatenessMs: prometheus.NewDesc("pit_send_lateness_ms",
+				"How long after it was due a client was served (ms)", []string{"server"}, nil),
+			histogramIterationUs: prometheus.NewDesc("pit_loop_iteration_us",
+				"Time a loop iteration spent working, without waiting for events (us)", []string{"server"}, nil),
+			histogramServed: prometheus.NewDesc("pit_clients_served_per_wakeup",
+				"Clients served per loop wakeup", []string{"server"}, nil),
+			histogramPeerRttUs: prometheus.NewDesc("pit_peer_rtt_us",
+				"Smoothed round trip time of trapped peers, sampled by the dead-peer sweep (us)", []string{"server"}, nil),
+			histogramPeerRetransmits: prometheus.NewDesc("pit_peer_retransmits",
+				"Segments retransmitted to a trapped peer so far, sampled by the dead-peer sweep", []string{"server"}, nil),
+		},
+		histograms: map[histogramKey]*loopHistogram{},
+	}
+}
+
+// Same as histogram_bucket in shared/histogram.h
+func histogramBucket(value uint64) int {
+	if value < 1<<histogramSubBits {
+		return int(value)
+	}
+	if value>>histogramMaxBits != 0 {
+		return histogramBuckets - 1
+	}
+	top := 63
+	for value>>top == 0 {
+		top--
+	}
+	sub := int(value>>(top-histogramSubBits)) & (1<<histogramSubBits - 1)
+	return (top-histogramSubBits+1)<<histogramSubBits | sub
+}
+
+// get returns the histogram to add a record to, or nil for kinds this exporter does not know
+func (c *histogramCollector) get(pit, kind byte) *loopHistogram {
+	if _, ok := c.descs[kind]; !ok {
+		return nil
+	}
+	key := histogramKey{pit, kind}
+	h, ok := c.histograms[key]
+	if !ok {
+		h = &loopHistogram{}
+		c.histograms[key] = h
+	}
+	return h
+}
+
+func (c *histogramCollector) Describe(ch chan<- *prometheus.Desc) {
+	for _, desc := range c.descs {
+		ch <- desc
+	}
+}
+
+func (c *histogramCollector) Collect(ch chan<- prometheus.Metric) {
+	metricsMutex.Lock()
+	defer metricsMutex.Unlock()
+	for key, h := range c.histograms {
+		// Values are integers, so everything below 2^power is at most 2^power - 1
+		buckets := make(map[float64]uint64, histogramMaxBits)
+		var cumulative uint64
+		next := 0
+		for power := 0; power < histogramMaxBits; power++ {
+			for end := histogramBucket(1 << power); next < end; next++ {
+				cumulative += h.counts[next]
+			}
+			buckets[float64(uint64(1)<<power-1)] = cumulative
+		}
+		ch <- prometheus.MustNewConstHistogram(c.descs[key.kind], h.count, h.sum, buckets, pitNames[key.pit])
+	}
+}
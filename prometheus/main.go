@@ -22,10 +22,22 @@ type metrics struct {
 	totalTrappedTime *prometheus.CounterVec
 	activeClients *prometheus.GaugeVec
 	clients *prometheus.CounterVec
+	metricsDropped *prometheus.CounterVec
+	ringOccupancy *prometheus.GaugeVec
+	ringCapacity *prometheus.GaugeVec
+	ringOverruns *prometheus.CounterVec
+	loopHistograms *histogramCollector
+	pacedTrapped *prometheus.CounterVec
+	sends *prometheus.CounterVec
+	sentBytes *prometheus.CounterVec
+	loopCpu *prometheus.CounterVec
+	trappedPerCpu *prometheus.GaugeVec
+	trappedPerKByte *prometheus.GaugeVec
 
 	upnpOtherHttpRequests *prometheus.CounterVec
 	upnpMSearchRequests *prometheus.CounterVec
 	upnpNonMSearchRequests *prometheus.CounterVec
+	upnpSsdpDatagrams *prometheus.CounterVec
 
 	mqttMalformedConnect prometheus.Counter
 	mqttConnectVersions *prometheus.CounterVec
@@ -58,6 +70,47 @@ func NewMetrics() *metrics {
 			Name: "tarpitted_clients",
 			Help: "Connected clients",
 		}, []string{/*"ip", */"server","country", "latitude", "longitude"}),
+		metricsDropped: prometheus.NewCounterVec(prometheus.CounterOpts{
+			Name: "metrics_dropped",
+			Help: "Metric lines a server dropped because the exporter was slow or unavailable",
+		}, []string{"server"}),
+		ringOccupancy: prometheus.NewGaugeVec(prometheus.GaugeOpts{
+			Name: "metric_ring_occupancy_bytes",
+			Help: "Bytes waiting in a shared memory metric ring when it was last polled",
+		}, []string{"server", "ring"}),
+		ringCapacity: prometheus.NewGaugeVec(prometheus.GaugeOpts{
+			Name: "metric_ring_capacity_bytes",
+			Help: "Size of a shared memory metric ring",
+		}, []string{"server", "ring"}),
+		ringOverruns: prometheus.NewCounterVec(prometheus.CounterOpts{
+			Name: "metric_ring_overruns",
+			Help: "Metric records a server dropped because its ring was full",
+		}, []string{"server"}),
+		loopHistograms: newHistogramCollector(),
+		pacedTrapped: prometheus.NewCounterVec(prometheus.CounterOpts{
+			Name: "pit_paced_trapped_seconds",
+			Help: "Seconds clients were held between the messages of a trickling pit",
+		}, []string{"server"}),
+		sends: prometheus.NewCounterVec(prometheus.CounterOpts{
+			Name: "pit_sends",
+			Help: "Messages a trickling pit sent",
+		}, []string{"server"}),
+		sentBytes: prometheus.NewCounterVec(prometheus.CounterOpts{
+			Name: "pit_sent_bytes",
+			Help: "Bytes a trickling pit sent",
+		}, []string{"server"}),
+		loopCpu: prometheus.NewCounterVec(prometheus.CounterOpts{
+			Name: "pit_loop_cpu_seconds",
+			Help: "CPU time of the threads running a trickling pit's loops",
+		}, []string{"server"}),
+		trappedPerCpu: prometheus.NewGaugeVec(prometheus.GaugeOpts{
+			Name: "pit_trapped_seconds_per_cpu_second",
+			Help: "Attacker seconds trapped per second of CPU since the exporter started",
+		}, []string{"server"}),
+		trappedPerKByte: prometheus.NewGaugeVec(prometheus.GaugeOpts{
+			Name: "pit_trapped_seconds_per_kilobyte",
+			Help: "Attacker seconds trapped per kB sent since the exporter started",
+		}, []string{"server"}),
 		// ---------------
 		upnpOtherHttpRequests: prometheus.NewCounterVec(prometheus.CounterOpts{
 			Name: "upnp_other_http_requests",
@@ -71,6 +124,10 @@ func NewMetrics() *metrics {
 			Name: "upnp_non_M-Search_requests",
 			Help: "Number of SSDP requests that are not M-SEARCH",
 		}, []string{"ip"}),
+		upnpSsdpDatagrams: prometheus.NewCounterVec(prometheus.CounterOpts{
+			Name: "upnp_ssdp_datagrams",
+			Help: "SSDP datagrams received, by what became of them",
+		}, []string{"kind"}),
 		// ---------------
 		mqttMalformedConnect: prometheus.NewCounter(prometheus.CounterOpts{
 			Name: "mqtt_pit_malformed_connects",
@@ -105,8 +162,9 @@ func NewMetrics() *metrics {
 			Help: "Total PUBREC requests for MQTT",
 		}),
 	}
-	prometheus.MustRegister(m.totalConnects, m.totalTrappedTime, m.activeClients, m.clients, 
-		m.upnpOtherHttpRequests, m.upnpMSearchRequests, m.upnpNonMSearchRequests,
+	prometheus.MustRegister(m.totalConnects, m.totalTrappedTime, m.activeClients, m.clients, m.metricsDropped, m.ringOccupancy, m.ringCapacity, m.ringOverruns, m.loopHistograms,
+		m.pacedTrapped, m.sends, m.sentBytes, m.loopCpu, m.trappedPerCpu, m.trappedPerKByte,
+		m.upnpOtherHttpRequests, m.upnpMSearchRequests, m.upnpNonMSearchRequests, m.upnpSsdpDatagrams,
 		m.mqttConacks, m.mqttUnsubscribe, m.mqttPubrec,
 		m.mqttMalformedConnect, m.mqttConnectVersions, m.mqttSubscribeTopics, m.mqttCredentials, m.mqttPublishTopics,)
 	return m
@@ -135,6 +193,7 @@ func main() {
 
 	// Start socket listener
 	go listenForMetrics("/tmp/tarpit_exporter.sock", m)
+	go consumeRings(m)
 
 	// HTTP handler
 	http.Handle("/metrics", promhttp.Handler())
@@ -154,25 +213,48 @@ func listenForMetrics(socketPath string, metrics *metrics) {
 	}
 	defer conn.Close()
 
-	buf := make([]byte, 1024)
+	// Servers batch several binary records, or newline separated text metrics, into one datagram
+	buf := make([]byte, 65536)
 	for {
 		n, _, err := conn.ReadFrom(buf)
 		if err != nil {
 			log.Println("Read error:", err)
 			continue
 		}
-		handleMetric(strings.TrimSpace(string(buf[:n])), metrics)
+		metricsMutex.Lock()
+		if !handleDatagram(buf[:n], metrics) {
+			for _, line := range strings.Split(string(buf[:n]), "\n") {
+				line = strings.TrimSpace(line)
+				if line != "" {
+					handleMetric(line, metrics)
+				}
+			}
+		}
+		metricsMutex.Unlock()
 	}
 }
 
 func handleMetric(line string, metrics *metrics) {
 	fields := strings.Fields(line)
 	log.Println(fields)
+	if len(fields) < 2 {
+		return
+	}
 
 	server := fields[0]
 	command := fields[1]
 
 	switch command {
+	case "metricsDropped":
+		if len(fields) < 3 {
+			return
+		}
+		count, err := strconv.ParseUint(fields[2], 10, 64)
+		if err != nil {
+			fmt.Println("Error parsing metricsDropped:", err)
+			return
+		}
+		metrics.metricsDropped.WithLabelValues(server).Add(float64(count))
 	case "connect":
 		ip := fields[2]
 		country := geoLookup(ip)
@@ -298,8 +380,10 @@ func parseTimeMs(s string) int64 {
 }
 
 func geoLookup(ipStr string) string {
-    ip := netip.MustParseAddr(ipStr)
+    return geoLookupAddr(netip.MustParseAddr(ipStr))
+}
 
+func geoLookupAddr(ip netip.Addr) string {
 	var record struct {
 		Country struct {
 			ISOCode string `maxminddb:"iso_code"`
@@ -0,0 +1,178 @@
+package main
+
+import (
+	"encoding/binary"
+	"log"
+	"os"
+	"path/filepath"
+	"sync/atomic"
+	"syscall"
+	"time"
+	"unsafe"
+)
+
+// Shared memory rings written by shared/metricring.c, see shared/metricring.h for the layout
+const (
+	ringDir          = "/tmp"
+	ringPattern      = "tarpit_ring_*"
+	ringMagic        = 0x47525054
+	ringVersion      = 1
+	ringHeaderSize   = 192
+	ringHeadOffset   = 64
+	ringTailOffset   = 128
+	ringPollInterval = 20 * time.Millisecond
+	ringScanInterval = time.Second // How often new and removed ring files are looked for
+)
+
+type ring struct {
+	name         string
+	inode        uint64 // A pit restarted with the same pid reuses the name, but not the file
+	mem          []byte
+	data         []byte
+	capacity     uint64
+	pit          byte
+	head         *uint64
+	tail         *uint64
+	overruns     *uint64
+	lastOverruns uint64
+}
+
+func inodeOf(info os.FileInfo) uint64 {
+	if stat, ok := info.Sys().(*syscall.Stat_t); ok {
+		return stat.Ino
+	}
+	return 0
+}
+
+func openRing(path string) (*ring, error) {
+	f, err := os.OpenFile(path, os.O_RDWR, 0)
+	if err != nil {
+		return nil, err
+	}
+	defer f.Close()
+
+	info, err := f.Stat()
+	if err != nil {
+		return nil, err
+	}
+	if info.Size() < ringHeaderSize {
+		return nil, nil // Still being created
+	}
+	mem, err := syscall.Mmap(int(f.Fd()), 0, int(info.Size()), syscall.PROT_READ|syscall.PROT_WRITE, syscall.MAP_SHARED)
+	if err != nil {
+		return nil, err
+	}
+
+	magic := atomic.LoadUint32((*uint32)(unsafe.Pointer(&mem[0])))
+	capacity := binary.LittleEndian.Uint64(mem[8:])
+	if magic != ringMagic || mem[4] != ringVersion || capacity == 0 ||
+		uint64(len(mem)) < ringHeaderSize+capacity || int(mem[5]) >= len(pitNames) || mem[5] == 0 {
+		syscall.Munmap(mem)
+		return nil, nil // Not ready yet, or not a ring we understand
+	}
+
+	return &ring{
+		name:     filepath.Base(path),
+		inode:    inodeOf(info),
+		mem:      mem,
+		data:     mem[ringHeaderSize : ringHeaderSize+capacity],
+		capacity: capacity,
+		pit:      mem[5],
+		head:     (*uint64)(unsafe.Pointer(&mem[ringHeadOffset])),
+		tail:     (*uint64)(unsafe.Pointer(&mem[ringTailOffset])),
+		overruns: (*uint64)(unsafe.Pointer(&mem[16])),
+	}, nil
+}
+
+// drain handles every published record and hands the space back to the pit
+func (r *ring) drain(metrics *metrics) {
+	head := atomic.LoadUint64(r.head)
+	tail := atomic.LoadUint64(r.tail)
+	server := pitNames[r.pit]
+	metrics.ringOccupancy.WithLabelValues(server, r.name).Set(float64(head - tail))
+
+	p := pitFor(r.pit, metrics)
+	for tail < head {
+		pos := tail & (r.capacity - 1)
+		length := uint64(binary.LittleEndian.Uint16(r.data[pos:]))
+		if length == 0 {
+			tail += r.capacity - pos // Padding up to the end of the data area
+			continue
+		}
+		if length < 3 || pos+length > r.capacity {
+			log.Println("Corrupt record in metric ring", r.name)
+			tail = head
+			break
+		}
+		record := wireReader{buf: r.data[:pos+length], pos: int(pos) + 3, ok: true}
+		handleRecord(r.pit, p, r.data[pos+2], &record, metrics)
+		tail += (length + 3) &^ 3
+	}
+	atomic.StoreUint64(r.tail, tail)
+
+	overruns := atomic.LoadUint64(r.overruns)
+	if overruns > r.lastOverruns {
+		metrics.ringOverruns.WithLabelValues(server).Add(float64(overruns - r.lastOverruns))
+		r.lastOverruns = overruns
+	}
+}
+
+func (r *ring) close(metrics *metrics) {
+	metrics.ringOccupancy.DeleteLabelValues(pitNames[r.pit], r.name)
+	metrics.ringCapacity.DeleteLabelValues(pitNames[r.pit], r.name)
+	syscall.Munmap(r.mem)
+}
+
+// consumeRings polls the ring files of all pits. Pits remove the files of their previous
+// run on startup, a removed file is drained one last time and unmapped
+func consumeRings(metrics *metrics) {
+	rings := map[string]*ring{}
+	lastScan := time.Time{}
+	for {
+		// The decoder shares its caches with the socket listener
+		metricsMutex.Lock()
+		if time.Since(lastScan) >= ringScanInterval {
+			lastScan = time.Now()
+			paths, _ := filepath.Glob(filepath.Join(ringDir, ringPattern))
+			present := map[string]bool{}
+			for _, path := range paths {
+				info, err := os.Stat(path)
+				if err != nil {
+					continue
+				}
+				if r, ok := rings[path]; ok {
+					if r.inode == inodeOf(info) {
+						present[path] = true
+						continue
+					}
+					r.drain(metrics)
+					r.close(metrics)
+					delete(rings, path)
+				}
+				present[path] = true
+				r, err := openRing(path)
+				if err != nil {
+					log.Println("Failed opening metric ring:", err)
+					continue
+				}
+				if r != nil {
+					rings[path] = r
+					metrics.ringCapacity.WithLabelValues(pitNames[r.pit], r.name).Set(float64(r.capacity))
+				}
+			}
+			for path, r := range rings {
+				if !present[path] {
+					r.drain(metrics)
+					r.close(metrics)
+					delete(rings, path)
+				}
+			}
+		}
+
+		for _, r := range rings {
+			r.drain(metrics)
+		}
+		metricsMutex.Unlock()
+		time.Sleep(ringPollInterval)
+	}
+}
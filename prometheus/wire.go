@@ -0,0 +1,372 @@
+package main
+
+import (
+	"encoding/binary"
+	"log"
+	"net/netip"
+	"strconv"
+	"sync"
+
+	"github.com/prometheus/client_golang/prometheus"
+)
+
+// Binary metric format written by shared/metrics.c, see shared/metrics.h for the layout
+const (
+	wireMagic     = 0xE7
+	wireVersion   = 1
+	wireStringRef = 0xFF
+	maxInterned   = 65536 // Distinct label strings kept by internString
+)
+
+const (
+	eventConnect = iota + 1
+	eventDisconnect
+	eventDropped
+	eventUpnpOtherHttp
+	eventUpnpMSearch
+	eventUpnpNonMSearch
+	eventMqttConnect
+	eventMqttMalformedConnect
+	eventMqttSubscribe
+	eventMqttCredentials
+	eventMqttPublish
+	eventMqttConnack
+	eventMqttUnsubscribe
+	eventMqttPubrec
+	eventHistogram
+	eventPacing
+	eventUpnpSsdp
+)
+
+var pitNames = []string{"", "Telnet", "UPnP", "MQTT", "CoAP", "SSH"}
+
+// Counters that only depend on the pit, resolved once instead of per event
+type pitMetrics struct {
+	connects      prometheus.Counter
+	trappedTime   prometheus.Counter
+	activeClients prometheus.Gauge
+	dropped       prometheus.Counter
+	clients       map[string]prometheus.Counter // By country
+	// Efficiency of the trickling loops, totals kept for the ratios
+	pacedMs         float64
+	sentBytes       float64
+	cpuUs           float64
+	pacedTrapped    prometheus.Counter
+	sends           prometheus.Counter
+	bytes           prometheus.Counter
+	cpu             prometheus.Counter
+	trappedPerCpu   prometheus.Gauge
+	trappedPerKByte prometheus.Gauge
+}
+
+var pits = map[byte]*pitMetrics{}
+
+// Held while decoding, the socket listener and the ring consumer share the caches below
+var metricsMutex sync.Mutex
+
+// Label strings repeat a lot (credentials, topics), so keep one copy of each
+var interned = map[string]string{}
+
+func internString(b []byte) string {
+	if s, ok := interned[string(b)]; ok {
+		return s
+	}
+	s := string(b)
+	if len(interned) < maxInterned {
+		interned[s] = s
+	}
+	return s
+}
+
+func pitFor(pit byte, metrics *metrics) *pitMetrics {
+	if p, ok := pits[pit]; ok {
+		return p
+	}
+	name := pitNames[pit]
+	p := &pitMetrics{
+		connects:      metrics.totalConnects.WithLabelValues(name),
+		trappedTime:   metrics.totalTrappedTime.WithLabelValues(name),
+		activeClients: metrics.activeClients.WithLabelValues(name),
+		dropped:       metrics.metricsDropped.WithLabelValues(name),
+		clients:       map[string]prometheus.Counter{},
+
+		pacedTrapped:    metrics.pacedTrapped.WithLabelValues(name),
+		sends:           metrics.sends.WithLabelValues(name),
+		bytes:           metrics.sentBytes.WithLabelValues(name),
+		cpu:             metrics.loopCpu.WithLabelValues(name),
+		trappedPerCpu:   metrics.trappedPerCpu.WithLabelValues(name),
+		trappedPerKByte: metrics.trappedPerKByte.WithLabelValues(name),
+	}
+	pits[pit] = p
+	return p
+}
+
+type wireReader struct {
+	buf     []byte
+	pos     int
+	strings []string // Strings of the current datagram, for references
+	ok      bool
+}
+
+func (r *wireReader) u8() byte {
+	if r.pos+1 > len(r.buf) {
+		r.ok = false
+		return 0
+	}
+	v := r.buf[r.pos]
+	r.pos++
+	return v
+}
+
+func (r *wireReader) u32() uint32 {
+	if r.pos+4 > len(r.buf) {
+		r.ok = false
+		return 0
+	}
+	v := binary.LittleEndian.Uint32(r.buf[r.pos:])
+	r.pos += 4
+	return v
+}
+
+func (r *wireReader) u64() uint64 {
+	if r.pos+8 > len(r.buf) {
+		r.ok = false
+		return 0
+	}
+	v := binary.LittleEndian.Uint64(r.buf[r.pos:])
+	r.pos += 8
+	return v
+}
+
+func (r *wireReader) addr() netip.Addr {
+	var size int
+	switch r.u8() {
+	case 4:
+		size = 4
+	case 6:
+		size = 16
+	default:
+		return netip.Addr{}
+	}
+	if r.pos+size > len(r.buf) {
+		r.ok = false
+		return netip.Addr{}
+	}
+	addr, _ := netip.AddrFromSlice(r.buf[r.pos : r.pos+size])
+	r.pos += size
+	return addr
+}
+
+func (r *wireReader) str() string {
+	length := int(r.u8())
+	if length == wireStringRef {
+		index := int(r.u8())
+		if index >= len(r.strings) {
+			r.ok = false
+			return ""
+		}
+		return r.strings[index]
+	}
+	if r.pos+length > len(r.buf) {
+		r.ok = false
+		return ""
+	}
+	s := internString(r.buf[r.pos : r.pos+length])
+	r.pos += length
+	if length > 2 {
+		r.strings = append(r.strings, s) // Same rule as the encoder
+	}
+	return s
+}
+
+// handleDatagram decodes a binary datagram. It returns false for text datagrams from older pits.
+// Every string of known events must be read, otherwise string references get out of step
+func handleDatagram(buf []byte, metrics *metrics) bool {
+	if len(buf) < 3 || buf[0] != wireMagic {
+		return false
+	}
+	if buf[1] != wireVersion {
+		log.Println("Unsupported metric format version:", buf[1])
+		return true
+	}
+	pit := buf[2]
+	if int(pit) >= len(pitNames) || pit == 0 {
+		log.Println("Unknown pit:", pit)
+		return true
+	}
+	p := pitFor(pit, metrics)
+
+	r := wireReader{buf: buf, pos: 3, ok: true}
+	for r.pos+3 <= len(buf) {
+		length := int(binary.LittleEndian.Uint16(buf[r.pos:]))
+		end := r.pos + length
+		if length < 3 || end > len(buf) {
+			log.Println("Truncated metric record")
+			return true
+		}
+		event := buf[r.pos+2]
+		record := wireReader{buf: buf[:end], pos: r.pos + 3, strings: r.strings, ok: true}
+		handleRecord(pit, p, event, &record, metrics)
+		r.strings = record.strings
+		r.pos = end
+	}
+	return true
+}
+
+func handleRecord(pit byte, p *pitMetrics, event byte, r *wireReader, metrics *metrics) {
+	switch event {
+	case eventConnect:
+		addr := r.addr()
+		if !r.ok || !addr.IsValid() {
+			return
+		}
+		country := geoLookupAddr(addr)
+		clients, ok := p.clients[country]
+		if !ok {
+			lat := CapitalCoordinates[country].Latitude
+			lon := CapitalCoordinates[country].Longitude
+			clients = metrics.clients.WithLabelValues(pitNames[pit], country,
+				strconv.FormatFloat(lat, 'f', 6, 64), strconv.FormatFloat(lon, 'f', 6, 64))
+			p.clients[country] = clients
+		}
+		p.connects.Inc()
+		p.activeClients.Inc()
+		clients.Inc()
+	case eventDisconnect:
+		r.addr()
+		timeTrapped := int64(r.u64())
+		if !r.ok {
+			return
+		}
+		if timeTrapped < 0 {
+			log.Println("Negative time trapped:", timeTrapped)
+			return
+		}
+		p.activeClients.Dec()
+		p.trappedTime.Add(float64(timeTrapped))
+	case eventDropped:
+		count := r.u64()
+		if r.ok {
+			p.dropped.Add(float64(count))
+		}
+	// UPnP
+	case eventUpnpOtherHttp:
+		method := r.str()
+		url := r.str()
+		if method == "" {
+			method = " "
+		}
+		if url == "" {
+			url = " "
+		}
+		if r.ok {
+			metrics.upnpOtherHttpRequests.WithLabelValues(method, url).Inc()
+		}
+	case eventUpnpMSearch, eventUpnpNonMSearch:
+		addr := r.addr()
+		if !r.ok {
+			return
+		}
+		if event == eventUpnpMSearch {
+			metrics.upnpMSearchRequests.WithLabelValues(addr.String()).Inc()
+		} else {
+			metrics.upnpNonMSearchRequests.WithLabelValues(addr.String()).Inc()
+		}
+	// MQTT
+	case eventMqttConnect:
+		version := r.str()
+		if r.ok {
+			metrics.mqttConnectVersions.WithLabelValues(version).Inc()
+		}
+	case eventMqttMalformedConnect:
+		metrics.mqttMalformedConnect.Inc()
+	case eventMqttSubscribe, eventMqttPublish:
+		topic := r.str()
+		qos := r.u8()
+		if !r.ok {
+			return
+		}
+		if event == eventMqttSubscribe {
+			metrics.mqttSubscribeTopics.WithLabelValues(topic, qosLabels[qos&0b11]).Inc()
+		} else {
+			metrics.mqttPublishTopics.WithLabelValues(topic, qosLabels[qos&0b11]).Inc()
+		}
+	case eventMqttCredentials:
+		username := r.str()
+		password := r.str()
+		if username == "" {
+			username = " "
+		}
+		if password == "" {
+			password = " "
+		}
+		if r.ok {
+			metrics.mqttCredentials.WithLabelValues(username, password).Inc()
+		}
+	case eventMqttConnack:
+		metrics.mqttConacks.Inc()
+	case eventMqttUnsubscribe:
+		r.str() // Read so later references in the datagram stay in step
+		metrics.mqttUnsubscribe.Inc()
+	case eventMqttPubrec:
+		metrics.mqttPubrec.Inc()
+	// Loop histograms of every pit
+	case eventHistogram:
+		kind := r.u8()
+		sum := r.u64()
+		buckets := int(r.u8())
+		if !r.ok || r.pos+buckets*5 > len(r.buf) {
+			return
+		}
+		h := metrics.loopHistograms.get(pit, kind)
+		if h == nil {
+			return
+		}
+		for i := 0; i < buckets; i++ {
+			bucket := int(r.u8())
+			count := uint64(r.u32())
+			if bucket < histogramBuckets {
+				h.counts[bucket] += count
+				h.count += count
+			}
+		}
+		h.sum += float64(sum)
+	case eventPacing:
+		trappedMs := r.u64()
+		sends := r.u64()
+		bytes := r.u64()
+		cpuUs := r.u64()
+		if !r.ok {
+			return
+		}
+		p.pacedTrapped.Add(float64(trappedMs) / 1000)
+		p.sends.Add(float64(sends))
+		p.bytes.Add(float64(bytes))
+		p.cpu.Add(float64(cpuUs) / 1e6)
+		p.pacedMs += float64(trappedMs)
+		p.sentBytes += float64(bytes)
+		p.cpuUs += float64(cpuUs)
+		if p.cpuUs > 0 {
+			p.trappedPerCpu.Set(p.pacedMs * 1000 / p.cpuUs)
+		}
+		if p.sentBytes > 0 {
+			p.trappedPerKByte.Set(p.pacedMs / p.sentBytes)
+		}
+	case eventUpnpSsdp:
+		var counts [len(ssdpKinds)]uint64
+		for i := range counts {
+			counts[i] = r.u64()
+		}
+		if !r.ok {
+			return
+		}
+		for i, kind := range ssdpKinds {
+			metrics.upnpSsdpDatagrams.WithLabelValues(kind).Add(float64(counts[i]))
+		}
+	}
+}
+
+var qosLabels = [4]string{"0", "1", "2", "3"}
+
+// Counts of an SSDP batch, in the order of the record
+var ssdpKinds = [5]string{"received", "m_search", "non_m_search", "answered", "rate_limited"}
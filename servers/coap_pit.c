@@ -3,7 +3,6 @@
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
-#include <poll.h>
 #include <sys/time.h>
 #include <limits.h>
 #include <fcntl.h>
@@ -28,20 +27,59 @@
 struct coapClient *clients = NULL;
 
 int port = 5683;
-int timeout = -1;
 int delay = 1000;
 int ACK_TIMEOUT = 2000;
 int MAX_RETRANSMIT = 4;
 int maxNoClients = 4096;
 int sockFd;
+struct eventLoop loop;
+struct eventHandler sockHandler;
+struct slabPool clientPool;
+struct admission admission;
+struct coapClient *sampleCursor; // Where the next eviction starts sampling, NULL for the first client
 
 void addClient(struct coapClient *client) {
     HASH_ADD(hh, clients, clientAddr, sizeof(struct sockaddr_in), client);
+    admission_add(&admission, client->prefix, sizeof(struct coapClient));
 }
 
 void deleteClient(struct coapClient *client) {
+    if (sampleCursor == client) sampleCursor = client->hh.next;
+    admission_remove(&admission, client->prefix, sizeof(struct coapClient));
     HASH_DEL(clients, client);
-    free(client);
+    slab_free(&clientPool, client);
+}
+
+// Evicts a client if the pit is out of budget. The victim is picked from a few clients
+// in a row, starting where the last eviction stopped. Returns false if the new client
+// has to be turned away
+bool makeRoom() {
+    if (admission_fits(&admission, sizeof(struct coapClient))) return true;
+
+    struct coapClient *victim = NULL;
+    struct admissionCandidate best;
+    if (admission.policy != EVICT_NONE && clients != NULL) {
+        struct coapClient *c = sampleCursor != NULL ? sampleCursor : clients;
+        for (int sampled = 0; sampled < ADMISSION_SAMPLES; sampled++) {
+            struct admissionCandidate candidate = {c->prefix, c->base.timeConnected};
+            if (admission_prefer(&admission, &candidate, victim == NULL ? NULL : &best)) {
+                best = candidate;
+                victim = c;
+            }
+            c = c->hh.next != NULL ? c->hh.next : clients;
+        }
+        sampleCursor = c;
+    }
+    if (victim == NULL) {
+        admission_refused(&admission);
+        return false;
+    }
+    admission_evicted(&admission);
+    printf("%s disconnect %s %lld\n", SERVER_ID, victim->base.ipaddr, victim->base.timeConnected);
+    metric_disconnect(victim->base.ipaddr, victim->base.timeConnected);
+    timerwheel_cancel(&clientQueueCoap, &victim->base.timer);
+    deleteClient(victim);
+    return true;
 }
 
 struct coapClient *findExistingClient(struct sockaddr_in *addr) {
@@ -119,8 +157,185 @@ int sendPing(uint16_t messageId, struct sockaddr_in* addr, socklen_t addrLen) {
     return sendto(sockFd, ping, sizeof(ping), 0, (struct sockaddr *)addr, addrLen);
 }
 
+// Called when a client is due for its next block or retransmit
+void onClientDue(struct eventLoop *loop, struct timerNode *node, long long now) {
+    (void)loop;
+    struct baseClient *bc = timer_entry(node, struct baseClient, timer);
+    struct coapClient *c = (struct coapClient *)bc;
+    
+    // Handle retransmits
+    if(!c->receivedAck || !c->receivedRst) {
+        if(c->retransmits < MAX_RETRANSMIT) {
+            long long retransmitAt = now + (ACK_TIMEOUT << (c->retransmits));
+            c->base.timeConnected += (ACK_TIMEOUT << (c->retransmits));
+            c->retransmits += 1;
+
+            if(!c->receivedAck) {
+                sendCoapBlockResponse(c->messageId, c->token, c->tkl, &c->blockNumber, &c->clientAddr, c->addrLen);
+            } else {
+                sendPing(c->messageId, &c->clientAddr, c->addrLen);
+            }
+
+            // printf("Token contents: ");
+            // for (int i = 0; i < 8; i++) {
+            //     printf("%u ", c->token[i]);
+            // }
+            // printf("\n");
+            // printf("Sent block2 due to not receiving an ACK with out=%d messageId=%u tkl=%d blockNumber=%d\n", out, c->messageId, c->tkl, c->blockNumber);
+            client_schedule(&clientQueueCoap, &c->base, retransmitAt);
+            return;
+        } else {
+            // Disconnect client
+            long long timeTrapped = c->base.timeConnected - (ACK_TIMEOUT * ((0b1 << MAX_RETRANSMIT) - 1));
+            printf("%s disconnect %s %lld\n", SERVER_ID, c->base.ipaddr, timeTrapped);
+            metric_disconnect(c->base.ipaddr, timeTrapped);
+            deleteClient(c);
+            return;
+        }
+    } 
+    
+    if (c->receivedGet) {
+        sendCoapBlockResponse(c->messageId, c->token, c->tkl, &c->blockNumber, &c->clientAddr, c->addrLen);
+        c->blockNumber += 1;
+        c->receivedAck = false;
+    } else if (c->receivedRst) {
+        sendPing(c->messageId, &c->clientAddr, c->addrLen);
+        c->receivedRst = false;
+    } 
+    
+    c->base.timeConnected += delay;
+    c->messageId += 1;
+    client_schedule(&clientQueueCoap, &c->base, now + delay);
+}
+
+void onCoapRequest(struct eventLoop *loop, struct eventHandler *handler, uint32_t events) {
+    (void)events;
+    struct sockaddr_in clientAddr;
+    socklen_t addrLen = sizeof(clientAddr);
+    char buffer[1024];
+
+    int len = recvfrom(handler->fd, buffer, MAX_BUF_LEN, 0, (struct sockaddr *)&clientAddr, &addrLen);
+    if(len < 4) {
+        // Too short or something went wrong
+        return;
+    }
+
+    uint8_t version = (buffer[0] >> 6) & 0b11;
+    uint8_t type = (buffer[0] >> 4) & 0b11;
+    uint8_t code = buffer[1];
+    uint8_t class = (code >> 5) & 0b111;
+    uint8_t detail = code & 0b11111;
+    uint8_t tkl = buffer[0] & 0b1111;
+    uint16_t msgId = (buffer[2] << 8) | buffer[3];
+    uint8_t token[8] = {0};
+
+    printf("Incoming request from %s:%d\n", inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port));
+
+    // Header fields
+    printf("Header:\n");
+    printf("  Version : %u\n", version);
+    printf("  Type    : %u\n", type);
+    printf("  TKL     : %u\n", tkl);
+    printf("  Code    : 0x%02X (Class: %u, Detail: %u)\n", code, class, detail);
+    printf("  Msg ID  : %u\n", msgId);
+    
+    // Token (if any)
+    printf("  Token   : ");
+    for (int i = 0; i < tkl; i++) {
+        printf("%02X ", buffer[4 + i]);
+    }
+    if (tkl == 0) {
+        printf("(none)");
+    }
+    printf("\n");
+
+    if (tkl > 8 || len < 4 + tkl) {
+        // Malformed request. Send 4.00 Bad Request
+        uint8_t response[4];
+        uint8_t resp_type = (type == TYPE_CONFIRMABLE) ? TYPE_ACK : TYPE_NON_CONFIRMABLE;
+    
+        response[0] = (0b01 << 6) | (resp_type << 4) | 0; // Ver=1, Type=ACK/NON, TKL=0
+        response[1] = (0b100 << 5) | 0b0;                 // Code 4.00 (Bad Request)
+        response[2] = msgId >> 8;
+        response[3] = msgId & 0b11111111;
+        int resp_len = 4;
+
+        sendto(sockFd, response, resp_len, 0, (struct sockaddr *)&clientAddr, addrLen);
+        return;
+    } 
+    else if (version != 1){
+        // Must be silently ignored
+        return;
+    } else if (tkl > 0) {
+        memcpy(token, &buffer[4], tkl);
+    }
+
+    // TODO: Ignore extended methods (send "method not allowed" response)
+    // TODO: Handle requests while the client is still receiving blocks. 
+    struct coapClient* client = findExistingClient(&clientAddr);
+    if(client == NULL) {
+        if (!makeRoom()) {
+            fprintf(stderr, "Client limit reached. Can't add any more clients\n");
+            return;
+        }
+        client = slab_alloc(&clientPool);
+        if (!client) {
+            fprintf(stderr, "Out of memory");
+            return;
+        }
+
+        // Records are recycled, nothing of the previous client may carry over
+        memset(client, 0, sizeof(*client));
+        client->clientAddr = clientAddr;
+        client->addrLen = addrLen;
+        client->base.type = COAP_CLIENT;
+        client->base.timeConnected = 0;
+        timerwheel_node_init(&client->base.timer);
+        client->blockNumber = 0;
+        client->tkl = tkl;
+        client->retransmits = 0;
+        client->messageId = 1;
+        client->receivedAck = true;
+        client->receivedRst = true;
+        memcpy(client->token, token, 8);
+        snprintf(client->base.ipaddr, INET_ADDRSTRLEN, "%s", inet_ntoa(clientAddr.sin_addr));
+        client->prefix = addressPrefix(client->base.ipaddr);
+        client_schedule(&clientQueueCoap, &client->base, loop->now + delay);
+        addClient(client);
+
+        printf("%s connect %s\n", SERVER_ID, client->base.ipaddr);
+        metric_address(METRIC_CONNECT, client->base.ipaddr);
+    }
+    
+    if (type == TYPE_RST) {
+        client->receivedRst = true;
+    }
+    else if (type == TYPE_ACK) {
+        client->receivedAck = true;
+        client->retransmits = 0;
+    }
+    else if (class == CLASS_REQUEST && detail == DETAIL_GET) {
+        printf("GET request from %s of type %d with tkl=%d and msgId1=%u\n", inet_ntoa(clientAddr.sin_addr), type, tkl, msgId);
+        client->receivedGet = true;
+    } 
+
+    // If a CON (Confirmable) request, first send seperate ACK response. 
+    // The response does not need to be confirmable. (5.2.2 and 5.2.3)
+    if (type == TYPE_CONFIRMABLE) {
+        uint8_t ack[4];
+        ack[0] = (0b01 << 6) | (0b10 << 4) | 0;   // Version = 1, Type = ACK (2), TKL = 0
+        ack[1] = 0;                               // Code = 0.00 (empty ACK)
+        ack[2] = buffer[2];                       // Same Message ID MSB
+        ack[3] = buffer[3];                       // Same Message ID LSB
+
+        int out = sendto(sockFd, ack, sizeof(ack), 0, (struct sockaddr *)&clientAddr, addrLen);
+        printf("ACK sendto: %d with messageId=%u\n", out, msgId);
+    }
+}
+
 int main(int argc, char* argv[]) {
     setbuf(stdout, NULL);
+    metrics_init(PIT_COAP);
 
     // testing
     // char msg[256];
@@ -139,10 +354,12 @@ int main(int argc, char* argv[]) {
     ACK_TIMEOUT = atoi(argv[3]);
     MAX_RETRANSMIT = atoi(argv[4]);
     maxNoClients = atoi(argv[5]);
+    admission_init(&admission, SERVER_ID, maxNoClients);
     struct sockaddr_in serverAddr;
-    heap_init(&clientQueueCoap, maxNoClients);
+    timerwheel_init(&clientQueueCoap, currentTimeMs());
+    slab_init(&clientPool, SERVER_ID, sizeof(struct coapClient), SLAB_CHUNK_OBJECTS);
 
-    if ((sockFd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+    if ((sockFd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0) {
         fprintf(stderr, "SSDP Socket creation failed");
         exit(EXIT_FAILURE);
     }
@@ -167,199 +384,14 @@ int main(int argc, char* argv[]) {
 
     printf("CoAP listener started on port %d\n", port);
 
-    struct pollfd pollFd;
-    memset(&pollFd, 0, sizeof(pollFd));
-    pollFd.fd = sockFd;
-    pollFd.events = POLLIN;
-
-    while (1) {
-        long long now = currentTimeMs();
-
-        while (clientQueueCoap.size > 0) {
-            if(clientQueueCoap.heapArray[0]->sendNext <= now){
-                struct baseClient *bc = heap_pop(&clientQueueCoap);
-                struct coapClient *c = (struct coapClient *)bc;
-                
-                // Handle retransmits
-                if(!c->receivedAck || !c->receivedRst) {
-                    if(c->retransmits < MAX_RETRANSMIT) {
-                        c->base.sendNext = now + (ACK_TIMEOUT << (c->retransmits));
-                        c->base.timeConnected += (ACK_TIMEOUT << (c->retransmits));
-                        c->retransmits += 1;
-
-                        if(!c->receivedAck) {
-                            sendCoapBlockResponse(c->messageId, c->token, c->tkl, &c->blockNumber, &c->clientAddr, c->addrLen);
-                        } else {
-                            sendPing(c->messageId, &c->clientAddr, c->addrLen);
-                        }
-
-                        // printf("Token contents: ");
-                        // for (int i = 0; i < 8; i++) {
-                        //     printf("%u ", c->token[i]);
-                        // }
-                        // printf("\n");
-                        // printf("Sent block2 due to not receiving an ACK with out=%d messageId=%u tkl=%d blockNumber=%d\n", out, c->messageId, c->tkl, c->blockNumber);
-                        heap_insert(&clientQueueCoap, (struct baseClient *)c);
-                        continue;
-                    } else {
-                        // Disconnect client
-                        long long timeTrapped = c->base.timeConnected - (ACK_TIMEOUT * ((0b1 << MAX_RETRANSMIT) - 1));
-                        char msg[256];
-                        snprintf(msg, sizeof(msg), "%s disconnect %s %lld\n",
-                            SERVER_ID, c->base.ipaddr, timeTrapped);
-                        printf("%s", msg);
-                        sendMetric(msg);
-                        deleteClient(c);
-                        continue;
-                    }
-                } 
-                
-                if (c->receivedGet) {
-                    sendCoapBlockResponse(c->messageId, c->token, c->tkl, &c->blockNumber, &c->clientAddr, c->addrLen);
-                    c->blockNumber += 1;
-                    c->receivedAck = false;
-                } else if (c->receivedRst) {
-                    sendPing(c->messageId, &c->clientAddr, c->addrLen);
-                    c->receivedRst = false;
-                } 
-                
-                c->base.timeConnected += delay;
-                c->messageId += 1;
-                c->base.sendNext = now + delay;
-                heap_insert(&clientQueueCoap, (struct baseClient *)c);
-            } else {
-                timeout = clientQueueCoap.heapArray[0]->sendNext - now;
-                break;
-            }
-        }
-
-        int pollResult = poll(&pollFd, 1, timeout);
-        now = currentTimeMs();
-        if (pollResult < 0) {
-            fprintf(stderr, "Poll error with error %s", strerror(errno));
-            continue;
-        }
-
-        if (pollFd.revents & POLLIN) {
-            struct sockaddr_in clientAddr;
-            socklen_t addrLen = sizeof(clientAddr);
-            char buffer[1024];
-
-            int len = recvfrom(sockFd, buffer, MAX_BUF_LEN, 0, (struct sockaddr *)&clientAddr, &addrLen);
-            if(len < 4) {
-                // Too short or something went wrong
-                continue;
-            }
-
-            uint8_t version = (buffer[0] >> 6) & 0b11;
-            uint8_t type = (buffer[0] >> 4) & 0b11;
-            uint8_t code = buffer[1];
-            uint8_t class = (code >> 5) & 0b111;
-            uint8_t detail = code & 0b11111;
-            uint8_t tkl = buffer[0] & 0b1111;
-            uint16_t msgId = (buffer[2] << 8) | buffer[3];
-            uint8_t token[8] = {0};
-
-            printf("Incoming request from %s:%d\n", inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port));
-
-            // Header fields
-            printf("Header:\n");
-            printf("  Version : %u\n", version);
-            printf("  Type    : %u\n", type);
-            printf("  TKL     : %u\n", tkl);
-            printf("  Code    : 0x%02X (Class: %u, Detail: %u)\n", code, class, detail);
-            printf("  Msg ID  : %u\n", msgId);
-            
-            // Token (if any)
-            printf("  Token   : ");
-            for (int i = 0; i < tkl; i++) {
-                printf("%02X ", buffer[4 + i]);
-            }
-            if (tkl == 0) {
-                printf("(none)");
-            }
-            printf("\n");
-
-            if (tkl > 8 || len < 4 + tkl) {
-                // Malformed request. Send 4.00 Bad Request
-                uint8_t response[4];
-                uint8_t resp_type = (type == TYPE_CONFIRMABLE) ? TYPE_ACK : TYPE_NON_CONFIRMABLE;
-            
-                response[0] = (0b01 << 6) | (resp_type << 4) | 0; // Ver=1, Type=ACK/NON, TKL=0
-                response[1] = (0b100 << 5) | 0b0;                 // Code 4.00 (Bad Request)
-                response[2] = msgId >> 8;
-                response[3] = msgId & 0b11111111;
-                int resp_len = 4;
-
-                sendto(sockFd, response, resp_len, 0, (struct sockaddr *)&clientAddr, addrLen);
-                continue;
-            } 
-            else if (version != 1){
-                // Must be silently ignored
-                continue;
-            } else if (tkl > 0) {
-                memcpy(token, &buffer[4], tkl);
-            }
-
-            // TODO: Ignore extended methods (send "method not allowed" response)
-            // TODO: Handle requests while the client is still receiving blocks. 
-            struct coapClient* client = findExistingClient(&clientAddr);
-            if(client == NULL) {
-                client = malloc(sizeof(struct coapClient));
-                if (!client) {
-                    fprintf(stderr, "Out of memory");
-                    continue;
-                }
-
-                client->clientAddr = clientAddr;
-                client->addrLen = addrLen;
-                client->base.sendNext = now + delay;
-                client->base.timeConnected = 0;
-                client->blockNumber = 0;
-                client->tkl = tkl;
-                client->retransmits = 0;
-                client->messageId = 1;
-                client->receivedAck = true;
-                client->receivedRst = true;
-                memcpy(client->token, token, 8);
-                snprintf(client->base.ipaddr, INET_ADDRSTRLEN, "%s", inet_ntoa(clientAddr.sin_addr));
-                heap_insert(&clientQueueCoap, (struct baseClient*)client);
-                addClient(client);
-
-                char msg[256];
-                snprintf(msg, sizeof(msg), "%s connect %s\n",
-                    SERVER_ID, client->base.ipaddr);
-                printf("%s", msg);
-                sendMetric(msg);
-            }
-            
-            if (type == TYPE_RST) {
-                client->receivedRst = true;
-            }
-            else if (type == TYPE_ACK) {
-                client->receivedAck = true;
-                client->retransmits = 0;
-            }
-            else if (class == CLASS_REQUEST && detail == DETAIL_GET) {
-                printf("GET request from %s of type %d with tkl=%d and msgId1=%u\n", inet_ntoa(clientAddr.sin_addr), type, tkl, msgId);
-                client->receivedGet = true;
-            } 
-
-            // If a CON (Confirmable) request, first send seperate ACK response. 
-            // The response does not need to be confirmable. (5.2.2 and 5.2.3)
-            if (type == TYPE_CONFIRMABLE) {
-                uint8_t ack[4];
-                ack[0] = (0b01 << 6) | (0b10 << 4) | 0;   // Version = 1, Type = ACK (2), TKL = 0
-                ack[1] = 0;                               // Code = 0.00 (empty ACK)
-                ack[2] = buffer[2];                       // Same Message ID MSB
-                ack[3] = buffer[3];                       // Same Message ID LSB
-
-                int out = sendto(sockFd, ack, sizeof(ack), 0, (struct sockaddr *)&clientAddr, addrLen);
-                printf("ACK sendto: %d with messageId=%u\n", out, msgId);
-            }
-        }
+    eventloop_init(&loop, 1, &clientQueueCoap, onClientDue);
+    if (eventloop_add(&loop, &sockHandler, sockFd, EPOLLIN, onCoapRequest, NULL) == -1) {
+        fprintf(stderr, "epoll_ctl: coap socket");
+        exit(EXIT_FAILURE);
     }
 
+    eventloop_run(&loop);
+
     close(sockFd);
     return 0;
 }
\ No newline at end of file
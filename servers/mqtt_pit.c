@@ -7,7 +7,6 @@
 #include <sys/epoll.h>
 #include <sys/time.h>
 #include <limits.h>
-#include <fcntl.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <signal.h>
@@ -30,21 +29,25 @@ int epollTimeoutInterval;
 uint32_t pubrelInterval;
 uint32_t maxPacketsPerClient;
 int maxNoClients;
+int acceptBudget;
 
 struct mqttClient* clients = NULL;
-
-struct mqttClient* lookupClient(int fd) {
-    struct mqttClient* client;
-
-    HASH_FIND_INT(clients, &fd, client);
-    return client;
-}
+struct eventLoop loop;
+struct eventHandler listener;
+struct slabPool clientPool;
+struct sourceTable sources;
+struct admission admission;
+struct mqttClient *sampleCursor; // Where the next eviction starts sampling, NULL for the first client
+bool listenerPaused;             // Listener left out of epoll while accept runs out of descriptors
 
 void addClient(struct mqttClient* client) {
     HASH_ADD_INT(clients, fd, client);
+    admission_add(&admission, client->prefix, sizeof(struct mqttClient));
 }
 
 void deleteClient(struct mqttClient* client) {
+    if (sampleCursor == client) sampleCursor = client->hh.next;
+    admission_remove(&admission, client->prefix, sizeof(struct mqttClient));
     HASH_DEL(clients, client);
 }
 
@@ -113,25 +116,22 @@ uint8_t readConnreq(uint8_t* buffer, uint32_t packetEnd, uint32_t offset, struct
         return 0x80;
     }
     uint8_t proto_level = buffer[offset++];
-    char msg[256];
+    const char *versionName;
     if(proto_level == 0b101) {
-        snprintf(msg, sizeof(msg), "%s CONNECT %s\n",
-            SERVER_ID, "v5");
+        versionName = "v5";
         client->version = V5;
      } else if (proto_level == 0b100) {
-        snprintf(msg, sizeof(msg), "%s CONNECT %s\n",
-        SERVER_ID, "v3.1.1");
+        versionName = "v3.1.1";
         client->version = V311;
     } else if (proto_level == 0b011) {
-        snprintf(msg, sizeof(msg), "%s CONNECT %s\n",
-        SERVER_ID, "v3.1");
+        versionName = "v3.1";
         client->version = V31;
     } else {
         fprintf(stderr, "Unsupported MQTT version: %d", proto_level);
         return 0x01; // Unacceptable protocol version
     }
-    printf("%s", msg);
-    sendMetric(msg);
+    printf("%s CONNECT %s\n", SERVER_ID, versionName);
+    metric_strings(METRIC_MQTT_CONNECT, versionName, NULL);
 
     // Connect Flags
     if (offset >= packetEnd) {
@@ -223,11 +223,8 @@ uint8_t readConnreq(uint8_t* buffer, uint32_t packetEnd, uint32_t offset, struct
     }
 
     // syslog(LOG_INFO, "Successfully read CONNECT request with keep-alive: %d username: %s password: %s", keepAlive, username, password);
-    // char msg[256];
-    snprintf(msg, sizeof(msg), "%s credentials %.100s %.100s\n",
-        SERVER_ID, username, password);
-    printf("%s", msg);
-    sendMetric(msg);
+    printf("%s credentials %.100s %.100s\n", SERVER_ID, username, password);
+    metric_strings(METRIC_MQTT_CREDENTIALS, username, password);
     return 0x00; // Success
 }
 
@@ -274,11 +271,8 @@ void readSubscribe(uint8_t* buffer, uint32_t packetEnd, uint32_t offset, enum Mq
     uint8_t options = buffer[offset++];
     uint8_t qos = options & 0b11;
 
-    char msg[256];
-    snprintf(msg, sizeof(msg), "%s SUBSCRIBE %.100s %d\n",
-        SERVER_ID, topic, qos);
-    printf("%s", msg);
-    sendMetric(msg);
+    printf("%s SUBSCRIBE %.100s %d\n", SERVER_ID, topic, qos);
+    metric_topic(METRIC_MQTT_SUBSCRIBE, topic, qos);
 
     // syslog(LOG_INFO, "Successfully read SUBSCRIBE request with topic: %s and QoS %d", topic, qos);
     return;
@@ -340,11 +334,8 @@ bool sendConnack(struct mqttClient* client, uint8_t reasonCode) {
             return false;
         }
     } else {
-        char msg[256];
-        snprintf(msg, sizeof(msg), "%s CONNACK\n",
-            SERVER_ID);
-        printf("%s", msg);
-        sendMetric(msg);
+        printf("%s CONNACK\n", SERVER_ID);
+        metric_event(METRIC_MQTT_CONNACK);
         // syslog(LOG_INFO, "Sent CONNACK to client fd=%d\n", client->fd);
     }
 
@@ -395,10 +386,7 @@ void readPublish(uint8_t* buffer, uint32_t packetEnd, uint32_t offset, enum Mqtt
     memcpy(payload, &buffer[offset], payloadLen < 511 ? payloadLen : 511);
     payload[copyLen] = '\0';
 
-    char msg[256];
-    snprintf(msg, sizeof(msg), "%s PUBLISH %.100s %d\n",
-        SERVER_ID, topic, qos);
-    sendMetric(msg);
+    metric_topic(METRIC_MQTT_PUBLISH, topic, qos);
     printf("PUBLISH received. Topic: %s, Payload: %s, QoS: %d\n", topic, payload, qos);
 }
 
@@ -432,10 +420,7 @@ void readUnsubscribe(uint8_t* buffer, uint32_t packetEnd, uint32_t offset, enum
         memcpy(topic, &buffer[offset], topicLen < 255 ? topicLen : 255);
         offset += topicLen;
 
-        char msg[256];
-        snprintf(msg, sizeof(msg), "%s UNSUBSCRIBE %.200s\n",
-            SERVER_ID, topic);
-        sendMetric(msg);
+        metric_strings(METRIC_MQTT_UNSUBSCRIBE, topic, NULL);
 
         printf("UNSUBSCRIBE received for topic: %s (Packet ID: %u)\n", topic, packetId);
     }
@@ -593,10 +578,7 @@ void readPubrec(uint8_t* buffer, uint32_t packetEnd, uint32_t offset, struct mqt
         }
     }
 
-    char msg[256];
-    snprintf(msg, sizeof(msg), "%s PUBREC\n",
-        SERVER_ID);
-    sendMetric(msg);
+    metric_event(METRIC_MQTT_PUBREC);
     // syslog(LOG_INFO, "Received PUBREC for fd=%d and packet ID: %d\n", client->fd, packetId);
 }
 
@@ -656,20 +638,50 @@ bool sendPingresp(struct mqttClient* client) {
     return true;
 }
 
-void disconnectClient(struct mqttClient* client, int epollFd, long long now){
+void disconnectClient(struct mqttClient* client, long long now){
     long long wastedTime = now - client->timeOfConnection;
 
-    char msg[256];
-    snprintf(msg, sizeof(msg), "%s disconnect %s %lld",
-        SERVER_ID, client->ipaddr, wastedTime);
+    printf("%s disconnect %s %lld\n", SERVER_ID, client->ipaddr, wastedTime);
+    metric_disconnect(client->ipaddr, wastedTime);
 
-    printf(msg);
-    sendMetric(msg);
-
-    epoll_ctl(epollFd, EPOLL_CTL_DEL, client->fd, NULL);
+    timerwheel_cancel(&clientQueueMqtt, &client->timer);
+    eventloop_remove(&loop, &client->handler);
     deleteClient(client);
+    sourcetable_release(&sources, client->source);
     close(client->fd);
-    free(client);
+    slab_free(&clientPool, client);
+    if (listenerPaused && eventloop_modify(&loop, &listener, EPOLLIN) == 0) {
+        listenerPaused = false; // A descriptor is free again
+    }
+}
+
+// Evicts a client if the pit is out of budget. The victim is picked from a few clients
+// in a row, starting where the last eviction stopped. Returns false if the new client
+// has to be turned away
+bool makeRoom(long long now) {
+    if (admission_fits(&admission, sizeof(struct mqttClient))) return true;
+
+    struct mqttClient *victim = NULL;
+    struct admissionCandidate best;
+    if (admission.policy != EVICT_NONE && clients != NULL) {
+        struct mqttClient *c = sampleCursor != NULL ? sampleCursor : clients;
+        for (int sampled = 0; sampled < ADMISSION_SAMPLES; sampled++) {
+            struct admissionCandidate candidate = {c->prefix, now - c->timeOfConnection};
+            if (admission_prefer(&admission, &candidate, victim == NULL ? NULL : &best)) {
+                best = candidate;
+                victim = c;
+            }
+            c = c->hh.next != NULL ? c->hh.next : clients;
+        }
+        sampleCursor = c;
+    }
+    if (victim == NULL) {
+        admission_refused(&admission);
+        return false;
+    }
+    admission_evicted(&admission);
+    disconnectClient(victim, now);
+    return true;
 }
 
 enum Request determineRequest(uint8_t firstByte) {
@@ -759,8 +771,233 @@ void cleanupBuffer(struct mqttClient* client, uint32_t packetLength){
     client->bytesWrittenToBuffer = leftover;
 }
 
+long long keepAliveWindow(struct mqttClient* client) {
+    // Clients without a keep alive are checked as often as the old epoll timeout swept them
+    if (client->keepAlive == 0) return epollTimeoutInterval;
+    return (long long)client->keepAlive * 1400;
+}
+
+void scheduleKeepAliveCheck(struct mqttClient* client) {
+    long long pubrelDue = client->lastPubrelMs + pubrelInterval;
+    long long inactiveDue = client->lastActivityMs + keepAliveWindow(client);
+    timerwheel_schedule(&clientQueueMqtt, &client->timer, pubrelDue < inactiveDue ? pubrelDue : inactiveDue);
+}
+
+// Detect dead clients and disconnect them
+void onKeepAliveCheck(struct eventLoop *loop, struct timerNode *node, long long now) {
+    (void)loop;
+    struct mqttClient *c = timer_entry(node, struct mqttClient, timer);
+    long long timeSinceLastActivityMs = now - (long long)c->lastActivityMs;
+    if ((now - (long long)c->lastPubrelMs >= pubrelInterval) || (timeSinceLastActivityMs >= keepAliveWindow(c))) {
+        bool success = sendPubrel(c, 1234);
+        c->lastActivityMs = now;
+        c->lastPubrelMs = now;
+
+        if(!success) {
+            fprintf(stderr, "Disconnecting client due to inactivity");
+            disconnectClient(c, now);
+            return;
+        }
+    }
+    scheduleKeepAliveCheck(c);
+}
+
+void onClientReadable(struct eventLoop *loop, struct eventHandler *handler, uint32_t events) {
+    long long now = loop->now;
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        disconnectClient(handler->data, now);
+        return;
+    }
+
+    struct mqttClient* client = handler->data;
+    ssize_t bytesRead = read(handler->fd,
+              client->buffer + client->bytesWrittenToBuffer, // Avoid overwriting existing data
+              sizeof(client->buffer) - client->bytesWrittenToBuffer);
+
+    if(bytesRead == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        }
+        fprintf(stderr, "Failed reading. Disconnecting client. error: %s", strerror(errno));
+        disconnectClient(client, now);
+        return;
+    }
+
+    if(bytesRead == 0) {
+        fprintf(stderr, "Client closed the connection. Disconnecting client.");
+        disconnectClient(client, now);
+        return;
+    }
+
+    client->bytesWrittenToBuffer += bytesRead;
+
+    if (client->bytesWrittenToBuffer >= sizeof(client->buffer)) {
+        fprintf(stderr, "Buffer full. Disconnecting client.");
+        disconnectClient(client, now);
+        return;
+    }
+
+    uint32_t packetLengths[maxPacketsPerClient]; // Length of each packet
+    uint32_t packetStarts[maxPacketsPerClient]; // Points to the start of each packet, after the header values
+    uint32_t packetCount = 0;
+
+    calculateTotalPacketLengths(client->buffer, client->bytesWrittenToBuffer,
+                packetLengths, packetStarts, &packetCount);
+    
+    uint32_t processedPackets = 0;
+    for (uint32_t i = 0; i < packetCount; i++) {
+        uint32_t packetLength = packetLengths[i];
+        uint32_t packetStart = packetStarts[i];
+        uint32_t packetEnd = packetStart + packetLength;
+        
+        if (packetLength == 0 || processedPackets + packetLength > client->bytesWrittenToBuffer) {
+            // syslog(LOG_INFO, "Incomplete packet");
+            break; // Incomplete packet
+        }
+
+        client->lastActivityMs = now;
+        enum Request request = determineRequest(client->buffer[processedPackets]);
+        bool pubSuccess = false;
+        switch (request) {
+            case CONNECT:
+                uint8_t reasonCodeConn = readConnreq(client->buffer, packetEnd, packetStart, client);
+                if(reasonCodeConn != 0x00) {
+                    metric_event(METRIC_MQTT_MALFORMED_CONNECT);
+                }
+                bool ackSuccess = sendConnack(client, reasonCodeConn);
+                if(!ackSuccess) {
+                    fprintf(stderr, "Disconnecting client due to CONNACK failure");
+                    disconnectClient(client, now);
+                    return;
+                }
+                pubSuccess = sendPublish(client, "$SYS/credentials", "username=admin password=admin");
+                if(!pubSuccess) {
+                    fprintf(stderr, "Disconnecting client due to publish failure");
+                    disconnectClient(client, now);
+                    return;
+                }
+                break;
+            case SUBSCRIBE:
+                readSubscribe(client->buffer, packetEnd, packetStart, client->version);
+                break;
+            case PUBREC:
+                readPubrec(client->buffer, packetEnd, packetStart, client);
+                break;
+            case PUBLISH:
+                readPublish(client->buffer, packetEnd, packetStart, client->version);
+                break;
+            case PUBCOMP:
+                readPubcomp(packetEnd, packetStart);
+                pubSuccess = sendPublish(client, "$SYS/confidential", "username=admin123 password=admin321");
+                if(!pubSuccess) {
+                    fprintf(stderr, "Disconnecting client due to publish failure");
+                    disconnectClient(client, now);
+                    return;
+                }
+                break;
+            case UNSUBSCRIBE:
+                readUnsubscribe(client->buffer, packetEnd, packetStart, client->version);
+                break;
+            case PING:
+                bool pingSuccess = sendPingresp(client);
+                if(!pingSuccess){
+                    fprintf(stderr, "Disconnecting client due to ping failure");
+                    disconnectClient(client, now);
+                    return;
+                }
+                break;
+            case DISCONNECT:
+                fprintf(stderr, "Disconnecting client due to receiving DISCONNECT");
+                disconnectClient(client, now);
+                return;
+            default:
+                break;
+        }
+        processedPackets += packetLength;
+    }
+    uint32_t leftover = client->bytesWrittenToBuffer - processedPackets;
+    if (leftover > 0) {
+        memmove(client->buffer, client->buffer + processedPackets, leftover);
+    }
+    client->bytesWrittenToBuffer = leftover;
+    scheduleKeepAliveCheck(client); // Activity and CONNECT move the deadline
+}
+
+void acceptNewClient(struct eventLoop *loop, int clientFd, struct sockaddr_in clientAddr) {
+    long long now = loop->now;
+    uint64_t source = sourcetable_key(&sources, (struct sockaddr *)&clientAddr);
+    if (!sourcetable_admit(&sources, &source, now)) {
+        close(clientFd);
+        return;
+    }
+    if (!makeRoom(now)) {
+        sourcetable_release(&sources, source);
+        close(clientFd);
+        return;
+    }
+    struct mqttClient* newClient = slab_alloc(&clientPool);
+    if (newClient == NULL) {
+        fprintf(stderr, "Out of memory");
+        sourcetable_release(&sources, source);
+        close(clientFd);
+        return;
+    }
+
+    
+    statsMqtt.totalConnects += 1;
+    newClient->fd = clientFd;
+    newClient->source = source;
+    strncpy(newClient->ipaddr, inet_ntoa(clientAddr.sin_addr), INET_ADDRSTRLEN);
+    newClient->prefix = addressPrefix(newClient->ipaddr);
+    newClient->bytesWrittenToBuffer = 0;
+    newClient->lastActivityMs = now;
+    newClient->timeOfConnection = now;
+    newClient->lastPubrelMs = now;
+    newClient->keepAlive = 0; // Initial value. Will be updated after connect
+    memset(newClient->buffer, 0, sizeof(newClient->buffer)); // Maybe not necessary
+    // ev.events = EPOLLIN | EPOLLET;
+    // ev.data.fd = clientFd;
+    if (eventloop_add(loop, &newClient->handler, clientFd, EPOLLIN | EPOLLRDHUP, onClientReadable, newClient) == -1) {
+        fprintf(stderr, "Failed adding client to epoll with error %s", strerror(errno));
+        sourcetable_release(&sources, source);
+        close(clientFd);
+        slab_free(&clientPool, newClient);
+        return;
+    }
+    
+    timerwheel_node_init(&newClient->timer);
+    scheduleKeepAliveCheck(newClient);
+    addClient(newClient);
+    printf("%s connect %s\n", SERVER_ID, newClient->ipaddr);
+    metric_address(METRIC_CONNECT, newClient->ipaddr);
+    // if(statsMqtt.mostConcurrentConnections < HASH_COUNT(clients)) {
+    //     statsMqtt.mostConcurrentConnections = HASH_COUNT(clients);
+    // }
+}
+
+// Drains the backlog, but at most acceptBudget connections before clients get a turn
+void onAccept(struct eventLoop *loop, struct eventHandler *handler, uint32_t events) {
+    (void)events;
+    for (int i = 0; i < acceptBudget; i++) {
+        struct sockaddr_in clientAddr;
+        int clientFd = acceptClient(handler->fd, &clientAddr);
+        if (clientFd == -1) {
+            if (errno == EMFILE || errno == ENFILE) {
+                // The pending connection stays queued and epoll would report it again at once,
+                // so the listener waits for a disconnect instead of spinning
+                if (eventloop_modify(loop, handler, 0) == 0) listenerPaused = true;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "Failed accepting new client with error %s", strerror(errno));
+            }
+            return;
+        }
+        acceptNewClient(loop, clientFd, clientAddr);
+    }
+}
+
 int main(int argc, char* argv[]) {
     setbuf(stdout, NULL);
+    metrics_init(PIT_MQTT);
     
     // testing
     // char msg[256];
@@ -775,9 +1012,13 @@ int main(int argc, char* argv[]) {
     pubrelInterval = atoi(argv[4]);
     maxPacketsPerClient = atoi(argv[5]);
     maxNoClients = atoi(argv[6]);
+    acceptBudget = configInt("ACCEPT_BUDGET", DEFAULT_ACCEPT_BUDGET);
+    if (acceptBudget < 1) acceptBudget = 1;
     // openlog("mqtt_tarpit", LOG_PID | LOG_CONS, LOG_USER);
     initializeStats();
     setFdLimit(maxNoClients);
+    sourcetable_init(&sources, maxNoClients);
+    admission_init(&admission, SERVER_ID, maxNoClients);
     signal(SIGPIPE, SIG_IGN);
     
     int serverSock = createServer(port);
@@ -786,215 +1027,16 @@ int main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
     
-    struct sockaddr_in clientAddr;
-    socklen_t addrLen = sizeof(clientAddr);
-
-    struct epoll_event ev, eventsQueue[maxEvents];
-    int epollfd = epoll_create1(0);
-    if (epollfd == -1) {
-        fprintf(stderr, "epoll_create1 failed");
-        exit(EXIT_FAILURE);
-    }
-
-    ev.events = EPOLLIN;
-    ev.data.fd = serverSock;
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, serverSock, &ev) == -1) {
+    timerwheel_init(&clientQueueMqtt, currentTimeMs());
+    slab_init(&clientPool, SERVER_ID, sizeof(struct mqttClient), SLAB_CHUNK_OBJECTS);
+    eventloop_init(&loop, maxEvents, &clientQueueMqtt, onKeepAliveCheck);
+    if (eventloop_add(&loop, &listener, serverSock, EPOLLIN, onAccept, NULL) == -1) {
         fprintf(stderr, "epoll_ctl: server_sock");
         exit(EXIT_FAILURE);
     }
 
     // long long lastHeartbeat = currentTimeMs();
-    while(true) {
-        long long now = currentTimeMs();
-
-        // if (now - lastHeartbeat >= HEARTBEAT_INTERVAL_MS) {
-        //     heartbeatLog();
-        //     lastHeartbeat = now;
-        // }
-
-        int nfds = epoll_wait(epollfd, eventsQueue, maxEvents, epollTimeoutInterval);
-        if (nfds == -1) {
-            fprintf(stderr, "epoll_wait");
-            exit(EXIT_FAILURE);
-        }
-
-        // Update now, since epoll_wait made the value outdated. 
-        now = currentTimeMs();
-        for (int n = 0; n < nfds; ++n) {
-            int currentFd = eventsQueue[n].data.fd;
-            if (currentFd == serverSock) {
-                int clientFd = accept(serverSock, (struct sockaddr *) &clientAddr, &addrLen);
-                if (clientFd == -1) {
-                    fprintf(stderr, "Failed accepting new client with error %s", strerror(errno));
-                    continue;
-                }
-                struct mqttClient* newClient = malloc(sizeof(struct mqttClient));
-                if (newClient == NULL) {
-                    fprintf(stderr, "Out of memory");
-                    close(clientFd);
-                    continue;
-                }
-
-                
-                statsMqtt.totalConnects += 1;
-                newClient->fd = clientFd;
-                strncpy(newClient->ipaddr, inet_ntoa(clientAddr.sin_addr), INET_ADDRSTRLEN);
-                newClient->bytesWrittenToBuffer = 0;
-                newClient->lastActivityMs = now;
-                newClient->timeOfConnection = now;
-                newClient->lastPubrelMs = now;
-                newClient->keepAlive = 0; // Initial value. Will be updated after connect
-                memset(newClient->buffer, 0, sizeof(newClient->buffer)); // Maybe not necessary
-                // ev.events = EPOLLIN | EPOLLET;
-                // ev.data.fd = clientFd;
-                fcntl(clientFd, F_SETFL, O_NONBLOCK);
-                struct epoll_event clientEv;
-                clientEv.events = EPOLLIN;
-                clientEv.data.fd = clientFd;
-                if (epoll_ctl(epollfd, EPOLL_CTL_ADD, clientFd, &clientEv) == -1) {
-                    fprintf(stderr, "Failed adding client to epoll with error %s", strerror(errno));
-                    close(clientFd);
-                    free(newClient);
-                    continue;
-                }
-                
-                addClient(newClient);
-                char msg[256];
-                snprintf(msg, sizeof(msg), "%s connect %s\n",
-                    SERVER_ID, newClient->ipaddr);
-                printf("%s", msg);
-                sendMetric(msg);
-                // if(statsMqtt.mostConcurrentConnections < HASH_COUNT(clients)) {
-                //     statsMqtt.mostConcurrentConnections = HASH_COUNT(clients);
-                // }
-            } else {
-                struct mqttClient* client = lookupClient(currentFd);
-                ssize_t bytesRead = read(currentFd,
-                          client->buffer + client->bytesWrittenToBuffer, // Avoid overwriting existing data
-                          sizeof(client->buffer) - client->bytesWrittenToBuffer);
-
-                if(bytesRead == -1) {
-                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                        continue;
-                    }
-                    fprintf(stderr, "Failed reading. Disconnecting client. error: %s", strerror(errno));
-                    disconnectClient(client, epollfd, now);
-                    continue;
-                }
-
-                client->bytesWrittenToBuffer += bytesRead;
-
-                if (client->bytesWrittenToBuffer >= sizeof(client->buffer)) {
-                    fprintf(stderr, "Buffer full. Disconnecting client.");
-                    disconnectClient(client, epollfd, now);
-                    continue;
-                }
-
-                uint32_t packetLengths[maxPacketsPerClient]; // Length of each packet
-                uint32_t packetStarts[maxPacketsPerClient]; // Points to the start of each packet, after the header values
-                uint32_t packetCount = 0;
-
-                calculateTotalPacketLengths(client->buffer, client->bytesWrittenToBuffer,
-                            packetLengths, packetStarts, &packetCount);
-                
-                uint32_t processedPackets = 0;
-                for (uint32_t i = 0; i < packetCount; i++) {
-                    uint32_t packetLength = packetLengths[i];
-                    uint32_t packetStart = packetStarts[i];
-                    uint32_t packetEnd = packetStart + packetLength;
-                    
-                    if (packetLength == 0 || processedPackets + packetLength > client->bytesWrittenToBuffer) {
-                        // syslog(LOG_INFO, "Incomplete packet");
-                        break; // Incomplete packet
-                    }
-
-                    client->lastActivityMs = now;
-                    enum Request request = determineRequest(client->buffer[processedPackets]);
-                    bool pubSuccess = false;
-                    switch (request) {
-                        case CONNECT:
-                            uint8_t reasonCodeConn = readConnreq(client->buffer, packetEnd, packetStart, client);
-                            if(reasonCodeConn != 0x00) {
-                                char msg[256];
-                                snprintf(msg, sizeof(msg), "%s malformedConnect",
-                                    SERVER_ID);
-                                sendMetric(msg);
-                            }
-                            bool ackSuccess = sendConnack(client, reasonCodeConn);
-                            if(!ackSuccess) {
-                                fprintf(stderr, "Disconnecting client due to CONNACK failure");
-                                disconnectClient(client, epollfd, now);
-                                break;
-                            }
-                            pubSuccess = sendPublish(client, "$SYS/credentials", "username=admin password=admin");
-                            if(!pubSuccess) {
-                                fprintf(stderr, "Disconnecting client due to publish failure");
-                                disconnectClient(client, epollfd, now);
-                            }
-                            break;
-                        case SUBSCRIBE:
-                            readSubscribe(client->buffer, packetEnd, packetStart, client->version);
-                            break;
-                        case PUBREC:
-                            readPubrec(client->buffer, packetEnd, packetStart, client);
-                            break;
-                        case PUBLISH:
-                            readPublish(client->buffer, packetEnd, packetStart, client->version);
-                            break;
-                        case PUBCOMP:
-                            readPubcomp(packetEnd, packetStart);
-                            pubSuccess = sendPublish(client, "$SYS/confidential", "username=admin123 password=admin321");
-                            if(!pubSuccess) {
-                                fprintf(stderr, "Disconnecting client due to publish failure");
-                                disconnectClient(client, epollfd, now);
-                            }
-                            break;
-                        case UNSUBSCRIBE:
-                            readUnsubscribe(client->buffer, packetEnd, packetStart, client->version);
-                            break;
-                        case PING:
-                            bool pingSuccess = sendPingresp(client);
-                            if(!pingSuccess){
-                                fprintf(stderr, "Disconnecting client due to ping failure");
-                                disconnectClient(client, epollfd, now);
-                                break;
-                            }
-                            break;
-                        case DISCONNECT:
-                            fprintf(stderr, "Disconnecting client due to receiving DISCONNECT");
-                            disconnectClient(client, epollfd, now);
-                            break;
-                        default:
-                            break;
-                    }
-                    processedPackets += packetLength;
-                }
-                uint32_t leftover = client->bytesWrittenToBuffer - processedPackets;
-                if (leftover > 0) {
-                    memmove(client->buffer, client->buffer + processedPackets, leftover);
-                }
-                client->bytesWrittenToBuffer = leftover;
-            }
-            
-        }
-        
-        // Detect dead clients and disconnect them
-        for (struct mqttClient *c = clients, *tmp = NULL; c != NULL; c = tmp) {
-            long long timeSinceLastActivityMs = now - c->lastActivityMs;
-            tmp = c->hh.next;
-            if ((now - c->lastPubrelMs > pubrelInterval) || (timeSinceLastActivityMs > c->keepAlive * 1400)) {
-                bool success = sendPubrel(c, 1234);
-                c->lastActivityMs = now;
-                c->lastPubrelMs = now;
-
-                if(!success) {
-                    fprintf(stderr, "Disconnecting client due to inactivity");
-                    disconnectClient(c, epollfd, now);
-                    continue;
-                }
-            }
-        }
-    }
+    eventloop_run(&loop);
 
     // closelog();
     close(serverSock);
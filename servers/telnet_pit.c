@@ -3,19 +3,18 @@
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
-#include <poll.h>
 #include <sys/time.h>
 #include <limits.h>
-#include <fcntl.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <signal.h>
 #include <time.h>
+#include <pthread.h>
 #include "../shared/structs.h"
 
 // #define PORT 23
 // #define DELAY_MS 100
-// #define HEARTBEAT_INTERVAL_MS 600000 // 10 minutes
+#define HEARTBEAT_INTERVAL_MS 600000 // 10 minutes
 // #define FD_LIMIT 4096
 #define SERVER_ID "Telnet"
 
@@ -24,10 +23,67 @@
 #define DONT 254
 #define WILL 251
 #define WONT 252
+#define SB 250
+#define SE 240
+#define TTYPE 24      // Terminal type option
+#define TTYPE_SEND 1
+
+#define TELNET_REPLY_PENDING 2 // Client table state: the next tick answers the client's negotiation
+
+#define DISCARD_MAX (1 << 20) // Bytes of input thrown away per recv
+#define DRAIN_MAX (4 * DISCARD_MAX) // Bytes read per readiness event, the rest waits for the next one
 
 int port;
 int delay;
+int delayJitter; // Most ms added to a delay, spreads clients accepted in a burst
 int maxNoClients;
+int acceptBudget;
+int workerCount;
+int keepInput; // Bytes of input per client kept for the disconnect log
+int wakeOnWritable; // Park clients with a full send buffer on EPOLLOUT instead of retrying with backoff
+
+enum telnetParser { PARSE_DATA, PARSE_IAC, PARSE_VERB, PARSE_SB_OPTION, PARSE_SB, PARSE_SB_IAC };
+
+// Where the client is in the option negotiation, kept to 4 bytes per client
+struct telnetNegotiation {
+    uint8_t parser;      // enum telnetParser
+    uint8_t arg;         // Verb waiting for its option, or the option being subnegotiated
+    uint8_t replyVerb;   // WILL, WONT, DO, DONT, or SB for a terminal type request
+    uint8_t replyOption;
+};
+
+// Cold record of a telnet client, followed by keepInput bytes of what it sent
+struct telnetClient {
+    struct trickleClient base;
+    struct telnetNegotiation negotiation;
+    uint32_t inputKept;
+    unsigned char input[];
+};
+
+// MSG_TRUNC discards TCP input in the kernel without copying it. Other sockets, like the
+// socketpairs of the simulation, refuse a NULL buffer and get the scratch buffer instead
+bool discardWithTrunc = true;
+__thread unsigned char scratch[16384];
+
+// Each worker owns a listener on the shared port, its clients and its statistics
+struct telnetWorker {
+    pthread_t thread;
+    int id;
+    int serverSock;
+    unsigned int seed;
+    struct eventLoop loop;
+    struct eventHandler listener;
+    struct timerWheel clientQueue;
+    struct clientTable clients;
+    struct pacing pacing;
+    struct peerSweep sweep;
+    struct timerNode sweepTimer; // In clientQueue with the clients
+    struct telnetStatistics stats; // Written by the worker, read by the reporter
+};
+
+struct telnetWorker *workers;
+struct admission admission; // Shared by the workers
+struct sourceTable sources; // Shared by the workers
 
 // Telnet negotiation options
 unsigned char negotiations[][3] = {
@@ -40,19 +96,492 @@ unsigned char negotiations[][3] = {
 };
 int num_options = sizeof(negotiations) / sizeof(negotiations[0]);
 
-// void heartbeatLog() {
-//     syslog(LOG_INFO, "Server is running with %d connected clients. Number of most concurrent connected clients is %d", clientQueueTelnet.length, statsTelnet.mostConcurrentConnections);
-//     syslog(LOG_INFO, "Current statistics: wasted time: %lld ms. Total connected clients: %ld", statsTelnet.totalWastedTime, statsTelnet.totalConnects);
-// }
+// Every WILL, WONT, DO and DONT for every option, so replies are sent from buffers that never change
+unsigned char commands[4][256][3];
+// DO TTYPE followed by SB TTYPE SEND, the second half alone asks for the next terminal type
+const unsigned char doTtypeSend[] = {IAC, DO, TTYPE, IAC, SB, TTYPE, TTYPE_SEND, IAC, SE};
+
+void initNegotiation() {
+    for (int verb = WILL; verb <= DONT; verb++) {
+        for (int option = 0; option < 256; option++) {
+            commands[verb - WILL][option][0] = IAC;
+            commands[verb - WILL][option][1] = verb;
+            commands[verb - WILL][option][2] = option;
+        }
+    }
+}
+
+// Single writer per counter, so relaxed atomics are enough for the reporter to read them
+#define STAT_ADD(field, n) __atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+#define STAT_SET(field, v) __atomic_store_n(&(field), (v), __ATOMIC_RELAXED)
+#define STAT_GET(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
 
 void initializeStats(){
     statsTelnet.totalConnects = 0;
     statsTelnet.totalWastedTime = 0;
     statsTelnet.mostConcurrentConnections = 0;
+    statsTelnet.connectedClients = 0;
+    statsTelnet.inputBytes = 0;
+    statsTelnet.negotiationReplies = 0;
+    statsTelnet.stalledTime = 0;
+    statsTelnet.deadPeers = 0;
+}
+
+// Sums the per-worker statistics into statsTelnet. The peak is the larger of the
+// sum of current connections and the highest peak seen by a single worker
+void mergeWorkerStats() {
+    unsigned long totalConnects = 0;
+    unsigned long long totalWastedTime = 0;
+    unsigned long long inputBytes = 0;
+    unsigned long negotiationReplies = 0;
+    unsigned long long stalledTime = 0;
+    unsigned long deadPeers = 0;
+    int connectedClients = 0;
+    int mostConcurrent = statsTelnet.mostConcurrentConnections;
+
+    for (int i = 0; i < workerCount; i++) {
+        struct telnetStatistics *s = &workers[i].stats;
+        totalConnects += STAT_GET(s->totalConnects);
+        totalWastedTime += STAT_GET(s->totalWastedTime);
+        inputBytes += STAT_GET(s->inputBytes);
+        negotiationReplies += STAT_GET(s->negotiationReplies);
+        stalledTime += STAT_GET(s->stalledTime);
+        deadPeers += STAT_GET(s->deadPeers);
+        connectedClients += STAT_GET(s->connectedClients);
+        int workerPeak = STAT_GET(s->mostConcurrentConnections);
+        if (mostConcurrent < workerPeak) mostConcurrent = workerPeak;
+    }
+    if (mostConcurrent < connectedClients) mostConcurrent = connectedClients;
+
+    statsTelnet.totalConnects = totalConnects;
+    statsTelnet.totalWastedTime = totalWastedTime;
+    statsTelnet.inputBytes = inputBytes;
+    statsTelnet.negotiationReplies = negotiationReplies;
+    statsTelnet.stalledTime = stalledTime;
+    statsTelnet.deadPeers = deadPeers;
+    statsTelnet.connectedClients = connectedClients;
+    statsTelnet.mostConcurrentConnections = mostConcurrent;
+}
+
+void heartbeatLog() {
+    mergeWorkerStats();
+    printf("Server is running with %d connected clients on %d workers. Number of most concurrent connected clients is %d\n", statsTelnet.connectedClients, workerCount, statsTelnet.mostConcurrentConnections);
+    printf("Current statistics: wasted time: %llu ms. Total connected clients: %lu. Input drained: %llu bytes. Negotiation replies: %lu. Stalled time: %llu ms. Dead peers: %lu\n", statsTelnet.totalWastedTime, statsTelnet.totalConnects, statsTelnet.inputBytes, statsTelnet.negotiationReplies, statsTelnet.stalledTime, statsTelnet.deadPeers);
+    for (int i = 0; i < workerCount; i++) {
+        clienttable_report(&workers[i].clients);
+        eventloop_report(&workers[i].loop, SERVER_ID);
+    }
+    admission_report(&admission);
+    sourcetable_report(&sources, SERVER_ID);
+    printf("Metrics dropped: %lu\n", metrics_dropped());
+}
+
+// Logs the kept input with anything unprintable escaped
+void logInput(struct telnetClient *info) {
+    printf("%s input %s ", SERVER_ID, info->base.ipaddr);
+    for (uint32_t i = 0; i < info->inputKept; i++) {
+        unsigned char ch = info->input[i];
+        if (ch >= 0x20 && ch < 0x7f && ch != '\\') {
+            putchar(ch);
+        } else {
+            printf("\\x%02x", ch);
+        }
+    }
+    putchar('\n');
+}
+
+// left is false when the pit drops the client, then pacing does not learn from it
+void disconnectClient(struct telnetWorker *w, uint32_t i, bool left) {
+    struct telnetClient *info = clienttable_cold(&w->clients, i);
+    long long timeTrapped = w->clients.timeConnected[i];
+    if (info->inputKept > 0) logInput(info);
+    if (info->base.stalledSince != 0) {
+        STAT_ADD(w->stats.stalledTime, w->loop.now - info->base.stalledSince);
+    } else if (left) {
+        pacing_lost(&w->pacing, &info->base.pacing, w->loop.now);
+    }
+    admission_remove(&admission, info->base.prefix, w->clients.coldSize);
+    sourcetable_release(&sources, info->base.source);
+    printf("%s disconnect %s %lld\n", SERVER_ID, info->base.ipaddr, timeTrapped);
+    metric_disconnect(info->base.ipaddr, timeTrapped);
+
+    timerwheel_cancel(&w->clientQueue, &w->clients.timers[i]);
+    eventloop_remove(&w->loop, &w->clients.handlers[i]);
+    close(w->clients.handlers[i].fd);
+    clienttable_remove(&w->clients, i);
+    STAT_SET(w->stats.connectedClients, (int)w->clients.length);
+}
+
+// Checks the next slice of the client table for peers that are gone
+void sweepPeers(struct telnetWorker *w, long long now) {
+    uint32_t first;
+    uint32_t count = peersweep_slice(&w->sweep, w->clients.capacity, &first);
+    for (uint32_t k = 0; k < count; k++) {
+        uint32_t i = (first + k) % w->clients.capacity;
+        if (w->clients.states[i] == CLIENT_FREE) continue;
+        if (!peersweep_alive(&w->sweep, w->clients.handlers[i].fd)) {
+            STAT_ADD(w->stats.deadPeers, 1);
+            disconnectClient(w, i, false);
+        }
+    }
+    peersweep_report(&w->sweep, now);
+    timerwheel_schedule(&w->clientQueue, &w->sweepTimer, now + PEER_SWEEP_TICK_MS);
+}
+
+// Called when a client is due for its next negotiation. Clients that answered get a reply
+// that keeps them negotiating, silent ones a random option from the table
+void onClientDue(struct eventLoop *loop, struct timerNode *node, long long now) {
+    struct telnetWorker *w = loop->data;
+    if (node == &w->sweepTimer) {
+        sweepPeers(w, now);
+        return;
+    }
+    uint32_t i = clienttable_timer_index(&w->clients, node);
+
+    const unsigned char *message;
+    size_t length = 3;
+    if (w->clients.states[i] == TELNET_REPLY_PENDING) {
+        struct telnetNegotiation *n = &((struct telnetClient *)clienttable_cold(&w->clients, i))->negotiation;
+        if (n->replyVerb == SB) {
+            message = doTtypeSend + 3;
+            length = sizeof(doTtypeSend) - 3;
+        } else if (n->replyVerb == DO && n->replyOption == TTYPE) {
+            message = doTtypeSend;
+            length = sizeof(doTtypeSend);
+        } else {
+            message = commands[n->replyVerb - WILL][n->replyOption];
+        }
+        w->clients.states[i] = CLIENT_TRICKLING;
+    } else {
+        message = negotiations[rand_r(&w->seed) % num_options];
+    }
+    eventloop_send(loop, w->clients.handlers[i].fd, message, length, clienttable_handle(&w->clients, i));
+}
+
+// The client stopped reading and its send buffer is full. It is tried again after an
+// exponential backoff, or once EPOLLOUT reports room with WAKE_ON_WRITABLE, and the time
+// until then is counted as stalled instead of wasted
+void stallClient(struct telnetWorker *w, uint32_t i, struct telnetClient *info) {
+    if (info->base.stalledSince == 0) info->base.stalledSince = w->loop.now;
+    if (info->base.stalls < UINT8_MAX) info->base.stalls++;
+
+    if (wakeOnWritable && eventloop_modify(&w->loop, &w->clients.handlers[i], EPOLLIN | EPOLLRDHUP | EPOLLOUT) == 0) {
+        return;
+    }
+    timerwheel_schedule(&w->clientQueue, &w->clients.timers[i], w->loop.now + backoffDelay(delay, info->base.stalls));
+}
+
+// Called once a negotiation was sent, right away or when io_uring completed it
+void onSendDone(struct eventLoop *loop, uint64_t handle, ssize_t result) {
+    struct telnetWorker *w = loop->data;
+    int64_t i = clienttable_lookup(&w->clients, handle);
+    if (i < 0) return; // Disconnected while the send was in flight
+
+    if (result < 0 && result != -EAGAIN && result != -EWOULDBLOCK) {
+        disconnectClient(w, i, true);
+        return;
+    }
+
+    struct telnetClient *info = clienttable_cold(&w->clients, i);
+    if (result < 0) {
+        stallClient(w, i, info);
+        return;
+    }
+    if (info->base.stalledSince != 0) {
+        STAT_ADD(w->stats.stalledTime, loop->now - info->base.stalledSince);
+        info->base.stalledSince = 0;
+        info->base.stalls = 0;
+        pacing_resume(&info->base.pacing, loop->now);
+    }
+    int interval = pacing_next(&w->pacing, &info->base.pacing, loop->now, result > 0 ? result : 0);
+    int wait = jitterDelay(interval, delayJitter, &w->seed);
+    w->clients.timeConnected[i] += wait;
+    STAT_ADD(w->stats.totalWastedTime, wait);
+    timerwheel_schedule(&w->clientQueue, &w->clients.timers[i], loop->now + wait);
+}
+
+// Answers a WILL, WONT, DO or DONT on the next tick with the opposite: whatever the client
+// agreed to is revoked, whatever it refused is asked for again. A terminal type is asked
+// for with DO and SB SEND at once
+void onCommand(struct telnetWorker *w, uint32_t i, struct telnetNegotiation *n, uint8_t verb, uint8_t option) {
+    static const uint8_t opposite[4] = {DONT, DO, WONT, WILL}; // Of WILL, WONT, DO and DONT
+    n->replyVerb = verb == WILL && option == TTYPE ? DO : opposite[verb - WILL];
+    n->replyOption = option;
+    w->clients.states[i] = TELNET_REPLY_PENDING;
+    STAT_ADD(w->stats.negotiationReplies, 1);
+}
+
+// Runs the negotiation parser over input. A later answer replaces one not sent yet
+void parseInput(struct telnetWorker *w, uint32_t i, const unsigned char *buf, size_t len) {
+    struct telnetNegotiation *n = &((struct telnetClient *)clienttable_cold(&w->clients, i))->negotiation;
+
+    for (size_t k = 0; k < len; k++) {
+        unsigned char ch = buf[k];
+        switch (n->parser) {
+            case PARSE_DATA: {
+                // Skip plain data (login attempts, commands) in one go
+                const unsigned char *iac = memchr(buf + k, IAC, len - k);
+                if (iac == NULL) return;
+                k = iac - buf;
+                n->parser = PARSE_IAC;
+                break;
+            }
+            case PARSE_IAC:
+                if (ch >= WILL && ch <= DONT) {
+                    n->arg = ch;
+                    n->parser = PARSE_VERB;
+                } else {
+                    n->parser = ch == SB ? PARSE_SB_OPTION : PARSE_DATA;
+                }
+                break;
+            case PARSE_VERB:
+                onCommand(w, i, n, n->arg, ch);
+                n->parser = PARSE_DATA;
+                break;
+            case PARSE_SB_OPTION:
+                n->arg = ch;
+                n->parser = PARSE_SB;
+                break;
+            case PARSE_SB:
+                if (ch == IAC) n->parser = PARSE_SB_IAC;
+                break;
+            case PARSE_SB_IAC:
+                if (ch != SE) {
+                    n->parser = PARSE_SB; // Escaped IAC inside the subnegotiation
+                    break;
+                }
+                // Reported a terminal type, ask for the next one
+                if (n->arg == TTYPE) {
+                    n->replyVerb = SB;
+                    n->replyOption = TTYPE;
+                    w->clients.states[i] = TELNET_REPLY_PENDING;
+                    STAT_ADD(w->stats.negotiationReplies, 1);
+                }
+                n->parser = PARSE_DATA;
+                break;
+        }
+    }
+}
+
+// Reads everything the client sent so it does not pile up in the kernel. The first keepInput
+// bytes are kept, negotiation replies are looked for in up to a scratch buffer per wakeup and
+// the rest is discarded. At most DRAIN_MAX bytes are read per event, so a client that keeps
+// its queue full cannot hold up the timers of the worker, epoll reports the rest again.
+// Returns false if the client is gone
+bool drainInput(struct telnetWorker *w, uint32_t i) {
+    int fd = w->clients.handlers[i].fd;
+    struct telnetClient *info = clienttable_cold(&w->clients, i);
+    size_t parseBudget = sizeof(scratch);
+    size_t drained = 0;
+
+    for (;;) {
+        ssize_t n;
+        size_t wanted;
+        unsigned char *buf;
+        if (info->inputKept < (uint32_t)keepInput) {
+            buf = info->input + info->inputKept;
+            wanted = keepInput - info->inputKept;
+            n = recv(fd, buf, wanted, MSG_DONTWAIT);
+            if (n > 0) info->inputKept += n;
+        } else if (parseBudget == 0 && __atomic_load_n(&discardWithTrunc, __ATOMIC_RELAXED)) {
+            buf = NULL;
+            wanted = DISCARD_MAX;
+            n = recv(fd, NULL, wanted, MSG_DONTWAIT | MSG_TRUNC);
+            if (n == -1 && errno == EFAULT) {
+                __atomic_store_n(&discardWithTrunc, false, __ATOMIC_RELAXED);
+                continue;
+            }
+        } else {
+            buf = scratch;
+            wanted = parseBudget > 0 ? parseBudget : sizeof(scratch);
+            n = recv(fd, scratch, wanted, MSG_DONTWAIT);
+        }
+
+        if (n > 0) {
+            STAT_ADD(w->stats.inputBytes, n);
+            if (buf != NULL && parseBudget > 0) {
+                size_t parsed = (size_t)n < parseBudget ? (size_t)n : parseBudget;
+                parseInput(w, i, buf, parsed);
+                parseBudget -= parsed;
+            }
+            if ((size_t)n < wanted) return true; // Nothing left for now, save the EAGAIN round trip
+            drained += n;
+            if (drained >= DRAIN_MAX) return true;
+            continue;
+        }
+        if (n == 0) return false;
+        if (errno == EINTR) continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+}
+
+void onClientEvent(struct eventLoop *loop, struct eventHandler *handler, uint32_t events) {
+    struct telnetWorker *w = loop->data;
+    uint32_t i = clienttable_handler_index(&w->clients, handler);
+
+    if ((events & EPOLLIN) && !drainInput(w, i)) {
+        disconnectClient(w, i, true);
+        return;
+    }
+    if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        disconnectClient(w, i, true);
+        return;
+    }
+    if (events & EPOLLOUT) {
+        // Room in the send buffer again, stop watching for it and send right away
+        eventloop_modify(loop, handler, EPOLLIN | EPOLLRDHUP);
+        timerwheel_schedule(&w->clientQueue, &w->clients.timers[i], loop->now);
+    }
+}
+
+// Evicts one of this worker's clients if the pit is out of budget. A victim is picked from
+// a few clients in a row from a random slot on, the table fills from the lowest slots so
+// only those below the high water mark are looked at. Returns false if the new client has
+// to be turned away
+bool makeRoom(struct telnetWorker *w) {
+    if (admission_fits(&admission, w->clients.coldSize)) return true;
+
+    int64_t victim = -1;
+    struct admissionCandidate best;
+    uint32_t highWater = w->clients.highWater;
+    if (admission.policy != EVICT_NONE && w->clients.length > 0) {
+        uint32_t start = rand_r(&w->seed) % highWater;
+        for (uint32_t k = 0, sampled = 0; sampled < ADMISSION_SAMPLES && k < highWater && k < 4 * ADMISSION_SAMPLES; k++) {
+            uint32_t i = (start + k) % highWater;
+            if (w->clients.states[i] == CLIENT_FREE) continue;
+            sampled++;
+            struct telnetClient *info = clienttable_cold(&w->clients, i);
+            struct admissionCandidate candidate = {info->base.prefix, w->clients.timeConnected[i]};
+            if (admission_prefer(&admission, &candidate, victim < 0 ? NULL : &best)) {
+                best = candidate;
+                victim = i;
+            }
+        }
+    }
+    if (victim < 0) {
+        admission_refused(&admission);
+        return false;
+    }
+    admission_evicted(&admission);
+    disconnectClient(w, victim, false);
+    return true;
+}
+
+void acceptNewClient(struct telnetWorker *w, int clientFd, struct sockaddr_in *clientAddr) {
+    // A source over its cap is turned away before anyone is evicted for it
+    uint64_t source = sourcetable_key(&sources, (struct sockaddr *)clientAddr);
+    if (!sourcetable_admit(&sources, &source, w->loop.now)) {
+        close(clientFd);
+        return;
+    }
+    if (!makeRoom(w)) {
+        sourcetable_release(&sources, source);
+        close(clientFd);
+        return;
+    }
+
+    clientHandle handle = clienttable_add(&w->clients, CLIENT_TRICKLING);
+    if (handle == CLIENT_HANDLE_NONE) {
+        fprintf(stderr, "Client table full");
+        sourcetable_release(&sources, source);
+        close(clientFd);
+        return;
+    }
+    uint32_t i = clienttable_index(handle);
+
+    peersweep_configure(&w->sweep, clientFd);
+    if (eventloop_add(&w->loop, &w->clients.handlers[i], clientFd, EPOLLIN | EPOLLRDHUP, onClientEvent, NULL) == -1) {
+        fprintf(stderr, "Failed adding client to epoll with error %s", strerror(errno));
+        sourcetable_release(&sources, source);
+        close(clientFd);
+        clienttable_remove(&w->clients, i);
+        return;
+    }
+
+    STAT_ADD(w->stats.totalConnects, 1);
+    struct telnetClient *info = clienttable_cold(&w->clients, i);
+    info->base.source = source;
+    inet_ntop(AF_INET, &clientAddr->sin_addr, info->base.ipaddr, INET_ADDRSTRLEN);
+    info->base.prefix = addressPrefix(info->base.ipaddr);
+    admission_add(&admission, info->base.prefix, w->clients.coldSize);
+    int interval = pacing_start(&w->pacing, &info->base.pacing, info->base.ipaddr, w->loop.now);
+    timerwheel_schedule(&w->clientQueue, &w->clients.timers[i], w->loop.now + jitterDelay(interval, delayJitter, &w->seed));
+
+    int connected = (int)w->clients.length;
+    STAT_SET(w->stats.connectedClients, connected);
+    if(w->stats.mostConcurrentConnections < connected) {
+        STAT_SET(w->stats.mostConcurrentConnections, connected);
+    }
+
+    printf("%s connect %s\n", SERVER_ID, info->base.ipaddr);
+    metric_address(METRIC_CONNECT, info->base.ipaddr);
+}
+
+// Drains the backlog, but at most acceptBudget connections before due clients get a turn
+void onAccept(struct eventLoop *loop, struct eventHandler *handler, uint32_t events) {
+    (void)events;
+    for (int i = 0; i < acceptBudget; i++) {
+        struct sockaddr_in clientAddr;
+        int clientFd = acceptClient(handler->fd, &clientAddr);
+        if(clientFd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "Failed accepting new client with error %s", strerror(errno));
+            }
+            return;
+        }
+        acceptNewClient(loop->data, clientFd, &clientAddr);
+    }
+}
+
+void *runWorker(void *arg) {
+    struct telnetWorker *w = arg;
+    eventloop_run(&w->loop);
+    return NULL;
+}
+
+// Everything a worker needs except its listener and thread, the simulation in sim/ starts here
+void initWorker(struct telnetWorker *w, int id) {
+    w->id = id;
+    w->seed = (unsigned int)time(NULL) ^ (unsigned int)id;
+    timerwheel_init(&w->clientQueue, currentTimeMs());
+    // Sized for every client, the kernel does not split SO_REUSEPORT connections evenly
+    clienttable_init(&w->clients, SERVER_ID, maxNoClients, sizeof(struct telnetClient) + keepInput);
+    eventloop_init(&w->loop, maxNoClients / workerCount + 1, &w->clientQueue, onClientDue);
+    eventloop_init_sends(&w->loop, onSendDone);
+    pacing_init(&w->pacing, delay);
+    peersweep_init(&w->sweep);
+    timerwheel_node_init(&w->sweepTimer);
+    if (w->sweep.timeoutMs > 0) {
+        timerwheel_schedule(&w->clientQueue, &w->sweepTimer, currentTimeMs() + PEER_SWEEP_TICK_MS);
+    }
+    w->loop.data = w;
+}
+
+void startWorker(struct telnetWorker *w, int id) {
+    initWorker(w, id);
+
+    // A single worker keeps the plain listener, so a second instance on the port still fails to bind
+    w->serverSock = workerCount > 1 ? createReusePortServer(port) : createServer(port);
+    if (w->serverSock < 0) {
+        fprintf(stderr, "Invalid server socket fd: %d", w->serverSock);
+        exit(EXIT_FAILURE);
+    }
+
+    if (eventloop_add(&w->loop, &w->listener, w->serverSock, EPOLLIN, onAccept, NULL) == -1) {
+        fprintf(stderr, "epoll_ctl: server_sock");
+        exit(EXIT_FAILURE);
+    }
+
+    int r = pthread_create(&w->thread, NULL, runWorker, w);
+    if (r != 0) {
+        fprintf(stderr, "Failed starting worker %d with error %s\n", id, strerror(r));
+        exit(EXIT_FAILURE);
+    }
 }
 
 int main(int argc, char *argv[]) {
     setbuf(stdout, NULL);
+    metrics_init(PIT_TELNET);
     
     // testing
     // char msg[256];
@@ -63,115 +592,35 @@ int main(int argc, char *argv[]) {
     (void)argc;
     port = atoi(argv[1]);
     delay = atoi(argv[2]);
+    delayJitter = configInt("DELAY_JITTER", 0);
     maxNoClients = atoi(argv[3]);
+    acceptBudget = configInt("ACCEPT_BUDGET", DEFAULT_ACCEPT_BUDGET);
+    if (acceptBudget < 1) acceptBudget = 1;
+    keepInput = configInt("KEEP_INPUT", 0);
+    wakeOnWritable = configInt("WAKE_ON_WRITABLE", 0);
+    workerCount = configInt("WORKERS", 1);
+    if (workerCount < 1) workerCount = 1;
     initializeStats();
     setFdLimit(maxNoClients);
     signal(SIGPIPE, SIG_IGN); // Ignore 
-    queue_init(&clientQueueTelnet);
-    
-    int serverSock = createServer(port);
-    if (serverSock < 0) {
-        fprintf(stderr, "Invalid server socket fd: %d", serverSock);
+
+    initNegotiation();
+    admission_init(&admission, SERVER_ID, maxNoClients);
+    sourcetable_init(&sources, maxNoClients);
+    workers = calloc(workerCount, sizeof(struct telnetWorker));
+    if (!workers) {
+        fprintf(stderr, "Out of memory");
         exit(EXIT_FAILURE);
     }
-    
-    struct sockaddr_in clientAddr;
-    socklen_t addrLen = sizeof(clientAddr);
-    
-    struct pollfd fds;
-    memset(&fds, 0, sizeof(fds));
-    fds.fd = serverSock;
-    fds.events = POLLIN;
-    
-    // long long lastHeartbeat = currentTimeMs();
-    while (1) {
-        long long now = currentTimeMs();
-        int timeout = -1;
-
-        // if (now - lastHeartbeat >= HEARTBEAT_INTERVAL_MS) {
-        //     heartbeatLog();
-        //     lastHeartbeat = now;
-        // }
-
-        // Process clients in queue
-        while (clientQueueTelnet.head) {
-            if(clientQueueTelnet.head->sendNext <= now){
-                struct baseClient *bc = queue_pop(&clientQueueTelnet);
-                struct telnetAndUpnpClient *c = (struct telnetAndUpnpClient *)bc;
-                
-                int optionIndex = rand() % num_options;
-                ssize_t out = write(c->fd, negotiations[optionIndex], sizeof(negotiations[optionIndex]));
-                
-                if (out == -1) {
-                    if (errno == EAGAIN || errno == EWOULDBLOCK) { // Avoid blocking
-                        c->base.sendNext = now + delay;
-                        c->base.timeConnected += delay;
-                        statsTelnet.totalWastedTime += delay;
-                        queue_append(&clientQueueTelnet, (struct baseClient *)c);
-                    } else {
-                        long long timeTrapped = c->base.timeConnected;
-                        char msg[256];
-                        snprintf(msg, sizeof(msg), "%s disconnect %s %lld\n",
-                            SERVER_ID, c->base.ipaddr, timeTrapped);
-                        printf("%s", msg);
-                        sendMetric(msg);
-                        close(c->fd);
-                        free(c);
-                    }
-                } else {
-                    c->base.sendNext = now + delay;
-                    c->base.timeConnected += delay;
-                    statsTelnet.totalWastedTime += delay;
-                    queue_append(&clientQueueTelnet, (struct baseClient *)c);
-                }
-            } else {
-                timeout = clientQueueTelnet.head->sendNext - now;
-                break;
-            }
-        }
-        
-        int pollResult = poll(&fds, 1, timeout);
-        now = currentTimeMs(); // Poll will cause old value to be misrepresenting
-        if (pollResult < 0) {
-            fprintf(stderr, "Poll error with error %s", strerror(errno));
-            continue;
-        }
-
-        // Accept new connections
-        if (fds.revents & POLLIN) {
-            int clientFd = accept(serverSock, (struct sockaddr *)&clientAddr, &addrLen);
-            if(clientFd == -1) {
-                fprintf(stderr, "Failed accepting new client with error %s", strerror(errno));
-                continue;
-            }
-
-            fcntl(clientFd, F_SETFL, O_NONBLOCK); // Set non-blocking mode
-            struct telnetAndUpnpClient* newClient = malloc(sizeof(struct telnetAndUpnpClient));
-            if (!newClient) {
-                fprintf(stderr, "Out of memory");
-                close(clientFd);
-                continue;
-            }
-
-            statsTelnet.totalConnects += 1;
-            newClient->fd = clientFd;
-            newClient->base.sendNext = now + delay;
-            newClient->base.timeConnected = 0;
-            snprintf(newClient->base.ipaddr, INET_ADDRSTRLEN, "%s", inet_ntoa(clientAddr.sin_addr));
-            queue_append(&clientQueueTelnet, (struct baseClient*)newClient);
-
-            if(statsTelnet.mostConcurrentConnections < clientQueueTelnet.length) {
-                statsTelnet.mostConcurrentConnections = clientQueueTelnet.length;
-            }
+    for (int i = 0; i < workerCount; i++) {
+        startWorker(&workers[i], i);
+    }
 
-            char msg[256];
-            snprintf(msg, sizeof(msg), "%s connect %s\n",
-                SERVER_ID, newClient->base.ipaddr);
-            printf("%s", msg);
-            sendMetric(msg);
-        }
+    // The main thread only reports, the workers never return
+    for (;;) {
+        sleep(HEARTBEAT_INTERVAL_MS / 1000);
+        heartbeatLog();
     }
 
-    close(serverSock);
     return 0;
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // recvmmsg, sendmmsg
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,25 +7,82 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
-#include <poll.h>
 #include <errno.h>
-#include <fcntl.h>
 #include <netdb.h>
 #include <signal.h>
 #include <ifaddrs.h>
+#include <time.h>
 #include "../shared/structs.h"
 
 #define SSDP_MULTICAST "239.255.255.250"
 #define SERVER_ID "UPnP"
+#define HEARTBEAT_INTERVAL_MS 600000 // 10 minutes
+#define CLIENT_READING 2 // Client table state while the request arrives, the client is not trapped yet
+#define REQUEST_TIMEOUT_MS 60000 // How long a client may take to send the head of its request
+
+// What a trapped client is being sent: the response head with the description, chunks,
+// and once RESPONSE_CHUNKS of them went out the last chunk that ends the response
+enum upnpFrame { FRAME_HEAD, FRAME_CHUNK, FRAME_END };
+#define SSDP_BATCH 64 // Datagrams received, and answers sent, per syscall
+#define SSDP_DATAGRAM_MAX 1024 // Longer requests are cut, only their start is looked at
 
 int httpPort;
 int ssdpPort;
 int delay;
+int delayJitter; // Most ms added to a delay, spreads clients accepted in a burst
+unsigned int jitterSeed;
+struct pacing pacing; // Of the HTTP loop
+struct peerSweep sweep; // Of the HTTP loop
+struct timerNode sweepTimer; // In clientQueueUpnp with the clients
+struct admission admission; // Of the HTTP loop
+struct sourceTable sources;
 int maxNoClients;
+int acceptBudget;
+int wakeOnWritable; // Park clients with a full send buffer on EPOLLOUT instead of retrying with backoff
+uint32_t responseChunks; // Chunks before a response ends and a keep-alive client may ask again, 0 never ends
+struct personaSet personas; // Loaded before the server threads start, only read after
+struct eventLoop httpLoop;
+struct eventHandler httpListener;
+struct clientTable clients;
+struct slabPool requestPool; // Request buffers of the clients in CLIENT_READING
+
+// Cold record of an HTTP client. It holds a request buffer while a request is read, and
+// while a response is sent if more requests were pipelined behind it
+struct upnpClient {
+    struct trickleClient base;
+    struct httpParser *request;
+    struct persona *persona; // Device it is shown, the same one SSDP answered its source with
+    bool connected;      // Trapped at least once, so its connect was logged
+    bool keepAlive;      // Reads the next request once the response is complete
+    uint8_t frame;       // enum upnpFrame
+    uint16_t frameSent;  // Bytes of the frame a short send got out, the rest goes first
+    uint32_t chunksSent; // Of the current response
+};
+
+// Each SSDP worker owns a socket on the shared port and its batch buffers
+struct ssdpWorker {
+    int fd;
+    pthread_t thread;
+    struct eventLoop loop;
+    struct eventHandler handler;
+    unsigned long requests;  // Read by the heartbeat with relaxed atomics
+    unsigned long msearches;
+    unsigned long others;
+    unsigned long answers;
+    struct mmsghdr messages[SSDP_BATCH];
+    struct iovec iovecs[SSDP_BATCH];
+    struct sockaddr_in addresses[SSDP_BATCH];
+    struct mmsghdr replies[SSDP_BATCH];
+    char buffers[SSDP_BATCH][SSDP_DATAGRAM_MAX];
+};
+
+int ssdpWorkerCount;
+struct ssdpWorker *ssdpWorkers;
+struct rateLimiter ssdpLimiter; // Shared by the workers, so the rates hold however many there are
 
 // Can use Chunked Transfer Coding from rfc 2616 section 3.6.1
 // Required to be a HTTP GET request (Section 2.1 from specifications)
-const char *FAKE_DEVICE_DESCRIPTION =
+const char FAKE_DEVICE_DESCRIPTION[] =
     "<?xml version=\"1.0\"?>\n"
     "<root xmlns=\"urn:Philips:device-1-0\">\n"
     "  <specVersion>\n"
@@ -58,7 +116,7 @@ const char *FAKE_DEVICE_DESCRIPTION =
     "    </iconList>\n"
     "    <serviceList>\n";
 
-const char *FAKE_CHUNK =
+const char FAKE_CHUNK[] =
     "      <service>\n"
     "        <serviceType>urn:Philips:service:SwitchPower:1</serviceType>\n"
     "        <serviceId>urn:upnp-org:serviceId:SwitchPower</serviceId>\n"
@@ -67,11 +125,38 @@ const char *FAKE_CHUNK =
     "        <SCPDURL>/hue_service.xml</SCPDURL>\n"
     "      </service>\n";
 
-// void heartbeatLog() {
-//     syslog(LOG_INFO, "Server is running with %d connected clients. Number of most concurrent connected clients is %d", clientQueueUpnp.length, statsUpnp.mostConcurrentConnections);
-//     syslog(LOG_INFO, "Current statistics: wasted time: %lld ms. Total HTTP requests: %ld. Total other HTTP requests: %ld. SSDP responses: %ld. XML requests: %ld", 
-//         statsUpnp.totalWastedTime, statsUpnp.totalHttpRequests, statsUpnp.otherHttpRequests, statsUpnp.ssdpResponses, statsUpnp.totalXmlRequests);
-// }
+// The persona of every client unless PERSONA_DIR names a directory of them, see shared/persona.h
+#define PERSONA_TEXT(s) {s, sizeof(s) - 1}
+const struct personaSource FAKE_PERSONA = {
+    PERSONA_TEXT("hue"),
+    PERSONA_TEXT("Linux/3.14 UPnP/1.0 PhilipsHue/2.1"),
+    PERSONA_TEXT("urn:Philips:device:Basic:1"),
+    PERSONA_TEXT("uuid:bd752e88-91a9-49e4-8297-8433e05d1c22::urn:Philips:device:Basic:1"),
+    PERSONA_TEXT("/hue-device.xml"),
+    PERSONA_TEXT(FAKE_DEVICE_DESCRIPTION),
+    PERSONA_TEXT(FAKE_CHUNK)
+};
+
+const char END_FRAME[] = "0\r\nX-Checksum: 9f86d081\r\n\r\n"; // Last chunk and the announced trailer
+
+// Only reads counters the HTTP thread and the SSDP workers keep with relaxed atomics
+void heartbeatLog() {
+    unsigned long requests = 0, msearches = 0, others = 0, answers = 0;
+    for (int i = 0; i < ssdpWorkerCount; i++) {
+        requests += __atomic_load_n(&ssdpWorkers[i].requests, __ATOMIC_RELAXED);
+        msearches += __atomic_load_n(&ssdpWorkers[i].msearches, __ATOMIC_RELAXED);
+        others += __atomic_load_n(&ssdpWorkers[i].others, __ATOMIC_RELAXED);
+        answers += __atomic_load_n(&ssdpWorkers[i].answers, __ATOMIC_RELAXED);
+    }
+    printf("SSDP: %lu requests, %lu M-SEARCH, %lu other, %lu answered, %lu over the rate limit\n", requests, msearches,
+        others, answers, __atomic_load_n(&ssdpLimiter.limited, __ATOMIC_RELAXED));
+    admission_report(&admission);
+    sourcetable_report(&sources, SERVER_ID);
+    printf("Stalled time: %llu ms. Dead peers: %lu\n", __atomic_load_n(&statsUpnp.stalledTime, __ATOMIC_RELAXED),
+        __atomic_load_n(&statsUpnp.deadPeers, __ATOMIC_RELAXED));
+    clienttable_report(&clients);
+    eventloop_report(&httpLoop, SERVER_ID);
+}
 
 char* getLocalIpAddress() {
     struct ifaddrs *ifaddr, *ifa;
@@ -99,40 +184,89 @@ char* getLocalIpAddress() {
     return NULL;  // No valid IP found
 }
 
-char* ssdpResponse() {
-    char *ipAddress = getLocalIpAddress();
-
-    char *responseBuffer = (char*) malloc((512)*sizeof(char));
-    snprintf(responseBuffer, 512,
-        "HTTP/1.1 200 OK\r\n"
-        "CACHE-CONTROL: max-age=1800\r\n"
-        "EXT:\r\n"
-        "LOCATION: http://%s:%d/hue-device.xml\r\n"
-        "SERVER: Linux/3.14 UPnP/1.0 PhilipsHue/2.1\r\n"
-        "ST: urn:Philips:device:Basic:1\r\n"
-        "USN: uuid:bd752e88-91a9-49e4-8297-8433e05d1c22::urn:Philips:device:Basic:1\r\n"
-        "BOOTID.UPNP.ORG: 1\r\n"
-        "CONFIGID.UPNP.ORG: 1337\r\n"
-        "\r\n", ipAddress, httpPort);
-    return responseBuffer;
+// Compiles the personas, whose SSDP answers point at this host and httpPort
+void loadPersonas() {
+    const char *host = getLocalIpAddress();
+    if (host == NULL) host = "127.0.0.1";
+    const char *dir = getenv("PERSONA_DIR");
+    if (dir == NULL || dir[0] == '\0') {
+        persona_add(&personas, &FAKE_PERSONA, host, httpPort);
+        return;
+    }
+    if (persona_load(&personas, dir, host, httpPort) <= 0) {
+        fprintf(stderr, "No personas loaded from %s\n", dir);
+        exit(EXIT_FAILURE);
+    }
+    printf("%s personas: %u loaded from %s\n", SERVER_ID, personas.count, dir);
 }
 
-// Handles SSDP discovery requests and sends fake responses
-void *ssdpListener(void *arg) {
-    (void)arg;
-    char* response = ssdpResponse();
-    int sockFd;
-    struct sockaddr_in serverAddr, client_addr;
-    socklen_t addrLen = sizeof(client_addr);
-    char buffer[1024];
+// Receives a batch of datagrams and answers the M-SEARCHes among them with one sendmmsg.
+// Sources over their rate are not answered, so a flood costs a bounded amount of answers.
+// Datagrams are not logged one by one, each batch goes out as one metric and the totals
+// in the heartbeat
+void onSsdpRequest(struct eventLoop *loop, struct eventHandler *handler, uint32_t events) {
+    (void)events;
+    struct ssdpWorker *w = loop->data;
+    for (int k = 0; k < SSDP_BATCH; k++) {
+        w->messages[k].msg_hdr.msg_namelen = sizeof(w->addresses[k]);
+    }
+    int received = recvmmsg(handler->fd, w->messages, SSDP_BATCH, MSG_DONTWAIT, NULL);
+    if (received <= 0) {
+        if (received == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            fprintf(stderr, "Error receiving SSDP request");
+        }
+        return;
+    }
 
-    // printf("response: %s\n", response);
+    int answers = 0, others = 0, limited = 0;
+    for (int k = 0; k < received; k++) {
+        struct sockaddr_in *addr = &w->addresses[k];
+        uint32_t prefix = (ntohl(addr->sin_addr.s_addr) >> 8) + 1; // The /24, like addressPrefix
+        if (!ratelimit_allow(&ssdpLimiter, prefix, loop->now)) {
+            limited++;
+            continue;
+        }
 
-    if ((sockFd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) { // works
+        // The method starts the request, no need to search all of it
+        if (w->messages[k].msg_len >= 8 && memcmp(w->buffers[k], "M-SEARCH", 8) == 0) {
+            w->replies[answers].msg_hdr.msg_iov = &persona_for(&personas, ntohl(addr->sin_addr.s_addr))->ssdpReply;
+            w->replies[answers].msg_hdr.msg_name = addr;
+            w->replies[answers].msg_hdr.msg_namelen = sizeof(*addr);
+            answers++;
+        } else {
+            others++;
+        }
+    }
+
+    int sent = answers > 0 ? sendmmsg(handler->fd, w->replies, answers, MSG_DONTWAIT) : 0;
+    if (sent < 0) sent = 0;
+    __atomic_fetch_add(&w->requests, received, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&w->msearches, answers, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&w->others, others, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&w->answers, sent, __ATOMIC_RELAXED);
+    metric_ssdp(received, answers, others, sent, limited);
+}
+
+void *runSsdpWorker(void *arg) {
+    struct ssdpWorker *w = arg;
+    eventloop_run(&w->loop);
+    return NULL;
+}
+
+void startSsdpWorker(struct ssdpWorker *w) {
+    struct sockaddr_in serverAddr;
+    if ((w->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0) { // works
         fprintf(stderr, "SSDP Socket creation failed");
         exit(EXIT_FAILURE);
     }
 
+    // A single worker keeps the plain socket, so a second instance on the port still fails to bind
+    int value = 1;
+    if (ssdpWorkerCount > 1 && setsockopt(w->fd, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value)) == -1) {
+        fprintf(stderr, "SSDP setsockopt SO_REUSEPORT failed");
+        exit(EXIT_FAILURE);
+    }
+
     // Bind to all interfaces for unicast
     memset(&serverAddr, 0, sizeof(serverAddr));
     serverAddr.sin_family = AF_INET;
@@ -145,206 +279,466 @@ void *ssdpListener(void *arg) {
     // mreq.imr_interface.s_addr = INADDR_ANY;
     // setsockopt(sockFd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
 
-    if (bind(sockFd, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0) {
+    if (bind(w->fd, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0) {
         fprintf(stderr, "SSDP Bind failed");
-        close(sockFd);
+        close(w->fd);
         exit(EXIT_FAILURE);
     }
 
-    printf("UPnP listener started on port %d\n", ssdpPort);
+    for (int k = 0; k < SSDP_BATCH; k++) {
+        w->iovecs[k].iov_base = w->buffers[k];
+        w->iovecs[k].iov_len = SSDP_DATAGRAM_MAX;
+        w->messages[k].msg_hdr.msg_iov = &w->iovecs[k];
+        w->messages[k].msg_hdr.msg_iovlen = 1;
+        w->messages[k].msg_hdr.msg_name = &w->addresses[k];
+        w->replies[k].msg_hdr.msg_iovlen = 1;
+    }
+    eventloop_init(&w->loop, 1, NULL, NULL);
+    w->loop.data = w;
+    if (eventloop_add(&w->loop, &w->handler, w->fd, EPOLLIN, onSsdpRequest, NULL) == -1) {
+        fprintf(stderr, "epoll_ctl: ssdp socket");
+        exit(EXIT_FAILURE);
+    }
+    pthread_create(&w->thread, NULL, runSsdpWorker, w);
+}
 
-    while (1) {
-        memset(buffer, 0, sizeof(buffer));
+void startSsdpWorkers() {
+    ratelimit_init(&ssdpLimiter, configInt("SSDP_RATE", 0), configInt("SSDP_BURST", 4), configInt("SSDP_TOTAL_RATE", 0));
+    ssdpWorkerCount = configInt("SSDP_WORKERS", 1);
+    if (ssdpWorkerCount < 1) ssdpWorkerCount = 1;
+    ssdpWorkers = calloc(ssdpWorkerCount, sizeof(struct ssdpWorker));
+    if (!ssdpWorkers) {
+        fprintf(stderr, "Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < ssdpWorkerCount; i++) {
+        startSsdpWorker(&ssdpWorkers[i]);
+    }
+    printf("UPnP listener started on port %d with %d workers\n", ssdpPort, ssdpWorkerCount);
+}
 
-        if (recvfrom(sockFd, buffer, sizeof(buffer), 0,
-                     (struct sockaddr *)&client_addr, &addrLen) <= 0) {
-            fprintf(stderr, "Error receiving SSDP request");
-            continue;
+// Written by the HTTP thread, read by the heartbeat
+void addStalledTime(long long ms) {
+    __atomic_store_n(&statsUpnp.stalledTime, statsUpnp.stalledTime + ms, __ATOMIC_RELAXED);
+}
+
+// left is false when the pit drops the client, then pacing does not learn from it
+void disconnectClient(uint32_t i, bool left) {
+    struct upnpClient *info = clienttable_cold(&clients, i);
+    size_t bytes = clients.coldSize + (info->request != NULL ? sizeof(struct httpParser) : 0);
+    slab_free(&requestPool, info->request);
+    if (info->connected) {
+        // Clients never trapped have no connect to match
+        long long timeTrapped = clients.timeConnected[i];
+        if (info->base.stalledSince != 0) {
+            addStalledTime(httpLoop.now - info->base.stalledSince);
+        } else if (left && clients.states[i] == CLIENT_TRICKLING) {
+            pacing_lost(&pacing, &info->base.pacing, httpLoop.now);
         }
+        printf("%s disconnect %s %lld\n", SERVER_ID, info->base.ipaddr, timeTrapped);
+        metric_disconnect(info->base.ipaddr, timeTrapped);
+    }
+    admission_remove(&admission, info->base.prefix, bytes);
+    sourcetable_release(&sources, info->base.source);
 
-        char client_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-        
-        char msg[256];
-        int isMSearch = strstr(buffer, "M-SEARCH") != NULL;
-
-        if (isMSearch) {
-            sendto(sockFd, response, strlen(response), 0,
-                (struct sockaddr *)&client_addr, sizeof(client_addr));
-            
-            snprintf(msg, sizeof(msg), "%s M-SEARCH %s\n", 
-                SERVER_ID, client_ip);
-        } else {
-            snprintf(msg, sizeof(msg), "%s non-M-SEARCH %s\n", 
-                SERVER_ID, client_ip);
+    timerwheel_cancel(&clientQueueUpnp, &clients.timers[i]);
+    eventloop_remove(&httpLoop, &clients.handlers[i]);
+    close(clients.handlers[i].fd);
+    clienttable_remove(&clients, i);
+}
+
+// Logs a request for anything but the device description
+void logOtherRequest(const struct httpParser *request) {
+    const char *method = httpparser_method(request);
+    const char *url = httpparser_url(request);
+
+    // prometheus handles stats
+    // statsUpnp.otherHttpRequests += 1;
+    printf("%s otherHttpRequests %s %s\n", SERVER_ID, method, url);
+    metric_strings(METRIC_UPNP_OTHER_HTTP, method, url);
+}
+
+// Closes the connection of a request that was cut off, malformed or too slow, logged with
+// what was parsed of it
+void refuseRequest(uint32_t i) {
+    struct upnpClient *info = clienttable_cold(&clients, i);
+    statsUpnp.totalHttpRequests += 1;
+    logOtherRequest(info->request);
+    disconnectClient(i, false);
+}
+
+// Checks the next slice of the client table for peers that are gone
+void sweepPeers(long long now) {
+    uint32_t first;
+    uint32_t count = peersweep_slice(&sweep, clients.capacity, &first);
+    for (uint32_t k = 0; k < count; k++) {
+        uint32_t i = (first + k) % clients.capacity;
+        if (clients.states[i] == CLIENT_FREE) continue;
+        if (!peersweep_alive(&sweep, clients.handlers[i].fd)) {
+            __atomic_store_n(&statsUpnp.deadPeers, statsUpnp.deadPeers + 1, __ATOMIC_RELAXED);
+            disconnectClient(i, false);
         }
-        
-        printf("%s", msg);
-        sendMetric(msg);
     }
+    peersweep_report(&sweep, now);
+    timerwheel_schedule(&clientQueueUpnp, &sweepTimer, now + PEER_SWEEP_TICK_MS);
+}
 
-    free(ssdpResponse);
-    close(sockFd);
-    return NULL;
+// The frame a trapped client is sending
+const char *currentFrame(const struct upnpClient *info, size_t *length) {
+    switch (info->frame) {
+        case FRAME_HEAD:
+            *length = info->persona->headLength;
+            return info->persona->head;
+        case FRAME_CHUNK:
+            *length = info->persona->chunkLength;
+            return info->persona->chunk;
+        default:
+            *length = sizeof(END_FRAME) - 1;
+            return END_FRAME;
+    }
 }
 
-void *httpServer(void *arg) {
-    (void)arg;
-    signal(SIGPIPE, SIG_IGN);
-    queue_init(&clientQueueUpnp);
-    int serverSock = createServer(httpPort);
-    if (serverSock < 0) {
-        fprintf(stderr, "Invalid server socket fd: %d", serverSock);
-        exit(EXIT_FAILURE);
+// Called when a client is due for its next chunk
+void onClientDue(struct eventLoop *loop, struct timerNode *node, long long now) {
+    if (node == &sweepTimer) {
+        sweepPeers(now);
+        return;
     }
+    uint32_t i = clienttable_timer_index(&clients, node);
+    struct upnpClient *info = clienttable_cold(&clients, i);
+    if (clients.states[i] == CLIENT_READING) {
+        // Its request did not arrive in time. Idle between two requests is no request at all
+        if (info->connected && info->request->length == 0) disconnectClient(i, false);
+        else refuseRequest(i);
+        return;
+    }
+    size_t length;
+    const char *frame = currentFrame(info, &length);
+    eventloop_send(loop, clients.handlers[i].fd, frame + info->frameSent, length - info->frameSent,
+        clienttable_handle(&clients, i));
+}
 
-    struct sockaddr_in clientAddr;
-    socklen_t addrLen = sizeof(clientAddr);
-    
-    struct pollfd fds;
-    memset(&fds, 0, sizeof(fds));
-    fds.fd = serverSock;
-    fds.events = POLLIN;
+// The client stopped reading and its send buffer is full. It is tried again after an
+// exponential backoff, or once EPOLLOUT reports room with WAKE_ON_WRITABLE, and the time
+// until then is counted as stalled instead of wasted
+void stallClient(uint32_t i, struct trickleClient *info) {
+    if (info->stalledSince == 0) info->stalledSince = httpLoop.now;
+    if (info->stalls < UINT8_MAX) info->stalls++;
 
-    // long long lastHeartbeat = currentTimeMs();
-    while (1){
-        long long now = currentTimeMs();
-        int timeout = -1;
-
-        // long long res = now - lastHeartbeat;
-
-        // if (res >= HEARTBEAT_INTERVAL_MS) {
-        //     heartbeatLog();
-        //     lastHeartbeat = now;
-        // }
-
-        while (clientQueueUpnp.head) {
-            if(clientQueueUpnp.head->sendNext <= now){
-                struct baseClient *bc = queue_pop(&clientQueueUpnp);
-                struct telnetAndUpnpClient *c = (struct telnetAndUpnpClient *)bc;
-
-                char chunk_size[10];
-                snprintf(chunk_size, sizeof(chunk_size), "%X\r\n", (int)strlen(FAKE_CHUNK));
-                write(c->fd, chunk_size, strlen(chunk_size));
-                write(c->fd, FAKE_CHUNK, strlen(FAKE_CHUNK));
-                ssize_t out = write(c->fd, "\r\n", 2);
-                
-                if (out == -1) {
-                    if (errno == EAGAIN || errno == EWOULDBLOCK) { // Avoid blocking
-                        c->base.sendNext = now + delay;
-                        c->base.timeConnected += delay;
-                        statsUpnp.totalWastedTime += delay;
-                        queue_append(&clientQueueUpnp, (struct baseClient *)c);
-                    } else {
-                        long long timeTrapped = c->base.timeConnected;
-
-                        char msg[256];
-                        snprintf(msg, sizeof(msg), "%s disconnect %s %lld\n",
-                            SERVER_ID, c->base.ipaddr, timeTrapped);
-                        printf("%s", msg);
-                        sendMetric(msg);
-
-                        close(c->fd);
-                        free(c);
-                    }
-                } else {
-                    c->base.sendNext = now + delay;
-                    c->base.timeConnected += delay;
-                    statsUpnp.totalWastedTime += delay;
-                    queue_append(&clientQueueUpnp, (struct baseClient *)c);
-                }
-            } else {
-                timeout = clientQueueUpnp.head->sendNext - now;
-                break;
-            }
-        }
+    if (wakeOnWritable && eventloop_modify(&httpLoop, &clients.handlers[i], EPOLLRDHUP | EPOLLOUT) == 0) {
+        return;
+    }
+    timerwheel_schedule(&clientQueueUpnp, &clients.timers[i], httpLoop.now + backoffDelay(delay, info->stalls));
+}
 
-        int pollResult = poll(&fds, 1, timeout);
-        now = currentTimeMs(); // Poll will cause old value to be misrepresenting
-        if (pollResult < 0) {
-            fprintf(stderr, "Poll error with error %s", strerror(errno));
-            continue;
+void answerRequest(struct eventLoop *loop, uint32_t i, enum httpParseState state);
+
+// The last chunk went out. A keep-alive client may send its next request, which may be
+// waiting in the buffer already, everyone else is let go
+void finishResponse(struct eventLoop *loop, uint32_t i) {
+    struct upnpClient *info = clienttable_cold(&clients, i);
+    if (!info->keepAlive) {
+        disconnectClient(i, false);
+        return;
+    }
+    if (info->request == NULL) {
+        info->request = slab_alloc(&requestPool);
+        if (info->request == NULL) {
+            fprintf(stderr, "Out of memory");
+            disconnectClient(i, false);
+            return;
         }
+        admission_charge(&admission, sizeof(struct httpParser));
+        httpparser_init(info->request);
+    }
 
-        // Accept new connections
-        if (fds.revents & POLLIN) {
-            int clientFd = accept(serverSock, (struct sockaddr *)&clientAddr, &addrLen);
-            if(clientFd == -1) {
-                fprintf(stderr, "Failed accepting new client with error %s", strerror(errno));
-                continue;
-            }
-            statsUpnp.totalHttpRequests += 1;
-            fcntl(clientFd, F_SETFL, O_NONBLOCK); // Set non-blocking mode
-            struct telnetAndUpnpClient* newClient = malloc(sizeof(struct telnetAndUpnpClient));
-            if (newClient == NULL) {
-                fprintf(stderr, "Out of memory");
-                close(clientFd);
-                continue;
+    clients.states[i] = CLIENT_READING;
+    info->frame = FRAME_HEAD;
+    info->chunksSent = 0;
+    eventloop_modify(loop, &clients.handlers[i], EPOLLIN | EPOLLRDHUP);
+    timerwheel_schedule(&clientQueueUpnp, &clients.timers[i], loop->now + REQUEST_TIMEOUT_MS);
+    answerRequest(loop, i, info->request->state);
+}
+
+// Called once a chunk was sent, right away or when io_uring completed it
+void onSendDone(struct eventLoop *loop, uint64_t handle, ssize_t result) {
+    int64_t i = clienttable_lookup(&clients, handle);
+    if (i < 0) return; // Disconnected while the send was in flight
+
+    if (result < 0 && result != -EAGAIN && result != -EWOULDBLOCK) {
+        disconnectClient(i, true);
+        return;
+    }
+
+    struct upnpClient *client = clienttable_cold(&clients, i);
+    struct trickleClient *info = &client->base;
+    if (result < 0) {
+        stallClient(i, info);
+        return;
+    }
+
+    // A short send means the send buffer filled up mid frame. The rest is sent before
+    // anything else, so the client never sees a torn chunk
+    size_t length;
+    currentFrame(client, &length);
+    client->frameSent += (uint16_t)result;
+    if (client->frameSent < length) {
+        stallClient(i, info);
+        return;
+    }
+    client->frameSent = 0;
+    if (client->frame == FRAME_END) {
+        finishResponse(loop, i);
+        return;
+    }
+    if (client->frame == FRAME_HEAD) {
+        client->frame = FRAME_CHUNK;
+    } else if (responseChunks > 0 && ++client->chunksSent >= responseChunks) {
+        client->frame = FRAME_END;
+    }
+    if (info->stalledSince != 0) {
+        addStalledTime(loop->now - info->stalledSince);
+        info->stalledSince = 0;
+        info->stalls = 0;
+        pacing_resume(&info->pacing, loop->now);
+    }
+    int interval = pacing_next(&pacing, &info->pacing, loop->now, result > 0 ? result : 0);
+    int wait = jitterDelay(interval, delayJitter, &jitterSeed);
+    clients.timeConnected[i] += wait;
+    statsUpnp.totalWastedTime += wait;
+    timerwheel_schedule(&clientQueueUpnp, &clients.timers[i], loop->now + wait);
+}
+
+// Answers a request with the response header and the description in one send, then
+// trickles chunks. Whatever was asked for, the client gets the same slow response, so
+// scanners fetching other paths or control URLs are held as well
+void trapClient(struct eventLoop *loop, uint32_t i) {
+    struct upnpClient *info = clienttable_cold(&clients, i);
+    struct httpParser *request = info->request;
+    statsUpnp.totalHttpRequests += 1;
+    // statsUpnp.totalXmlRequests += 1;
+    if (strcmp(httpparser_method(request), "GET") != 0 || strcmp(httpparser_url(request), info->persona->path) != 0) {
+        logOtherRequest(request);
+    }
+
+    const struct persona *persona = info->persona;
+    ssize_t out = send(clients.handlers[i].fd, persona->head, persona->headLength, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (out == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        fprintf(stderr, "failed to write response header to %s\n", info->base.ipaddr);
+        disconnectClient(i, false);
+        return;
+    }
+
+    // Requests pipelined behind this one wait in the buffer until the response is complete,
+    // without any the buffer goes back to the pool
+    info->keepAlive = request->keepAlive && responseChunks > 0;
+    if (!info->keepAlive || (httpparser_next(request) == HTTP_REQUEST_LINE && request->length == 0 && request->skip == 0)) {
+        slab_free(&requestPool, request);
+        admission_refund(&admission, sizeof(struct httpParser));
+        info->request = NULL;
+    }
+    clients.states[i] = CLIENT_TRICKLING;
+    eventloop_modify(loop, &clients.handlers[i], EPOLLRDHUP);
+    int interval = pacing_start(&pacing, &info->base.pacing, info->base.ipaddr, loop->now);
+    if (out == (ssize_t)persona->headLength) {
+        info->frame = FRAME_CHUNK;
+        timerwheel_schedule(&clientQueueUpnp, &clients.timers[i], loop->now + jitterDelay(interval, delayJitter, &jitterSeed));
+    } else {
+        // Did not fit the send buffer, the rest goes out on the next tick
+        info->frame = FRAME_HEAD;
+        info->frameSent = out > 0 ? (uint16_t)out : 0;
+        timerwheel_schedule(&clientQueueUpnp, &clients.timers[i], loop->now);
+    }
+    if (info->connected) return;
+
+    info->connected = true;
+    if(statsUpnp.mostConcurrentConnections < (int)clients.length) {
+        statsUpnp.mostConcurrentConnections = clients.length;
+    }
+
+    printf("%s connect %s\n", SERVER_ID, info->base.ipaddr);
+    metric_address(METRIC_CONNECT, info->base.ipaddr);
+}
+
+// Traps a complete request, turns away a bad one and waits for the rest of any other
+void answerRequest(struct eventLoop *loop, uint32_t i, enum httpParseState state) {
+    if (state == HTTP_DONE) {
+        trapClient(loop, i);
+    } else if (state == HTTP_BAD) {
+        refuseRequest(i);
+    }
+}
+
+// Reads what arrived of a request and answers it once its head is complete. Only one read
+// per readiness event, a client dribbling its request in cannot hold up the loop
+void readRequest(struct eventLoop *loop, uint32_t i) {
+    struct upnpClient *info = clienttable_cold(&clients, i);
+    struct httpParser *request = info->request;
+    ssize_t n = recv(clients.handlers[i].fd, request->buffer + request->length, httpparser_room(request), 0);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    if (n <= 0 && info->connected && request->length == 0) {
+        disconnectClient(i, true); // Closed or reset its keep-alive connection between two requests
+        return;
+    }
+
+    // Closed or failed before the head was complete
+    answerRequest(loop, i, n > 0 ? httpparser_feed(request, n) : HTTP_BAD);
+}
+
+// Clients reading their request are read from, trapped ones only watch for hangups, errors
+// and room after a stall
+void onClientEvent(struct eventLoop *loop, struct eventHandler *handler, uint32_t events) {
+    uint32_t i = clienttable_handler_index(&clients, handler);
+    if (clients.states[i] == CLIENT_READING) {
+        // A hangup can come right behind the request, so the request is read first
+        readRequest(loop, i);
+        return;
+    }
+    if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        disconnectClient(i, true);
+        return;
+    }
+    if (events & EPOLLOUT) {
+        // Room in the send buffer again, stop watching for it and send right away
+        eventloop_modify(loop, handler, EPOLLRDHUP);
+        timerwheel_schedule(&clientQueueUpnp, &clients.timers[i], loop->now);
+    }
+}
+
+// Evicts a client if the pit is out of budget. A victim is picked from a few clients in a
+// row from a random slot on, the table fills from the lowest slots so only those below the
+// high water mark are looked at. A new client holds its record and a request buffer.
+// Returns false if the new client has to be turned away
+bool makeRoom() {
+    if (admission_fits(&admission, clients.coldSize + sizeof(struct httpParser))) return true;
+
+    int64_t victim = -1;
+    struct admissionCandidate best;
+    uint32_t highWater = clients.highWater;
+    if (admission.policy != EVICT_NONE && clients.length > 0) {
+        uint32_t start = rand_r(&jitterSeed) % highWater;
+        for (uint32_t k = 0, sampled = 0; sampled < ADMISSION_SAMPLES && k < highWater && k < 4 * ADMISSION_SAMPLES; k++) {
+            uint32_t i = (start + k) % highWater;
+            if (clients.states[i] == CLIENT_FREE) continue;
+            sampled++;
+            struct upnpClient *info = clienttable_cold(&clients, i);
+            struct admissionCandidate candidate = {info->base.prefix, clients.timeConnected[i]};
+            if (admission_prefer(&admission, &candidate, victim < 0 ? NULL : &best)) {
+                best = candidate;
+                victim = i;
             }
+        }
+    }
+    if (victim < 0) {
+        admission_refused(&admission);
+        return false;
+    }
+    admission_evicted(&admission);
+    disconnectClient(victim, false);
+    return true;
+}
+
+// Takes a new connection in. Its request is read once it arrives, accepting never waits for it
+void acceptHttpClient(struct eventLoop *loop, int clientFd, struct sockaddr_in clientAddr) {
+    uint64_t source = sourcetable_key(&sources, (struct sockaddr *)&clientAddr);
+    if (!sourcetable_admit(&sources, &source, loop->now)) {
+        close(clientFd);
+        return;
+    }
+    if (!makeRoom()) {
+        sourcetable_release(&sources, source);
+        close(clientFd);
+        return;
+    }
+
+    struct httpParser *request = slab_alloc(&requestPool);
+    if (request == NULL) {
+        fprintf(stderr, "Out of memory");
+        sourcetable_release(&sources, source);
+        close(clientFd);
+        return;
+    }
+    clientHandle handle = clienttable_add(&clients, CLIENT_READING);
+    if (handle == CLIENT_HANDLE_NONE) {
+        fprintf(stderr, "Client table full");
+        slab_free(&requestPool, request);
+        sourcetable_release(&sources, source);
+        close(clientFd);
+        return;
+    }
+    uint32_t i = clienttable_index(handle);
+
+    peersweep_configure(&sweep, clientFd);
+    if (eventloop_add(loop, &clients.handlers[i], clientFd, EPOLLIN | EPOLLRDHUP, onClientEvent, NULL) == -1) {
+        fprintf(stderr, "Failed adding client to epoll with error %s", strerror(errno));
+        slab_free(&requestPool, request);
+        sourcetable_release(&sources, source);
+        close(clientFd);
+        clienttable_remove(&clients, i);
+        return;
+    }
+
+    struct upnpClient *info = clienttable_cold(&clients, i);
+    httpparser_init(request);
+    info->request = request;
+    info->persona = persona_for(&personas, ntohl(clientAddr.sin_addr.s_addr));
+    snprintf(info->base.ipaddr, sizeof(info->base.ipaddr), "%s", inet_ntoa(clientAddr.sin_addr));
+    info->base.prefix = addressPrefix(info->base.ipaddr);
+    info->base.source = source;
+    admission_add(&admission, info->base.prefix, clients.coldSize + sizeof(struct httpParser));
+    timerwheel_schedule(&clientQueueUpnp, &clients.timers[i], loop->now + REQUEST_TIMEOUT_MS);
+}
 
-            char buffer[1024];
-            memset(buffer, 0, 1024);
-            read(clientFd, buffer, 1024-1);
-            char method[20], url[128];
-            sscanf(buffer, "%19s %255s", method, url);
-
-            if (strcmp(url, "/hue-device.xml") == 0 && strcmp(method, "GET") == 0) {
-                // statsUpnp.totalXmlRequests += 1;
-                char responseHeader[] =
-                    "HTTP/1.1 200 OK\r\n"
-                    "Transfer-Encoding: chunked\r\n"
-                    "Trailer: X-Checksum\r\n"
-                    "\r\n";
-                
-                ssize_t out = write(clientFd, responseHeader, strlen(responseHeader));
-                if(out <= 0){
-                    fprintf(stderr, "failed to write response header to %s\n", 
-                        inet_ntoa(clientAddr.sin_addr));
-                    close(clientFd);
-                    free(newClient);
-                    continue;
-                }
-
-                char chunk_size[10];
-                snprintf(chunk_size, sizeof(FAKE_DEVICE_DESCRIPTION), "%X\r\n", (int)strlen(FAKE_DEVICE_DESCRIPTION));
-                write(clientFd, chunk_size, strlen(chunk_size));
-                write(clientFd, FAKE_DEVICE_DESCRIPTION, strlen(FAKE_DEVICE_DESCRIPTION));
-                write(clientFd, "\r\n", 2);
-
-                newClient->fd = clientFd;
-                newClient->base.sendNext = now + delay;
-                newClient->base.timeConnected = 0;
-                snprintf(newClient->base.ipaddr, sizeof(newClient->base.ipaddr), "%s", inet_ntoa(clientAddr.sin_addr));
-                queue_append(&clientQueueUpnp, (struct baseClient*)newClient);
-
-                if(statsUpnp.mostConcurrentConnections < clientQueueUpnp.length) {
-                    statsUpnp.mostConcurrentConnections = clientQueueUpnp.length;
-                }
-
-                char msg[256];
-                snprintf(msg, sizeof(msg), "%s connect %s\n",
-                    SERVER_ID, newClient->base.ipaddr);
-                printf("%s", msg);
-                sendMetric(msg);
-            // Ignore requests without a method or url
-            // } else if (strcmp(method, "") == 0 || strcmp(url, "")) {
-            //     continue;
-            } else {
-                // prometheus handles stats
-                // statsUpnp.otherHttpRequests += 1;
-
-                char msg[256];
-                snprintf(msg, sizeof(msg), "%s otherHttpRequests %s %s\n",
-                    SERVER_ID, method, url);
-                printf("%s", msg);
-                sendMetric(msg);
-
-                close(clientFd);
-                free(newClient);
-                continue;
+// Drains the backlog, but at most acceptBudget connections before due clients get a turn
+void onHttpAccept(struct eventLoop *loop, struct eventHandler *handler, uint32_t events) {
+    (void)events;
+    for (int i = 0; i < acceptBudget; i++) {
+        struct sockaddr_in clientAddr;
+        int clientFd = acceptClient(handler->fd, &clientAddr);
+        if(clientFd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "Failed accepting new client with error %s", strerror(errno));
             }
+            return;
         }
+        acceptHttpClient(loop, clientFd, clientAddr);
     }
+}
+
+// Everything the HTTP side needs except its listener, the simulation in sim/ starts here
+void initHttpServer() {
+    timerwheel_init(&clientQueueUpnp, currentTimeMs());
+    clienttable_init(&clients, SERVER_ID, maxNoClients, sizeof(struct upnpClient));
+    slab_init(&requestPool, "UPnP requests", sizeof(struct httpParser), SLAB_CHUNK_OBJECTS);
+    eventloop_init(&httpLoop, maxNoClients, &clientQueueUpnp, onClientDue);
+    eventloop_init_sends(&httpLoop, onSendDone);
+    pacing_init(&pacing, delay);
+    admission_init(&admission, SERVER_ID, maxNoClients);
+    sourcetable_init(&sources, maxNoClients);
+    peersweep_init(&sweep);
+    timerwheel_node_init(&sweepTimer);
+    if (sweep.timeoutMs > 0) {
+        timerwheel_schedule(&clientQueueUpnp, &sweepTimer, currentTimeMs() + PEER_SWEEP_TICK_MS);
+    }
+}
+
+void *httpServer(void *arg) {
+    (void)arg;
+    signal(SIGPIPE, SIG_IGN);
+    initHttpServer();
+    int serverSock = createServer(httpPort);
+    if (serverSock < 0) {
+        fprintf(stderr, "Invalid server socket fd: %d", serverSock);
+        exit(EXIT_FAILURE);
+    }
+
+    if (eventloop_add(&httpLoop, &httpListener, serverSock, EPOLLIN, onHttpAccept, NULL) == -1) {
+        fprintf(stderr, "epoll_ctl: server_sock");
+        exit(EXIT_FAILURE);
+    }
+
+    // long long lastHeartbeat = currentTimeMs();
+    eventloop_run(&httpLoop);
 
     close(serverSock);
     return NULL;
@@ -357,10 +751,13 @@ void initializeStats(){
     statsUpnp.mostConcurrentConnections = 0;
     statsUpnp.totalHttpRequests = 0;
     statsUpnp.totalXmlRequests = 0;
+    statsUpnp.stalledTime = 0;
+    statsUpnp.deadPeers = 0;
 }
 
 int main(int argc, char* argv[]) {
     setbuf(stdout, NULL);
+    metrics_init(PIT_UPNP);
     
     // testing
     // char msg[256];
@@ -376,14 +773,25 @@ int main(int argc, char* argv[]) {
     httpPort = atoi(argv[1]);
     ssdpPort = atoi(argv[2]);
     delay = atoi(argv[3]);
+    delayJitter = configInt("DELAY_JITTER", 0);
+    jitterSeed = (unsigned int)time(NULL);
     maxNoClients = atoi(argv[4]);
+    acceptBudget = configInt("ACCEPT_BUDGET", DEFAULT_ACCEPT_BUDGET);
+    if (acceptBudget < 1) acceptBudget = 1;
+    wakeOnWritable = configInt("WAKE_ON_WRITABLE", 0);
+    responseChunks = configInt("RESPONSE_CHUNKS", 0);
     // openlog("upnp_tarpit", LOG_PID | LOG_CONS, LOG_USER);
     initializeStats();
     setFdLimit(maxNoClients);
-    pthread_t ssdpThread, httpThread;
-    pthread_create(&ssdpThread, NULL, ssdpListener, NULL);
+    pthread_t httpThread;
+    loadPersonas();
+    startSsdpWorkers();
     pthread_create(&httpThread, NULL, httpServer, NULL);
-    pthread_join(ssdpThread, NULL);
-    pthread_join(httpThread, NULL);
+
+    // The main thread only reports, the server threads never return
+    for (;;) {
+        sleep(HEARTBEAT_INTERVAL_MS / 1000);
+        heartbeatLog();
+    }
     return 0;
 }
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "admission.h"
+#include "structs.h"
+
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define ADD(field, n) __atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+#define SUB(field, n) __atomic_fetch_sub(&(field), (n), __ATOMIC_RELAXED)
+
+static const char *policyNames[] = {"none", "oldest", "shortest", "prefix"};
+
+static uint32_t *prefixCount(struct admission *a, uint32_t prefix) {
+    return &a->prefixes[(prefix * 2654435761u) % ADMISSION_PREFIX_SLOTS];
+}
+
+static uint32_t prefixClients(const struct admission *a, uint32_t prefix) {
+    return LOAD(a->prefixes[(prefix * 2654435761u) % ADMISSION_PREFIX_SLOTS]);
+}
+
+void admission_init(struct admission *a, const char *name, uint32_t maxClients) {
+    memset(a, 0, sizeof(*a));
+    a->name = name;
+    a->maxClients = maxClients > 0 ? maxClients : 1;
+    a->maxBytes = (uint64_t)configInt("ADMISSION_MAX_BYTES", 0);
+
+    const char *policy = getenv("EVICTION_POLICY");
+    if (policy == NULL || policy[0] == '\0') return;
+    for (size_t i = 0; i < sizeof(policyNames) / sizeof(policyNames[0]); i++) {
+        if (strcmp(policy, policyNames[i]) == 0) {
+            a->policy = (enum evictionPolicy)i;
+            return;
+        }
+    }
+    fprintf(stderr, "Unknown EVICTION_POLICY %s, using none\n", policy);
+}
+
+bool admission_fits(const struct admission *a, size_t bytes) {
+    if (LOAD(a->clients) >= a->maxClients) return false;
+    return a->maxBytes == 0 || LOAD(a->bytes) + bytes <= a->maxBytes;
+}
+
+void admission_add(struct admission *a, uint32_t prefix, size_t bytes) {
+    ADD(a->clients, 1);
+    ADD(a->bytes, bytes);
+    ADD(*prefixCount(a, prefix), 1);
+}
+
+void admission_remove(struct admission *a, uint32_t prefix, size_t bytes) {
+    SUB(a->clients, 1);
+    SUB(a->bytes, bytes);
+    SUB(*prefixCount(a, prefix), 1);
+}
+
+void admission_charge(struct admission *a, size_t bytes) {
+    ADD(a->bytes, bytes);
+}
+
+void admission_refund(struct admission *a, size_t bytes) {
+    SUB(a->bytes, bytes);
+}
+
+bool admission_prefer(const struct admission *a, const struct admissionCandidate *candidate,
+                      const struct admissionCandidate *victim) {
+    if (victim == NULL) return true;
+    switch (a->policy) {
+        case EVICT_SHORTEST:
+            return candidate->trapped < victim->trapped;
+        case EVICT_PREFIX: {
+            uint32_t mine = prefixClients(a, candidate->prefix);
+            uint32_t theirs = prefixClients(a, victim->prefix);
+            if (mine != theirs) return mine > theirs;
+            return candidate->trapped > victim->trapped;
+        }
+        default:
+            return candidate->trapped > victim->trapped;
+    }
+}
+
+void admission_refused(struct admission *a) {
+    ADD(a->refusals, 1);
+}
+
+void admission_evicted(struct admission *a) {
+    ADD(a->evictions, 1);
+}
+
+void admission_report(const struct admission *a) {
+    printf("%s admission: %u of %u clients, %llu bytes of %llu, policy %s, %lu evicted, %lu refused\n",
+        a->name, LOAD(a->clients), a->maxClients, (unsigned long long)LOAD(a->bytes),
+        (unsigned long long)a->maxBytes, policyNames[a->policy], LOAD(a->evictions), LOAD(a->refusals));
+}
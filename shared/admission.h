@@ -0,0 +1,113 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Admission control for a pit. The clients and the bytes they hold are counted against
+// a budget, and once it is used up a new client does not bounce off the pit: a trapped
+// client is evicted to make room, picked from a few sampled ones by EVICTION_POLICY:
+//   none      refuse the new client instead (the default)
+//   oldest    evict the client trapped longest, it has paid off already
+//   shortest  evict the client expected to leave soonest. Trapping times are heavy tailed,
+//             so the client trapped for the shortest time is expected to stay the least
+//   prefix    evict from the /24 (or /48) with the most clients, one scanner farm must not
+//             fill the pit. The oldest of those goes first
+//
+// The counters are atomics, so the workers of a pit can share one controller. A worker
+// only evicts its own clients.
+
+#define ADMISSION_SAMPLES 8           // Clients looked at to pick a victim
+#define ADMISSION_PREFIX_SLOTS 16384  // Clients per prefix are counted in this many hashed slots
+#define FD_RESERVE 64                 // Descriptors on top of the client budget for listeners, epoll and the like
+
+enum evictionPolicy { EVICT_NONE, EVICT_OLDEST, EVICT_SHORTEST, EVICT_PREFIX };
+
+struct admission {
+    const char *name;
+    enum evictionPolicy policy;
+    uint32_t maxClients;
+    uint64_t maxBytes;        // 0 for no limit
+    uint32_t clients;
+    uint64_t bytes;
+    unsigned long evictions;
+    unsigned long refusals;
+    uint32_t prefixes[ADMISSION_PREFIX_SLOTS];
+};
+
+// What a victim is picked by, filled by the pit for every sampled client
+struct admissionCandidate {
+    uint32_t prefix;          // addressPrefix of the client
+    long long trapped;        // How long it has been trapped in ms
+};
+
+/**
+ * @brief Sets up admission control. ADMISSION_MAX_BYTES and EVICTION_POLICY are read from the environment.
+ * @param a Pointer to the controller to initialize.
+ * @param name Name of the pit for the report.
+ * @param maxClients Most clients at once, usually the fd budget of the pit.
+ */
+void admission_init(struct admission *a, const char *name, uint32_t maxClients);
+
+/**
+ * @return Returns true if a client holding bytes fits in the budget right now.
+ */
+bool admission_fits(const struct admission *a, size_t bytes);
+
+/**
+ * @brief Counts a client that was let in.
+ * @param a Pointer to the controller.
+ * @param prefix addressPrefix of the client.
+ * @param bytes Memory the client holds.
+ */
+void admission_add(struct admission *a, uint32_t prefix, size_t bytes);
+
+/**
+ * @brief Stops counting a client, whether it left or was evicted.
+ * @param a Pointer to the controller.
+ * @param prefix addressPrefix of the client.
+ * @param bytes Memory the client held.
+ */
+void admission_remove(struct admission *a, uint32_t prefix, size_t bytes);
+
+/**
+ * @brief Counts memory a client that was let in takes on, such as a request buffer.
+ * @param a Pointer to the controller.
+ * @param bytes Memory taken.
+ */
+void admission_charge(struct admission *a, size_t bytes);
+
+/**
+ * @brief Stops counting memory a client gave back before it leaves.
+ * @param a Pointer to the controller.
+ * @param bytes Memory given back.
+ */
+void admission_refund(struct admission *a, size_t bytes);
+
+/**
+ * @brief Compares two sampled clients by the policy.
+ * @param a Pointer to the controller.
+ * @param candidate Client sampled now.
+ * @param victim Best victim so far, or NULL.
+ * @return Returns true if candidate should be evicted rather than victim.
+ */
+bool admission_prefer(const struct admission *a, const struct admissionCandidate *candidate,
+                      const struct admissionCandidate *victim);
+
+/**
+ * @brief Counts a new client that was turned away, because the policy is none or no victim was found.
+ */
+void admission_refused(struct admission *a);
+
+/**
+ * @brief Counts a client evicted to make room.
+ */
+void admission_evicted(struct admission *a);
+
+/**
+ * @brief Prints the usage of the budget, evictions and refusals. Safe to call from another thread.
+ */
+void admission_report(const struct admission *a);
+
+#endif
@@ -0,0 +1,72 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "clienttable.h"
+
+// Anonymous mappings are zeroed and only backed by memory once touched,
+// so a table sized for the fd limit costs little while it is mostly empty
+static void *mapArray(const char *name, size_t count, size_t size) {
+    void *mem = mmap(NULL, count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "mmap for %s client table failed with error %s\n", name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return mem;
+}
+
+void clienttable_init(struct clientTable *t, const char *name, uint32_t capacity, size_t coldSize) {
+    memset(t, 0, sizeof(*t));
+    if (capacity == 0) capacity = 1;
+    t->name = name;
+    t->capacity = capacity;
+    t->coldSize = (coldSize + 7) & ~(size_t)7; // Keep every record aligned
+
+    t->timers = mapArray(name, capacity, sizeof(*t->timers));
+    t->handlers = mapArray(name, capacity, sizeof(*t->handlers));
+    t->timeConnected = mapArray(name, capacity, sizeof(*t->timeConnected));
+    t->states = mapArray(name, capacity, sizeof(*t->states));
+    t->generations = mapArray(name, capacity, sizeof(*t->generations));
+    t->freeList = mapArray(name, capacity, sizeof(*t->freeList));
+    t->cold = mapArray(name, capacity, t->coldSize > 0 ? t->coldSize : 1);
+
+    // Lowest indices on top, so a small load stays in the first pages
+    for (uint32_t i = 0; i < capacity; i++) {
+        t->freeList[i] = capacity - 1 - i;
+        t->generations[i] = 1;
+    }
+    t->freeCount = capacity;
+}
+
+clientHandle clienttable_add(struct clientTable *t, uint8_t state) {
+    if (t->freeCount == 0) return CLIENT_HANDLE_NONE;
+
+    uint32_t index = t->freeList[--t->freeCount];
+    timerwheel_node_init(&t->timers[index]);
+    memset(&t->handlers[index], 0, sizeof(t->handlers[index]));
+    t->timeConnected[index] = 0;
+    t->states[index] = state;
+    memset(clienttable_cold(t, index), 0, t->coldSize);
+
+    uint32_t length = t->length + 1;
+    __atomic_store_n(&t->length, length, __ATOMIC_RELAXED);
+    if (t->highWater < length) __atomic_store_n(&t->highWater, length, __ATOMIC_RELAXED);
+    return clienttable_handle(t, index);
+}
+
+void clienttable_remove(struct clientTable *t, uint32_t index) {
+    if (t->states[index] == CLIENT_FREE) return;
+
+    t->states[index] = CLIENT_FREE;
+    if (++t->generations[index] == 0) t->generations[index] = 1; // Keep handles non-zero
+    t->freeList[t->freeCount++] = index;
+    __atomic_store_n(&t->length, t->length - 1, __ATOMIC_RELAXED);
+}
+
+void clienttable_report(const struct clientTable *t) {
+    printf("%s client table: %u in use, high water %u, capacity %u\n", t->name,
+        __atomic_load_n(&t->length, __ATOMIC_RELAXED), __atomic_load_n(&t->highWater, __ATOMIC_RELAXED),
+        t->capacity);
+}
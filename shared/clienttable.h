@@ -0,0 +1,105 @@
+#ifndef CLIENTTABLE_H
+#define CLIENTTABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "timerwheel.h"
+#include "eventloop.h"
+
+#define CLIENT_FREE 0 // State of an unused slot, pits define their own states above it
+#define CLIENT_HANDLE_NONE 0
+
+// Generation in the upper 32 bits, index in the lower. A handle of a removed client
+// stops resolving, even after its slot was reused
+typedef uint64_t clientHandle;
+
+// Fixed-capacity client table laid out as parallel arrays. Dispatch only touches the
+// hot arrays: the timer node (deadline and wheel links), the handler (fd) and the
+// state, so walking due clients streams through the same few arrays instead of
+// separate heap blocks. Addresses and protocol state live in the cold area.
+// Only the owning thread may add and remove clients.
+struct clientTable {
+    const char *name;
+    uint32_t capacity;
+    uint32_t length;              // Clients in use
+    uint32_t highWater;           // Most clients in use at once
+    // Hot, indexed by client
+    struct timerNode *timers;     // timers[i].expires is when client i is due
+    struct eventHandler *handlers; // handlers[i].fd is the socket of client i
+    long long *timeConnected;     // Written on every send, so kept with the hot fields
+    uint8_t *states;
+    // Cold
+    uint32_t *generations;
+    uint32_t *freeList;           // Stack of free indices, the last freed slot is reused first
+    uint32_t freeCount;
+    unsigned char *cold;
+    size_t coldSize;
+};
+
+/**
+ * @brief Maps the arrays of a table. Pages are only backed once used. Exits on failure.
+ * @param t Pointer to the table to initialize.
+ * @param name Name used when reporting, e.g. the pit.
+ * @param capacity Most clients the table can hold.
+ * @param coldSize Size of the per-client cold record, e.g. a struct with the address.
+ */
+void clienttable_init(struct clientTable *t, const char *name, uint32_t capacity, size_t coldSize);
+
+/**
+ * @brief Takes a free slot. Its timer node is unscheduled, its handler, time connected
+ * and cold record are zeroed.
+ * @param t Pointer to the table.
+ * @param state Initial state, anything but CLIENT_FREE.
+ * @return Handle of the client, or CLIENT_HANDLE_NONE if the table is full.
+ */
+clientHandle clienttable_add(struct clientTable *t, uint8_t state);
+
+/**
+ * @brief Frees a slot. Handles to it stop resolving. The caller cancels its timer and
+ * removes its handler from the event loop first.
+ * @param t Pointer to the table.
+ * @param index Index of the client.
+ */
+void clienttable_remove(struct clientTable *t, uint32_t index);
+
+/**
+ * @brief Prints the usage and high-water mark of a table. Safe to call from another thread.
+ * @param t Pointer to the table.
+ */
+void clienttable_report(const struct clientTable *t);
+
+static inline uint32_t clienttable_index(clientHandle handle) {
+    return (uint32_t)handle;
+}
+
+static inline clientHandle clienttable_handle(const struct clientTable *t, uint32_t index) {
+    return ((uint64_t)t->generations[index] << 32) | index;
+}
+
+/**
+ * @brief Resolves a handle that may be stale.
+ * @return Index of the client, or -1 if the client was removed.
+ */
+static inline int64_t clienttable_lookup(const struct clientTable *t, clientHandle handle) {
+    uint32_t index = clienttable_index(handle);
+    if (index >= t->capacity || t->generations[index] != (uint32_t)(handle >> 32)) return -1;
+    return index;
+}
+
+/**
+ * @brief Gets the client a timer node or handler from the table belongs to.
+ */
+static inline uint32_t clienttable_timer_index(const struct clientTable *t, const struct timerNode *node) {
+    return (uint32_t)(node - t->timers);
+}
+
+static inline uint32_t clienttable_handler_index(const struct clientTable *t, const struct eventHandler *handler) {
+    return (uint32_t)(handler - t->handlers);
+}
+
+static inline void *clienttable_cold(const struct clientTable *t, uint32_t index) {
+    return t->cold + (size_t)index * t->coldSize;
+}
+
+#endif
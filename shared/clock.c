@@ -0,0 +1,34 @@
+#define _DEFAULT_SOURCE // clock_gettime
+#include <time.h>
+#include "clock.h"
+
+// Only the simulation writes these, from the thread that runs the pit
+static bool virtualClock;
+static long long virtualNow;
+
+long long currentTimeMs() {
+    if (virtualClock) return virtualNow;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000LL;
+}
+
+long long currentTimeUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000LL;
+}
+
+void clock_use_virtual(long long start) {
+    virtualClock = true;
+    virtualNow = start;
+}
+
+bool clock_is_virtual(void) {
+    return virtualClock;
+}
+
+void clock_set_virtual(long long now) {
+    if (virtualClock && now > virtualNow) virtualNow = now;
+}
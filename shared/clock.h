@@ -0,0 +1,38 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdbool.h>
+
+// All scheduling goes through currentTimeMs. By default it reads CLOCK_MONOTONIC, so NTP
+// steps never move deadlines. A simulation can swap in a virtual clock that only moves
+// when it is told to, see sim/.
+
+/**
+ * @return Returns the current time in milliseconds. Only differences between values are meaningful.
+ */
+long long currentTimeMs();
+
+/**
+ * @return Returns the monotonic time in microseconds, also with the virtual clock. For
+ * measuring how long work takes, never for scheduling.
+ */
+long long currentTimeUs();
+
+/**
+ * @brief Switches the process to the virtual clock. Call before anything reads the time.
+ * @param start Time in milliseconds the virtual clock starts at.
+ */
+void clock_use_virtual(long long start);
+
+/**
+ * @return true if the virtual clock is in use.
+ */
+bool clock_is_virtual(void);
+
+/**
+ * @brief Moves the virtual clock forward. Does nothing for earlier times or the real clock.
+ * @param now New time in milliseconds.
+ */
+void clock_set_virtual(long long now);
+
+#endif
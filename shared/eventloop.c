@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "eventloop.h"
+#include "structs.h"
+
+void eventloop_init(struct eventLoop *loop, int maxEvents, struct timerWheel *timers, timerCallback onTimer) {
+    memset(loop, 0, sizeof(*loop));
+    loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epollFd == -1) {
+        fprintf(stderr, "epoll_create1 failed with error %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    loop->maxEvents = maxEvents > 0 ? maxEvents : 1;
+    loop->events = malloc(sizeof(struct epoll_event) * loop->maxEvents);
+    if (!loop->events) {
+        fprintf(stderr, "malloc for event loop failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    loop->timers = timers;
+    loop->onTimer = onTimer;
+    loop->now = currentTimeMs();
+    loop->running = true;
+    loop->uring.fd = -1;
+    loop->timerBudget = configInt("DISPATCH_BUDGET", DEFAULT_DISPATCH_BUDGET);
+}
+
+static void onUringCompletion(void *context, uint64_t userData, int result) {
+    struct eventLoop *loop = context;
+    loop->onSendDone(loop, userData, result);
+}
+
+// Completions that were not ready when their sends were submitted
+static void onUringReady(struct eventLoop *loop, struct eventHandler *handler, uint32_t events) {
+    (void)handler;
+    (void)events;
+    uring_complete(&loop->uring, onUringCompletion, loop);
+}
+
+static void flushSends(struct eventLoop *loop) {
+    if (uring_submit(&loop->uring) == -1) {
+        fprintf(stderr, "io_uring_enter failed with error %s\n", strerror(errno));
+    }
+    uring_complete(&loop->uring, onUringCompletion, loop);
+}
+
+void eventloop_init_sends(struct eventLoop *loop, sendCallback onSendDone) {
+    loop->onSendDone = onSendDone;
+
+    int entries = configInt("IO_URING_ENTRIES", 0);
+    if (entries == 0) return;
+    if (uring_init(&loop->uring, entries) == -1) {
+        fprintf(stderr, "io_uring unavailable with error %s, using send()\n", strerror(errno));
+        return;
+    }
+    if (eventloop_add(loop, &loop->uringHandler, loop->uring.fd, EPOLLIN, onUringReady, NULL) == -1) {
+        fprintf(stderr, "Failed adding io_uring to epoll with error %s, using send()\n", strerror(errno));
+        uring_destroy(&loop->uring);
+    }
+}
+
+void eventloop_send(struct eventLoop *loop, int fd, const void *buf, size_t len, uint64_t userData) {
+    if (loop->uring.fd != -1) {
+        if (uring_send(&loop->uring, fd, buf, len, userData)) return;
+        flushSends(loop); // Queue full, submit what is there to make room
+        if (uring_send(&loop->uring, fd, buf, len, userData)) return;
+    }
+
+    ssize_t sent = send(fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    loop->onSendDone(loop, userData, sent == -1 ? -errno : sent);
+}
+
+int eventloop_add(struct eventLoop *loop, struct eventHandler *handler, int fd, uint32_t events,
+                  eventCallback callback, void *data) {
+    handler->fd = fd;
+    handler->callback = callback;
+    handler->data = data;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = handler;
+    return epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int eventloop_modify(struct eventLoop *loop, struct eventHandler *handler, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = handler;
+    return epoll_ctl(loop->epollFd, EPOLL_CTL_MOD, handler->fd, &ev);
+}
+
+void eventloop_remove(struct eventLoop *loop, struct eventHandler *handler) {
+    epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, handler->fd, NULL);
+
+    // The handler may be freed after this, so forget events that are not dispatched yet
+    for (int i = loop->cursor + 1; i < loop->ready; i++) {
+        if (loop->events[i].data.ptr == handler) {
+            loop->events[i].data.ptr = NULL;
+        }
+    }
+}
+
+static void recordIteration(struct eventLoop *loop, unsigned run, long long lag, long long maxLag, bool budgetHit) {
+    struct loopStats *s = &loop->stats;
+    __atomic_store_n(&s->iterations, s->iterations + 1, __ATOMIC_RELAXED);
+    if (run == 0) return;
+    __atomic_store_n(&s->timersRun, s->timersRun + run, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->lagTotal, s->lagTotal + lag, __ATOMIC_RELAXED);
+    if (budgetHit) __atomic_store_n(&s->budgetHits, s->budgetHits + 1, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&s->maxTimers, __ATOMIC_RELAXED) < run) __atomic_store_n(&s->maxTimers, run, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&s->maxLag, __ATOMIC_RELAXED) < maxLag) __atomic_store_n(&s->maxLag, maxLag, __ATOMIC_RELAXED);
+}
+
+void eventloop_report(struct eventLoop *loop, const char *name) {
+    struct loopStats *s = &loop->stats, *last = &loop->reported;
+    unsigned long iterations = __atomic_load_n(&s->iterations, __ATOMIC_RELAXED);
+    unsigned long long timersRun = __atomic_load_n(&s->timersRun, __ATOMIC_RELAXED);
+    unsigned long long lagTotal = __atomic_load_n(&s->lagTotal, __ATOMIC_RELAXED);
+    unsigned long budgetHits = __atomic_load_n(&s->budgetHits, __ATOMIC_RELAXED);
+    unsigned maxTimers = __atomic_exchange_n(&s->maxTimers, 0, __ATOMIC_RELAXED);
+    long long maxLag = __atomic_exchange_n(&s->maxLag, 0, __ATOMIC_RELAXED);
+
+    unsigned long long timers = timersRun - last->timersRun;
+    printf("%s loop: %lu iterations, %llu timers, %.1f per iteration, max %u, budget hit %lu times. Lag mean %.1f ms, max %lld ms\n",
+        name, iterations - last->iterations, timers,
+        iterations > last->iterations ? (double)timers / (iterations - last->iterations) : 0,
+        maxTimers, budgetHits - last->budgetHits,
+        timers > 0 ? (double)(lagTotal - last->lagTotal) / timers : 0, maxLag);
+
+    last->iterations = iterations;
+    last->timersRun = timersRun;
+    last->lagTotal = lagTotal;
+    last->budgetHits = budgetHits;
+}
+
+int eventloop_run_once(struct eventLoop *loop) {
+    int timeout = -1;
+    long long now = currentTimeMs();
+    long long workStart = currentTimeUs();
+    loop->now = now;
+
+    // Timers past the budget stay in the wheel and make the timeout 0, so a burst of
+    // due clients is spread over several iterations with accepts in between
+    unsigned run = 0;
+    long long lag = 0, maxLag = 0;
+    if (loop->timers != NULL) {
+        struct timerNode *node;
+        while ((loop->timerBudget == 0 || run < (unsigned)loop->timerBudget) &&
+               (node = timerwheel_pop(loop->timers, now)) != NULL) {
+            long long late = now - node->expires;
+            histogram_record(&loop->histograms.lateness, late > 0 ? late : 0);
+            lag += late;
+            if (maxLag < late) maxLag = late;
+            run++;
+            loop->onTimer(loop, node, now);
+        }
+    }
+    // Everything the timers sent goes to the kernel in one io_uring_enter. Completions
+    // can reschedule clients, so the timeout is only known after
+    if (loop->uring.queued > 0) flushSends(loop);
+    if (loop->timers != NULL) timeout = timerwheel_timeout(loop->timers, now);
+    recordIteration(loop, run, lag, maxLag, run == (unsigned)loop->timerBudget && timeout == 0);
+    if (loop->timers != NULL) histogram_record(&loop->histograms.served, run);
+    long long worked = currentTimeUs() - workStart;
+    // The virtual clock only moves when the simulation advances it, so sleeping would hang
+    if (clock_is_virtual()) timeout = 0;
+
+    int nfds = epoll_wait(loop->epollFd, loop->events, loop->maxEvents, timeout);
+    loop->now = currentTimeMs(); // epoll_wait will cause old value to be misrepresenting
+    workStart = currentTimeUs();
+    if (nfds == -1) {
+        if (errno != EINTR) {
+            fprintf(stderr, "epoll_wait failed with error %s\n", strerror(errno));
+        }
+        return 0;
+    }
+
+    loop->ready = nfds;
+    for (loop->cursor = 0; loop->cursor < nfds; loop->cursor++) {
+        struct epoll_event *ev = &loop->events[loop->cursor];
+        struct eventHandler *handler = ev->data.ptr;
+        if (handler == NULL) continue; // Removed earlier in this batch
+        handler->callback(loop, handler, ev->events);
+    }
+    loop->ready = 0;
+    loop->cursor = 0;
+    if (loop->uring.queued > 0) flushSends(loop);
+    worked += currentTimeUs() - workStart;
+    histogram_record(&loop->histograms.iteration, worked);
+    metrics_send_loop(&loop->histograms, loop->now);
+
+    // Send the metrics of this wakeup as one datagram
+    metrics_flush();
+    return nfds;
+}
+
+void eventloop_run(struct eventLoop *loop) {
+    while (loop->running) {
+        eventloop_run_once(loop);
+    }
+}
+
+void eventloop_stop(struct eventLoop *loop) {
+    loop->running = false;
+}
@@ -0,0 +1,141 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/types.h>
+#include "timerwheel.h"
+#include "uring.h"
+#include "metrics.h"
+
+struct eventLoop;
+struct eventHandler;
+
+typedef void (*eventCallback)(struct eventLoop *loop, struct eventHandler *handler, uint32_t events);
+typedef void (*timerCallback)(struct eventLoop *loop, struct timerNode *node, long long now);
+typedef void (*sendCallback)(struct eventLoop *loop, uint64_t userData, ssize_t result);
+
+// Embedded in whatever owns the fd (a listener or a client)
+struct eventHandler {
+    int fd;
+    eventCallback callback;
+    void *data;
+};
+
+// Dispatch counters, written by the loop's thread only. The maxima are reset by eventloop_report
+struct loopStats {
+    unsigned long iterations;
+    unsigned long long timersRun;
+    unsigned long budgetHits;  // Iterations that left due timers for the next one
+    unsigned long long lagTotal; // How late timers ran in total, in ms
+    unsigned maxTimers;        // Most timers run in one iteration
+    long long maxLag;          // Latest a timer ran, in ms
+};
+
+struct eventLoop {
+    int epollFd;
+    int maxEvents;
+    struct epoll_event *events;
+    int ready;  // Events returned by the last epoll_wait
+    int cursor; // Event currently being dispatched
+    struct timerWheel *timers;
+    timerCallback onTimer;
+    long long now; // Time of the last wakeup
+    bool running;
+    void *data;    // Owner of the loop, e.g. a worker thread
+    sendCallback onSendDone;
+    struct uring uring;                // uring.fd is -1 unless IO_URING_ENTRIES is set
+    struct eventHandler uringHandler;  // Wakes the loop for completions that were not ready at once
+    int timerBudget;         // Most timers run per iteration, 0 for no limit
+    struct loopStats stats;
+    struct loopStats reported; // Counters at the last report, only used by eventloop_report
+    struct loopHistograms histograms; // Sent through the metric channel
+};
+
+/**
+ * @brief Creates the epoll instance of an event loop. Exits on failure.
+ * At most DISPATCH_BUDGET timers run per iteration, the rest wait until the events
+ * of the iteration, e.g. accepts, were dispatched.
+ * @param loop Pointer to the loop to initialize.
+ * @param maxEvents Maximum number of events handled per wakeup.
+ * @param timers Wheel whose expired nodes are passed to onTimer, or NULL.
+ * @param onTimer Called once for every expired node.
+ */
+void eventloop_init(struct eventLoop *loop, int maxEvents, struct timerWheel *timers, timerCallback onTimer);
+
+/**
+ * @brief Starts watching a fd. EPOLLERR and EPOLLHUP are always reported.
+ * @param loop Pointer to the loop.
+ * @param handler Handler that lives as long as the fd is watched.
+ * @param fd File descriptor to watch.
+ * @param events Epoll events to watch for.
+ * @param callback Called with the ready events.
+ * @param data User data available through the handler.
+ * @return 0 on success, -1 on failure.
+ */
+int eventloop_add(struct eventLoop *loop, struct eventHandler *handler, int fd, uint32_t events,
+                  eventCallback callback, void *data);
+
+/**
+ * @brief Changes the events watched for a fd.
+ * @return 0 on success, -1 on failure.
+ */
+int eventloop_modify(struct eventLoop *loop, struct eventHandler *handler, uint32_t events);
+
+/**
+ * @brief Stops watching a fd. Must be called before the fd is closed and the handler freed.
+ * Events for the handler that are still pending in the current wakeup are dropped.
+ */
+void eventloop_remove(struct eventLoop *loop, struct eventHandler *handler);
+
+/**
+ * @brief Sets the callback for eventloop_send. If IO_URING_ENTRIES is set in the
+ * environment, the loop gets an io_uring with that many entries, otherwise or if
+ * io_uring is unavailable every send is a plain send().
+ * @param loop Pointer to the loop.
+ * @param onSendDone Called with the user data and the bytes sent or -errno.
+ */
+void eventloop_init_sends(struct eventLoop *loop, sendCallback onSendDone);
+
+/**
+ * @brief Sends without blocking. With io_uring the send is queued, all sends queued by
+ * timers are submitted together after the timers ran and onSendDone runs once they
+ * complete. Without it onSendDone runs before this returns.
+ * @param loop Pointer to the loop.
+ * @param fd Socket to send on.
+ * @param buf Data, it must stay unchanged until onSendDone ran.
+ * @param len Length of the data.
+ * @param userData Passed to onSendDone, e.g. a client handle.
+ */
+void eventloop_send(struct eventLoop *loop, int fd, const void *buf, size_t len, uint64_t userData);
+
+/**
+ * @brief Runs expired timers, then waits for and dispatches one batch of events.
+ * With the virtual clock it never waits. Timer lateness, the time spent working and
+ * the timers run are recorded in the loop's histograms.
+ * @param loop Pointer to the loop.
+ * @return Number of events returned by epoll, maxEvents means more may be pending.
+ */
+int eventloop_run_once(struct eventLoop *loop);
+
+/**
+ * @brief Prints the timers run per iteration and how late they ran since the last report.
+ * Safe to call from another thread, but only from one.
+ * @param loop Pointer to the loop.
+ * @param name Name of the loop, e.g. the pit and worker.
+ */
+void eventloop_report(struct eventLoop *loop, const char *name);
+
+/**
+ * @brief Runs the loop until eventloop_stop is called.
+ * @param loop Pointer to the loop.
+ */
+void eventloop_run(struct eventLoop *loop);
+
+/**
+ * @brief Makes eventloop_run return after the current iteration.
+ */
+void eventloop_stop(struct eventLoop *loop);
+
+#endif
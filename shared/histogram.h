@@ -0,0 +1,54 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Log-linear histogram in the style of HdrHistogram. Values below 8 get a bucket each,
+// above that every power of two is split into 8 buckets, so a bucket is at most 12.5%
+// wide and recording is a count-leading-zeros and an increment. Bucket boundaries fall
+// on powers of two, which prometheus/wire.go relies on.
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 32 // Values of 2^32 and above are counted in the last bucket
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+struct histogram {
+    uint64_t total; // Values recorded
+    uint64_t sum;
+    uint32_t counts[HISTOGRAM_BUCKETS];
+};
+
+/**
+ * @return Returns the bucket a value is counted in.
+ */
+static inline unsigned histogram_bucket(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) return (unsigned)value;
+    if (value >> HISTOGRAM_MAX_BITS) return HISTOGRAM_BUCKETS - 1;
+    unsigned top = 63 - __builtin_clzll(value);
+    unsigned sub = (value >> (top - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return ((top - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) | sub;
+}
+
+/**
+ * @return Returns the smallest value counted in a bucket.
+ */
+static inline uint64_t histogram_bucket_lower(unsigned bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) return bucket;
+    unsigned top = (bucket >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+    uint64_t sub = bucket & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (HISTOGRAM_SUB_BUCKETS | sub) << (top - HISTOGRAM_SUB_BITS);
+}
+
+static inline void histogram_record(struct histogram *h, uint64_t value) {
+    h->counts[histogram_bucket(value)]++;
+    h->total++;
+    h->sum += value;
+}
+
+static inline void histogram_reset(struct histogram *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+#endif
@@ -0,0 +1,125 @@
+#define _GNU_SOURCE // strcasestr
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "httpparser.h"
+
+void httpparser_init(struct httpParser *p) {
+    p->state = HTTP_REQUEST_LINE;
+    p->length = 0;
+    p->lineStart = 0;
+    p->scanned = 0;
+    p->method = 0;
+    p->url = 0;
+    p->end = 0;
+    p->keepAlive = false;
+    p->chunked = false;
+    p->bodyLength = 0;
+    p->skip = 0;
+}
+
+// True if a header line is the named header, value is set to where its value starts
+static bool isHeader(char *line, uint16_t length, const char *name, char **value) {
+    size_t nameLength = strlen(name);
+    if (length <= nameLength || line[nameLength] != ':' || strncasecmp(line, name, nameLength) != 0) return false;
+    *value = line + nameLength + 1;
+    while (**value == ' ' || **value == '\t') (*value)++;
+    return true;
+}
+
+// Picks out the headers keep-alive depends on, the line is NUL terminated
+static void headerLine(struct httpParser *p, char *line, uint16_t length) {
+    char *value;
+    if (isHeader(line, length, "Connection", &value)) {
+        if (strcasestr(value, "close") != NULL) p->keepAlive = false;
+        else if (strcasestr(value, "keep-alive") != NULL) p->keepAlive = true;
+    } else if (isHeader(line, length, "Content-Length", &value)) {
+        unsigned long bodyLength = strtoul(value, NULL, 10);
+        p->bodyLength = bodyLength > UINT32_MAX ? UINT32_MAX : (uint32_t)bodyLength;
+    } else if (isHeader(line, length, "Transfer-Encoding", &value)) {
+        p->chunked = true;
+    }
+}
+
+// Splits "METHOD URL HTTP/x.y" in place, end is where the line ends without its CR
+static enum httpParseState requestLine(struct httpParser *p, uint16_t start, uint16_t end) {
+    if (start == end) return HTTP_REQUEST_LINE; // Stray line break before the request
+
+    char *line = p->buffer;
+    uint16_t i = start;
+    while (i < end && line[i] != ' ') i++;
+    if (i == start || i == end) return HTTP_BAD;
+    line[i++] = '\0';
+    while (i < end && line[i] == ' ') i++;
+    uint16_t url = i;
+    while (i < end && line[i] != ' ') i++;
+    if (i == url) return HTTP_BAD;
+    p->method = start;
+    p->url = url;
+
+    if (i == end) {
+        line[end] = '\0';
+        return HTTP_DONE; // HTTP/0.9 has no version and no headers
+    }
+    line[i++] = '\0';
+    while (i < end && line[i] == ' ') i++;
+    if (end - i < 5 || memcmp(line + i, "HTTP/", 5) != 0) return HTTP_BAD;
+    p->keepAlive = end - i >= 8 && memcmp(line + i, "HTTP/1.1", 8) == 0; // The default from 1.1 on
+    return HTTP_HEADERS;
+}
+
+enum httpParseState httpparser_feed(struct httpParser *p, size_t bytes) {
+    if (p->state == HTTP_DONE || p->state == HTTP_BAD) return p->state;
+    if (p->skip > 0) {
+        // Rest of the body of the previous request
+        size_t dropped = bytes < p->skip ? bytes : p->skip;
+        memmove(p->buffer + p->length, p->buffer + p->length + dropped, bytes - dropped);
+        bytes -= dropped;
+        p->skip -= (uint32_t)dropped;
+    }
+    p->length += (uint16_t)bytes;
+
+    while (p->scanned < p->length) {
+        char *newline = memchr(p->buffer + p->scanned, '\n', p->length - p->scanned);
+        if (newline == NULL) {
+            p->scanned = p->length;
+            break;
+        }
+        uint16_t next = (uint16_t)(newline - p->buffer) + 1;
+        uint16_t end = next - 1;
+        if (end > p->lineStart && p->buffer[end - 1] == '\r') end--;
+
+        if (p->state == HTTP_REQUEST_LINE) {
+            p->state = requestLine(p, p->lineStart, end);
+        } else if (end == p->lineStart) {
+            p->state = HTTP_DONE; // Empty line after the headers
+        } else {
+            p->buffer[end] = '\0';
+            headerLine(p, p->buffer + p->lineStart, end - p->lineStart);
+        }
+        p->lineStart = next;
+        p->scanned = next;
+        if (p->state == HTTP_DONE) {
+            p->end = next;
+            p->keepAlive = p->keepAlive && !p->chunked; // Its body cannot be skipped
+        }
+        if (p->state == HTTP_DONE || p->state == HTTP_BAD) return p->state;
+    }
+
+    if (p->length == HTTP_REQUEST_MAX) p->state = HTTP_BAD;
+    return p->state;
+}
+
+enum httpParseState httpparser_next(struct httpParser *p) {
+    uint16_t consumed = p->end;
+    uint32_t body = p->bodyLength;
+    uint16_t arrived = p->length - consumed;
+    uint16_t bodyArrived = body < arrived ? (uint16_t)body : arrived;
+    consumed += bodyArrived;
+
+    uint16_t left = p->length - consumed;
+    memmove(p->buffer, p->buffer + consumed, left);
+    httpparser_init(p);
+    p->skip = body - bodyArrived;
+    return httpparser_feed(p, left);
+}
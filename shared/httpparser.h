@@ -0,0 +1,85 @@
+#ifndef HTTPPARSER_H
+#define HTTPPARSER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Incremental parser for the head of an HTTP/1.x request: the request line and the header
+// lines up to the empty line. Bytes are appended to the buffer as they arrive and fed to
+// the parser, which only looks at what it has not seen yet, so a request that trickles in
+// a byte at a time costs no more than one that arrives in one read. Lines may end in CRLF
+// or a bare LF, and empty lines before the request line are skipped.
+//
+// The method and URL are NUL terminated in place once the request line is complete.
+// A request line without a version is taken as a complete HTTP/0.9 request.
+//
+// For keep-alive the parser works out whether the connection persists and how long the
+// body is, and httpparser_next moves on to a request pipelined behind the current one.
+// Bodies are skipped, not parsed. A chunked request body cannot be skipped, so it ends
+// keep-alive.
+
+#define HTTP_REQUEST_MAX 2048 // Request heads that do not fit are bad
+
+enum httpParseState { HTTP_REQUEST_LINE, HTTP_HEADERS, HTTP_DONE, HTTP_BAD };
+
+struct httpParser {
+    enum httpParseState state;
+    uint16_t length;      // Bytes in buffer
+    uint16_t lineStart;   // Where the line being parsed starts
+    uint16_t scanned;     // Bytes already searched for the end of a line
+    uint16_t method;      // Offsets of the NUL terminated method and URL, 0 length until parsed
+    uint16_t url;
+    uint16_t end;         // Where the head ends once done, a pipelined request may follow
+    bool keepAlive;       // The connection persists after the response, final once done
+    bool chunked;         // Has a Transfer-Encoding, which rules out keep-alive whatever comes after
+    uint32_t bodyLength;  // Content-Length of the request
+    uint32_t skip;        // Body bytes of the previous request that are still to come
+    char buffer[HTTP_REQUEST_MAX];
+};
+
+/**
+ * @brief Resets a parser for a new request.
+ * @param p Pointer to the parser.
+ */
+void httpparser_init(struct httpParser *p);
+
+/**
+ * @brief Parses bytes appended to the buffer.
+ * @param p Pointer to the parser.
+ * @param bytes Number of bytes written to buffer + length, at most HTTP_REQUEST_MAX - length.
+ * @return HTTP_DONE once the head is complete, HTTP_BAD if it is malformed or too long,
+ * otherwise more bytes are needed.
+ */
+enum httpParseState httpparser_feed(struct httpParser *p, size_t bytes);
+
+/**
+ * @brief Drops a complete request, with as much of its body as arrived, and parses
+ * whatever was pipelined behind it. The rest of the body is dropped as it arrives.
+ * @param p Pointer to a parser in HTTP_DONE.
+ * @return State of the next request, like httpparser_feed.
+ */
+enum httpParseState httpparser_next(struct httpParser *p);
+
+/**
+ * @return Room left in the buffer for the next read.
+ */
+static inline size_t httpparser_room(const struct httpParser *p) {
+    return HTTP_REQUEST_MAX - p->length;
+}
+
+/**
+ * @return The method, or "" if the request line was not parsed.
+ */
+static inline const char *httpparser_method(const struct httpParser *p) {
+    return p->method == p->url ? "" : p->buffer + p->method;
+}
+
+/**
+ * @return The URL, or "" if the request line was not parsed.
+ */
+static inline const char *httpparser_url(const struct httpParser *p) {
+    return p->method == p->url ? "" : p->buffer + p->url;
+}
+
+#endif
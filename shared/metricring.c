@@ -0,0 +1,83 @@
+#define _DEFAULT_SOURCE // ftruncate
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include "metricring.h"
+
+#define RECORD_ALIGN 4
+
+int metricring_create(struct metricRing *ring, const char *path, uint8_t pit, size_t capacity) {
+    size_t size = sizeof(struct metricRingHeader) + capacity;
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) return -1;
+
+    if (ftruncate(fd, size) == -1) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        unlink(path);
+        return -1;
+    }
+
+    memset(ring, 0, sizeof(*ring));
+    ring->header = mem;
+    ring->data = (unsigned char *)mem + sizeof(struct metricRingHeader);
+    ring->capacity = capacity;
+
+    ring->header->version = METRIC_RING_VERSION;
+    ring->header->pit = pit;
+    ring->header->capacity = capacity;
+    __atomic_store_n(&ring->header->magic, METRIC_RING_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+bool metricring_push(struct metricRing *ring, const void *record, size_t length) {
+    uint64_t advance = (length + RECORD_ALIGN - 1) & ~(uint64_t)(RECORD_ALIGN - 1);
+    uint64_t pos = ring->head & (ring->capacity - 1);
+    uint64_t toEnd = ring->capacity - pos;
+    uint64_t needed = advance <= toEnd ? advance : toEnd + advance;
+
+    // Only look at the consumer's cache line when the cached tail says the ring is full
+    if (ring->head + needed - ring->tailCache > ring->capacity) {
+        ring->tailCache = __atomic_load_n(&ring->header->tail, __ATOMIC_ACQUIRE);
+        if (ring->head + needed - ring->tailCache > ring->capacity) {
+            __atomic_store_n(&ring->header->overruns, ring->header->overruns + 1, __ATOMIC_RELAXED);
+            return false;
+        }
+    }
+
+    if (advance > toEnd) {
+        ring->data[pos] = 0; // Zero length, skip to the start
+        ring->data[pos + 1] = 0;
+        ring->head += toEnd;
+        pos = 0;
+    }
+    memcpy(ring->data + pos, record, length);
+    ring->head += advance;
+    __atomic_store_n(&ring->header->head, ring->head, __ATOMIC_RELEASE);
+    return true;
+}
+
+void metricring_remove_stale(uint8_t pit) {
+    char prefix[64];
+    int prefixLength = snprintf(prefix, sizeof(prefix), "%s%d_", METRIC_RING_PREFIX, pit);
+
+    DIR *dir = opendir(METRIC_RING_DIR);
+    if (dir == NULL) return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, prefix, prefixLength) != 0) continue;
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", METRIC_RING_DIR, entry->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+}
@@ -0,0 +1,67 @@
+#ifndef METRICRING_H
+#define METRICRING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define METRIC_RING_MAGIC 0x47525054 // "TPRG"
+#define METRIC_RING_VERSION 1
+#define METRIC_RING_DIR "/tmp"        // Shared with the exporter
+#define METRIC_RING_PREFIX "tarpit_ring_"
+#define METRIC_RING_MIN 4096          // Smallest data area in bytes
+
+// Layout of a ring file, read by prometheus/ring.go. The producer only writes head
+// and overruns, the consumer only writes tail, each on its own cache line.
+//
+// The data area holds the records of shared/metrics.h back to back, each starting at
+// a multiple of 4. Records never wrap: a zero length means the rest of the area is
+// padding and the next record starts at offset 0.
+struct metricRingHeader {
+    uint32_t magic;      // Written last, once the header is complete
+    uint8_t version;
+    uint8_t pit;
+    uint16_t reserved;
+    uint64_t capacity;   // Size of the data area, a power of two
+    uint64_t overruns;   // Records dropped because the ring was full
+    char pad0[40];
+    uint64_t head;       // Bytes ever written, offset 64
+    char pad1[56];
+    uint64_t tail;       // Bytes ever consumed, offset 128
+    char pad2[56];
+};
+
+struct metricRing {
+    struct metricRingHeader *header;
+    unsigned char *data;
+    uint64_t capacity;
+    uint64_t head;      // Producer's copy of header->head
+    uint64_t tailCache; // Last tail seen, reloaded only when the ring looks full
+};
+
+/**
+ * @brief Creates and maps a ring file. Any existing file at the path is replaced.
+ * @param ring Pointer to the ring to initialize.
+ * @param path Path of the file, on the volume shared with the exporter.
+ * @param pit Pit id written in the header.
+ * @param capacity Size of the data area, a power of two of at least METRIC_RING_MIN.
+ * @return 0 on success, -1 on failure.
+ */
+int metricring_create(struct metricRing *ring, const char *path, uint8_t pit, size_t capacity);
+
+/**
+ * @brief Copies a record into the ring and publishes it. Only one thread may push to a ring.
+ * @param ring Pointer to the ring.
+ * @param record Encoded record.
+ * @param length Length of the record.
+ * @return true on success, false if the ring was full. The overrun is counted in the header.
+ */
+bool metricring_push(struct metricRing *ring, const void *record, size_t length);
+
+/**
+ * @brief Deletes ring files left behind by an earlier run of the same pit.
+ * @param pit Pit id the files were created for.
+ */
+void metricring_remove_stale(uint8_t pit);
+
+#endif
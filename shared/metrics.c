@@ -0,0 +1,334 @@
+#define _DEFAULT_SOURCE // strnlen
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "metrics.h"
+#include "metricring.h"
+#include "structs.h"
+
+#define RECORD_HEADER 3        // u16 length | u8 event
+#define MAX_RECORD (RECORD_HEADER + 17 + 8 + 2 * (1 + METRIC_STRING_MAX))
+
+struct internedString {
+    uint16_t offset; // Where the bytes are in the batch
+    uint8_t length;
+};
+
+// Every thread batches into its own buffer and owns its own socket, so no locking is needed
+struct metricBatch {
+    int fd;
+    long long retryAt; // Earliest time to connect again after a failure
+    size_t length;
+    unsigned long records;
+    unsigned long dropReport; // Drops reported in this batch
+    int strings;
+    struct internedString interned[METRIC_INTERN_MAX];
+    int ringState; // 0 not tried yet, 1 records go to the ring, -1 records go to the socket
+    struct metricRing ring;
+    unsigned char buffer[METRIC_BATCH_SIZE];
+};
+
+static __thread struct metricBatch batch = { .fd = -1 };
+static enum metricPit metricPit;
+static unsigned long dropped;         // All threads
+static unsigned long droppedReported; // Part of dropped already sent to the exporter
+static size_t ringCapacity;           // 0 when only the socket is used
+static unsigned int ringCount;        // Rings created by this process
+
+void metrics_init(enum metricPit pit) {
+    metricPit = pit;
+
+    int ringKb = configInt("METRIC_RING_KB", 0);
+    if (ringKb > 0) {
+        ringCapacity = METRIC_RING_MIN;
+        while (ringCapacity < (size_t)ringKb * 1024) ringCapacity <<= 1;
+        metricring_remove_stale(pit);
+    }
+}
+
+// Every thread gets its own ring, so every ring has a single producer
+static bool useRing() {
+    if (batch.ringState == 0) {
+        batch.ringState = -1;
+        if (ringCapacity > 0) {
+            char path[256];
+            snprintf(path, sizeof(path), "%s/%s%d_%d_%u", METRIC_RING_DIR, METRIC_RING_PREFIX,
+                metricPit, (int)getpid(), __atomic_fetch_add(&ringCount, 1, __ATOMIC_RELAXED));
+            if (metricring_create(&batch.ring, path, (uint8_t)metricPit, ringCapacity) == 0) {
+                batch.ringState = 1;
+            } else {
+                fprintf(stderr, "Failed creating metric ring %s, using the socket instead\n", path);
+            }
+        }
+    }
+    return batch.ringState == 1;
+}
+
+static int connectExporter() {
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", METRIC_SOCKET_PATH);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void putU8(uint8_t value) {
+    batch.buffer[batch.length++] = value;
+}
+
+static void putU32(uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        putU8((uint8_t)(value >> (8 * i)));
+    }
+}
+
+static void putU64(uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        putU8((uint8_t)(value >> (8 * i)));
+    }
+}
+
+static void putAddress(const char *ipaddr) {
+    unsigned char bytes[16];
+    if (inet_pton(AF_INET, ipaddr, bytes) == 1) {
+        putU8(4);
+        memcpy(batch.buffer + batch.length, bytes, 4);
+        batch.length += 4;
+    } else if (inet_pton(AF_INET6, ipaddr, bytes) == 1) {
+        putU8(6);
+        memcpy(batch.buffer + batch.length, bytes, 16);
+        batch.length += 16;
+    } else {
+        putU8(0);
+    }
+}
+
+// Strings repeated within a datagram (credentials, topics) are sent once and referenced after
+static void putString(const char *s) {
+    size_t length = strnlen(s, METRIC_STRING_MAX);
+    for (int i = 0; i < batch.strings; i++) {
+        struct internedString *is = &batch.interned[i];
+        if (is->length == length && memcmp(batch.buffer + is->offset, s, length) == 0) {
+            putU8(METRIC_STRING_REF);
+            putU8((uint8_t)i);
+            return;
+        }
+    }
+
+    putU8((uint8_t)length);
+    if (length > 2 && batch.ringState != 1 && batch.strings < METRIC_INTERN_MAX) {
+        batch.interned[batch.strings].offset = (uint16_t)batch.length;
+        batch.interned[batch.strings].length = (uint8_t)length;
+        batch.strings++;
+    }
+    memcpy(batch.buffer + batch.length, s, length);
+    batch.length += length;
+}
+
+// Starts a record, flushing first if a record of the largest size might not fit.
+// With a ring, the record is built at the start of the buffer and copied by endRecord
+static size_t beginRecord(enum metricEvent event) {
+    if (useRing()) {
+        batch.length = 0;
+        putU8(0);
+        putU8(0);
+        putU8((uint8_t)event);
+        return 0;
+    }
+    if (batch.length + MAX_RECORD > METRIC_BATCH_SIZE) {
+        metrics_flush();
+    }
+    if (batch.length == 0) {
+        putU8(METRIC_MAGIC);
+        putU8(METRIC_VERSION);
+        putU8((uint8_t)metricPit);
+    }
+    size_t start = batch.length;
+    batch.length += 2; // Length, written by endRecord
+    putU8((uint8_t)event);
+    return start;
+}
+
+static void endRecord(size_t start) {
+    size_t length = batch.length - start;
+    batch.buffer[start] = (uint8_t)length;
+    batch.buffer[start + 1] = (uint8_t)(length >> 8);
+}
+
+// Ends an event record and hands it to the ring, or leaves it in the batch for metrics_flush
+static void finishRecord(size_t start) {
+    endRecord(start);
+    if (batch.ringState != 1) {
+        batch.records++;
+        return;
+    }
+    if (!metricring_push(&batch.ring, batch.buffer, batch.length)) {
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+    }
+    batch.length = 0;
+}
+
+// Tells the exporter about drops since the last report, if they fit in the batch
+static void appendDropReport() {
+    unsigned long total = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+    unsigned long reported = __atomic_load_n(&droppedReported, __ATOMIC_RELAXED);
+    if (total == reported) return;
+
+    if (batch.length + RECORD_HEADER + 8 > METRIC_BATCH_SIZE) return;
+    if (!__atomic_compare_exchange_n(&droppedReported, &reported, total, false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return; // Another thread is reporting them
+    }
+    size_t start = batch.length;
+    batch.length += 2;
+    putU8(METRIC_DROPPED);
+    putU64(total - reported);
+    endRecord(start);
+    batch.dropReport = total - reported;
+}
+
+void metrics_flush(void) {
+    if (batch.length == 0) return;
+
+    // Without metrics_init, as in the simulation, records are encoded but never sent
+    if (metricPit == 0) {
+        batch.length = 0;
+        batch.records = 0;
+        batch.strings = 0;
+        return;
+    }
+
+    if (batch.fd == -1) {
+        long long now = currentTimeMs();
+        if (now >= batch.retryAt) {
+            batch.fd = connectExporter();
+            if (batch.fd == -1) batch.retryAt = now + METRIC_RECONNECT_MS;
+        }
+    }
+
+    ssize_t sent = -1;
+    if (batch.fd != -1) {
+        appendDropReport();
+        sent = send(batch.fd, batch.buffer, batch.length, 0);
+        if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            // The exporter restarted or is gone, connect again later
+            close(batch.fd);
+            batch.fd = -1;
+            batch.retryAt = currentTimeMs() + METRIC_RECONNECT_MS;
+        }
+    }
+
+    // EAGAIN means the exporter is behind, drop rather than block the pit
+    if (sent == -1) {
+        __atomic_fetch_add(&dropped, batch.records, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&droppedReported, batch.dropReport, __ATOMIC_RELAXED);
+    }
+    batch.length = 0;
+    batch.records = 0;
+    batch.dropReport = 0;
+    batch.strings = 0;
+}
+
+void metric_address(enum metricEvent event, const char *ipaddr) {
+    size_t start = beginRecord(event);
+    putAddress(ipaddr);
+    finishRecord(start);
+}
+
+void metric_disconnect(const char *ipaddr, long long timeTrapped) {
+    size_t start = beginRecord(METRIC_DISCONNECT);
+    putAddress(ipaddr);
+    putU64((uint64_t)timeTrapped);
+    finishRecord(start);
+}
+
+void metric_event(enum metricEvent event) {
+    size_t start = beginRecord(event);
+    finishRecord(start);
+}
+
+void metric_strings(enum metricEvent event, const char *first, const char *second) {
+    size_t start = beginRecord(event);
+    putString(first);
+    if (second != NULL) putString(second);
+    finishRecord(start);
+}
+
+void metric_topic(enum metricEvent event, const char *topic, int qos) {
+    size_t start = beginRecord(event);
+    putString(topic);
+    putU8((uint8_t)qos);
+    finishRecord(start);
+}
+
+void metric_histogram(enum metricHistogram kind, const struct histogram *h) {
+    if (h->total == 0) return;
+
+    // Larger than MAX_RECORD, so make room for all buckets before beginRecord checks
+    if (batch.ringState != 1 && batch.length + RECORD_HEADER + 10 + HISTOGRAM_BUCKETS * 5 > METRIC_BATCH_SIZE) {
+        metrics_flush();
+    }
+    size_t start = beginRecord(METRIC_HISTOGRAM);
+    putU8((uint8_t)kind);
+    putU64(h->sum);
+    size_t countAt = batch.length;
+    putU8(0);
+    uint8_t buckets = 0;
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (h->counts[i] == 0) continue;
+        putU8((uint8_t)i);
+        putU32(h->counts[i]);
+        buckets++;
+    }
+    batch.buffer[countAt] = buckets;
+    finishRecord(start);
+}
+
+void metric_pacing(uint64_t trappedMs, uint64_t sends, uint64_t bytes, uint64_t cpuUs) {
+    size_t start = beginRecord(METRIC_PACING);
+    putU64(trappedMs);
+    putU64(sends);
+    putU64(bytes);
+    putU64(cpuUs);
+    finishRecord(start);
+}
+
+void metric_ssdp(uint64_t received, uint64_t msearches, uint64_t others, uint64_t answered, uint64_t limited) {
+    size_t start = beginRecord(METRIC_UPNP_SSDP);
+    putU64(received);
+    putU64(msearches);
+    putU64(others);
+    putU64(answered);
+    putU64(limited);
+    finishRecord(start);
+}
+
+void metrics_send_loop(struct loopHistograms *l, long long now) {
+    if (l->sendAt == 0) l->sendAt = now + METRIC_HISTOGRAM_MS; // First call
+    if (now < l->sendAt) return;
+
+    metric_histogram(HISTOGRAM_LATENESS_MS, &l->lateness);
+    metric_histogram(HISTOGRAM_ITERATION_US, &l->iteration);
+    metric_histogram(HISTOGRAM_SERVED, &l->served);
+    histogram_reset(&l->lateness);
+    histogram_reset(&l->iteration);
+    histogram_reset(&l->served);
+    l->sendAt = now + METRIC_HISTOGRAM_MS;
+}
+
+unsigned long metrics_dropped(void) {
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
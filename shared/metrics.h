@@ -0,0 +1,162 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#define METRIC_SOCKET_PATH "/tmp/tarpit_exporter.sock"
+#define METRIC_BATCH_SIZE 4096     // Largest datagram sent to the exporter
+#define METRIC_RECONNECT_MS 1000   // Wait before connecting again after the exporter went away
+#define METRIC_HISTOGRAM_MS 10000  // How often a loop sends its histograms
+
+#include "histogram.h"
+
+// Binary wire format, all integers little endian. Decoded by prometheus/wire.go
+//
+// datagram: u8 magic | u8 version | u8 pit | record...
+// record:   u16 length (whole record) | u8 event | payload
+// address:  u8 family (4, 6 or 0 if unknown) | 4 or 16 address bytes
+// string:   u8 length (0-254) | bytes
+//       or  0xFF | u8 index of an earlier string in the same datagram
+//
+// Payloads per event:
+//   CONNECT, UPNP_MSEARCH, UPNP_NON_MSEARCH  address
+//   DISCONNECT                               address | i64 time trapped in ms
+//   DROPPED                                  u64 records dropped since the last report
+//   HISTOGRAM                                u8 histogram | u64 sum | u8 buckets |
+//                                            buckets x (u8 bucket | u32 count), counts since the last one
+//   PACING                                   u64 trapped ms | u64 sends | u64 bytes | u64 cpu us, since the last one
+//   UPNP_SSDP                                u64 received | u64 M-SEARCH | u64 other | u64 answered |
+//                                            u64 over the rate limit, since the last one
+//   UPNP_OTHER_HTTP, MQTT_CREDENTIALS        string | string
+//   MQTT_CONNECT, MQTT_UNSUBSCRIBE           string
+//   MQTT_SUBSCRIBE, MQTT_PUBLISH             string | u8 qos
+//   MQTT_MALFORMED_CONNECT, MQTT_CONNACK,
+//   MQTT_PUBREC                              nothing
+#define METRIC_MAGIC 0xE7
+#define METRIC_VERSION 1
+#define METRIC_STRING_MAX 254 // Longer strings are truncated
+#define METRIC_STRING_REF 0xFF
+#define METRIC_INTERN_MAX 64  // Strings per datagram that can be referenced again
+
+enum metricPit { PIT_TELNET = 1, PIT_UPNP, PIT_MQTT, PIT_COAP, PIT_SSH };
+
+enum metricEvent {
+    METRIC_CONNECT = 1,
+    METRIC_DISCONNECT,
+    METRIC_DROPPED,
+    METRIC_UPNP_OTHER_HTTP,
+    METRIC_UPNP_MSEARCH,
+    METRIC_UPNP_NON_MSEARCH,
+    METRIC_MQTT_CONNECT,
+    METRIC_MQTT_MALFORMED_CONNECT,
+    METRIC_MQTT_SUBSCRIBE,
+    METRIC_MQTT_CREDENTIALS,
+    METRIC_MQTT_PUBLISH,
+    METRIC_MQTT_CONNACK,
+    METRIC_MQTT_UNSUBSCRIBE,
+    METRIC_MQTT_PUBREC,
+    METRIC_HISTOGRAM,
+    METRIC_PACING,
+    METRIC_UPNP_SSDP
+};
+
+enum metricHistogram {
+    HISTOGRAM_LATENESS_MS = 1, // How long after it was due a client was served
+    HISTOGRAM_ITERATION_US,    // Time a loop iteration spent working, without waiting
+    HISTOGRAM_SERVED,          // Clients served per wakeup
+    HISTOGRAM_PEER_RTT_US,     // Round trip time of trapped peers, see peersweep.h
+    HISTOGRAM_PEER_RETRANSMITS // Segments retransmitted to a trapped peer
+};
+
+// What a pit's scheduling loop records, only touched by the loop's thread
+struct loopHistograms {
+    struct histogram lateness;
+    struct histogram iteration;
+    struct histogram served;
+    long long sendAt; // When the histograms are sent next
+};
+
+/**
+ * @brief Sets the pit written in the header of every datagram. Call once at startup.
+ * Until then records are encoded but discarded.
+ * If METRIC_RING_KB is set in the environment, every thread writes its records to its own
+ * shared memory ring of that size instead of the socket, see metricring.h.
+ * @param pit Pit of this process.
+ */
+void metrics_init(enum metricPit pit);
+
+/**
+ * @brief Queues an event whose payload is a client address.
+ * @param event METRIC_CONNECT, METRIC_UPNP_MSEARCH or METRIC_UPNP_NON_MSEARCH.
+ * @param ipaddr IPv4 or IPv6 address in text form.
+ */
+void metric_address(enum metricEvent event, const char *ipaddr);
+
+/**
+ * @brief Queues a METRIC_DISCONNECT event.
+ * @param ipaddr IPv4 or IPv6 address in text form.
+ * @param timeTrapped Time the client was trapped in ms.
+ */
+void metric_disconnect(const char *ipaddr, long long timeTrapped);
+
+/**
+ * @brief Queues an event without payload.
+ */
+void metric_event(enum metricEvent event);
+
+/**
+ * @brief Queues an event whose payload is one or two strings.
+ * @param event Event type.
+ * @param first First string.
+ * @param second Second string, or NULL for events with a single string.
+ */
+void metric_strings(enum metricEvent event, const char *first, const char *second);
+
+/**
+ * @brief Queues a METRIC_MQTT_SUBSCRIBE or METRIC_MQTT_PUBLISH event.
+ */
+void metric_topic(enum metricEvent event, const char *topic, int qos);
+
+/**
+ * @brief Queues a METRIC_HISTOGRAM event with the non-empty buckets of a histogram.
+ * @param kind Which histogram it is.
+ * @param h Counts since the last event for the same histogram.
+ */
+void metric_histogram(enum metricHistogram kind, const struct histogram *h);
+
+/**
+ * @brief Queues a METRIC_PACING event, what a loop got for what it spent.
+ * @param trappedMs Time clients were held between messages.
+ * @param sends Messages sent.
+ * @param bytes Bytes sent.
+ * @param cpuUs CPU time of the thread.
+ */
+void metric_pacing(uint64_t trappedMs, uint64_t sends, uint64_t bytes, uint64_t cpuUs);
+
+/**
+ * @brief Queues a METRIC_UPNP_SSDP event, the datagrams of one batch.
+ * @param received Datagrams read.
+ * @param msearches M-SEARCH requests among them.
+ * @param others Datagrams that were not M-SEARCH.
+ * @param answered Answers sent.
+ * @param limited Datagrams dropped over the rate limit, neither M-SEARCH nor other.
+ */
+void metric_ssdp(uint64_t received, uint64_t msearches, uint64_t others, uint64_t answered, uint64_t limited);
+
+/**
+ * @brief Queues the histograms of a loop and resets them, once every METRIC_HISTOGRAM_MS.
+ * @param l Pointer to the histograms.
+ * @param now Current time in milliseconds.
+ */
+void metrics_send_loop(struct loopHistograms *l, long long now);
+
+/**
+ * @brief Sends the records queued by the calling thread as one datagram.
+ * The event loop calls this after every wakeup. Records that can not be sent are dropped.
+ */
+void metrics_flush(void);
+
+/**
+ * @brief Gets the number of records dropped so far by all threads.
+ */
+unsigned long metrics_dropped(void);
+
+#endif
@@ -0,0 +1,146 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "pacing.h"
+#include "structs.h"
+
+static struct pacingPrefix *prefixSlot(struct pacing *p, uint32_t key) {
+    return &p->prefixes[(key * 2654435761u) % PACING_PREFIXES];
+}
+
+// The learned entry of a prefix, or NULL if it has none or forgot it
+static struct pacingPrefix *knownPrefix(struct pacing *p, uint32_t key, long long now) {
+    struct pacingPrefix *e = prefixSlot(p, key);
+    if (e->key != key || e->tolerance == 0 || now - e->updated > PACING_FORGET_MS) return NULL;
+    return e;
+}
+
+static long long threadCpuUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000LL;
+}
+
+static void report(struct pacing *p, long long now) {
+    if (now < p->reportAt) return;
+
+    long long cpuUs = threadCpuUs();
+    if (p->reportAt != 0) {
+        metric_pacing(p->trappedMs, p->sends, p->bytes, cpuUs - p->cpuUsAtReport);
+    }
+    p->trappedMs = 0;
+    p->sends = 0;
+    p->bytes = 0;
+    p->cpuUsAtReport = cpuUs;
+    p->reportAt = now + PACING_REPORT_MS;
+}
+
+static uint32_t clampInterval(struct pacing *p, uint64_t interval) {
+    if (interval < PACING_MIN_MS) return PACING_MIN_MS;
+    if (interval > (uint64_t)p->max) return p->max;
+    return (uint32_t)interval;
+}
+
+void pacing_init(struct pacing *p, int base) {
+    memset(p, 0, sizeof(*p));
+    p->base = base > 0 ? base : 1;
+    p->max = configInt("PACING_MAX_MS", 0);
+    if (p->max == 0) return;
+    if (p->max < p->base) p->max = p->base;
+
+    p->prefixes = mmap(NULL, PACING_PREFIXES * sizeof(struct pacingPrefix), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p->prefixes == MAP_FAILED) {
+        fprintf(stderr, "mmap for pacing prefixes failed with error %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+int pacing_start(struct pacing *p, struct pacingClient *c, const char *ipaddr, long long now) {
+    if (p->max == 0) return p->base;
+
+    memset(c, 0, sizeof(*c));
+    c->key = addressPrefix(ipaddr);
+    c->lastSent = now;
+    c->interval = p->base;
+    struct pacingPrefix *e = knownPrefix(p, c->key, now);
+    if (e != NULL && e->tolerance - e->tolerance / 8 < (uint32_t)p->base) {
+        c->interval = clampInterval(p, e->tolerance - e->tolerance / 8);
+    }
+    return c->interval;
+}
+
+int pacing_next(struct pacing *p, struct pacingClient *c, long long now, size_t bytes) {
+    p->sends++;
+    p->bytes += bytes;
+    if (p->max == 0) {
+        p->trappedMs += p->base;
+        report(p, now);
+        return p->base;
+    }
+
+    uint32_t gap = (uint32_t)(now - c->lastSent);
+    p->trappedMs += gap;
+    c->lastSent = now;
+    if (c->survived < c->gap) c->survived = c->gap;
+    c->gap = gap;
+
+    struct pacingPrefix *e = knownPrefix(p, c->key, now);
+    uint64_t interval;
+    if (e == NULL) {
+        // Nothing learned yet, stretch until a client of the prefix gives up
+        interval = c->interval + c->interval / 2;
+    } else {
+        if (gap > e->tolerance) e->tolerance = gap; // Outlasted what was learned
+        e->updated = now;
+        uint32_t target = e->tolerance - e->tolerance / 8;
+        if (c->interval >= target && now - e->probedAt > PACING_PROBE_MS) {
+            // Now and then risk one client on more silence, the prefix may be more patient
+            // than its quitters made it look
+            interval = (uint64_t)e->tolerance + e->tolerance / 4;
+            e->probedAt = now;
+        } else {
+            interval = c->interval + c->interval / 2;
+            if (interval > target) interval = target;
+        }
+    }
+    c->interval = clampInterval(p, interval);
+    report(p, now);
+    return c->interval;
+}
+
+static void learn(struct pacing *p, struct pacingClient *c, uint32_t silence, long long now) {
+    // Leaving after less silence than it already sat through is not impatience
+    if (silence < c->survived) return;
+    if (silence == 0) silence = 1;
+
+    struct pacingPrefix *e = prefixSlot(p, c->key);
+    if (knownPrefix(p, c->key, now) == NULL) {
+        e->key = c->key;
+        e->tolerance = silence;
+        e->probedAt = now;
+    } else {
+        e->tolerance = (uint32_t)(((uint64_t)e->tolerance * 3 + silence) / 4);
+    }
+    e->updated = now;
+}
+
+void pacing_resume(struct pacingClient *c, long long now) {
+    c->lastSent = now;
+}
+
+void pacing_lost(struct pacing *p, struct pacingClient *c, long long now) {
+    if (p->max == 0) return;
+    uint32_t silence = (uint32_t)(now - c->lastSent);
+    if (silence < c->gap) return;
+    learn(p, c, silence, now);
+}
+
+void pacing_refused(struct pacing *p, struct pacingClient *c, long long now) {
+    if (p->max == 0) return;
+    learn(p, c, c->gap, now);
+}
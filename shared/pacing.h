@@ -0,0 +1,104 @@
+#ifndef PACING_H
+#define PACING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Adaptive pacing for the trickling pits. Instead of one delay for every client, the
+// silence between two messages grows while a client keeps waiting, and how long clients
+// from a /24 (or /48) put up with silence before leaving is learned, so later clients
+// from it are held just below that. Fewer sends per trapped second means less CPU and
+// bandwidth for the same trap.
+//
+// Every loop has its own pacing, only the thread running the loop may use it.
+
+#define PACING_PREFIXES 4096        // Learned prefixes per loop, a new prefix replaces the one in its slot
+#define PACING_FORGET_MS 3600000    // A prefix not heard from for an hour is learned again
+#define PACING_MIN_MS 10            // Shortest interval, however impatient a prefix is
+#define PACING_PROBE_MS 600000      // How often a prefix is tried with more silence than it was learned to bear
+#define PACING_REPORT_MS 10000      // How often the efficiency counters are sent
+
+struct pacingPrefix {
+    uint32_t key;        // 0 for an empty slot
+    uint32_t tolerance;  // Silence in ms clients leave after, 0 while unknown
+    long long updated;
+    long long probedAt;
+};
+
+// Per client, kept with the client's cold data
+struct pacingClient {
+    uint32_t key;
+    uint32_t interval;   // Silence before the next message in ms
+    uint32_t gap;        // Silence before the last message
+    uint32_t survived;   // Longest silence the client sat through before that
+    long long lastSent;
+};
+
+struct pacing {
+    int base;            // Delay of the pit, unknown clients start at it
+    int max;             // Longest interval, 0 keeps every client at base
+    struct pacingPrefix *prefixes;
+    // Counted since the last report, see metric_pacing
+    uint64_t trappedMs;
+    uint64_t sends;
+    uint64_t bytes;
+    long long reportAt;
+    long long cpuUsAtReport;
+};
+
+/**
+ * @brief Sets up pacing for a loop. PACING_MAX_MS from the environment is the longest
+ * interval, unset or 0 turns pacing off and every interval is base. Exits on failure.
+ * @param p Pointer to the pacing to initialize.
+ * @param base Delay of the pit in ms.
+ */
+void pacing_init(struct pacing *p, int base);
+
+/**
+ * @brief Starts pacing a new client.
+ * @param p Pointer to the pacing of the loop.
+ * @param c Pacing state of the client.
+ * @param ipaddr Address of the client in text form.
+ * @param now Current time in ms.
+ * @return Time in ms until the first message.
+ */
+int pacing_start(struct pacing *p, struct pacingClient *c, const char *ipaddr, long long now);
+
+/**
+ * @brief Called after every message the client got.
+ * @param p Pointer to the pacing of the loop.
+ * @param c Pacing state of the client.
+ * @param now Current time in ms.
+ * @param bytes Bytes sent.
+ * @return Time in ms until the next message.
+ */
+int pacing_next(struct pacing *p, struct pacingClient *c, long long now, size_t bytes);
+
+/**
+ * @brief Learns from a client that left: the silence since its last message is what its prefix puts up with.
+ * @param p Pointer to the pacing of the loop.
+ * @param c Pacing state of the client.
+ * @param now Current time in ms.
+ */
+void pacing_lost(struct pacing *p, struct pacingClient *c, long long now);
+
+/**
+ * @brief Called before the first message a client takes after its send buffer was full.
+ * It was not reading, so the time it was stalled says nothing about how much silence its
+ * prefix bears and is left out.
+ * @param c Pacing state of the client.
+ * @param now Current time in ms.
+ */
+void pacing_resume(struct pacingClient *c, long long now);
+
+/**
+ * @brief Learns from a client whose send failed, for pits that only find out there. The
+ * send before already reached a closed connection, so the client left during the silence
+ * before that one.
+ * @param p Pointer to the pacing of the loop.
+ * @param c Pacing state of the client.
+ * @param now Current time in ms.
+ */
+void pacing_refused(struct pacing *p, struct pacingClient *c, long long now);
+
+#endif
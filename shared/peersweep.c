@@ -0,0 +1,69 @@
+#define _DEFAULT_SOURCE // struct tcp_info
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "peersweep.h"
+#include "structs.h"
+
+void peersweep_init(struct peerSweep *s) {
+    memset(s, 0, sizeof(*s));
+    s->timeoutMs = configInt("PEER_TIMEOUT_MS", 0);
+    s->passMs = configInt("PEER_SWEEP_MS", DEFAULT_PEER_SWEEP_MS);
+    if (s->passMs < PEER_SWEEP_TICK_MS) s->passMs = PEER_SWEEP_TICK_MS;
+}
+
+static void setOption(int fd, int level, int name, int value) {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) == -1 && errno != EOPNOTSUPP && errno != ENOTSUP) {
+        fprintf(stderr, "setsockopt %d on fd %d failed with error %s\n", name, fd, strerror(errno));
+    }
+}
+
+void peersweep_configure(const struct peerSweep *s, int fd) {
+    if (s->timeoutMs == 0) return;
+
+    // The kernel drops the connection once sent data went unacknowledged for the timeout,
+    // keepalive probes a peer while nothing is in flight between two messages
+    int idle = s->timeoutMs / 2000 > 0 ? s->timeoutMs / 2000 : 1;
+    int interval = s->timeoutMs / 8000 > 0 ? s->timeoutMs / 8000 : 1;
+    setOption(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, s->timeoutMs);
+    setOption(fd, SOL_SOCKET, SO_KEEPALIVE, 1);
+    setOption(fd, IPPROTO_TCP, TCP_KEEPIDLE, idle);
+    setOption(fd, IPPROTO_TCP, TCP_KEEPINTVL, interval);
+    setOption(fd, IPPROTO_TCP, TCP_KEEPCNT, 4);
+}
+
+uint32_t peersweep_slice(struct peerSweep *s, uint32_t capacity, uint32_t *first) {
+    if (capacity == 0) return 0;
+    uint64_t count = ((uint64_t)capacity * PEER_SWEEP_TICK_MS + s->passMs - 1) / s->passMs;
+    if (count > capacity) count = capacity;
+    if (s->cursor >= capacity) s->cursor = 0;
+    *first = s->cursor;
+    s->cursor = (uint32_t)((s->cursor + count) % capacity);
+    return (uint32_t)count;
+}
+
+bool peersweep_alive(struct peerSweep *s, int fd) {
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length) == -1) return true;
+
+    histogram_record(&s->rtt, info.tcpi_rtt);
+    histogram_record(&s->retransmits, info.tcpi_total_retrans);
+    if (info.tcpi_state != TCP_ESTABLISHED) return false; // Closed its side or was reset
+    return info.tcpi_unacked == 0 || info.tcpi_last_ack_recv < (uint32_t)s->timeoutMs;
+}
+
+void peersweep_report(struct peerSweep *s, long long now) {
+    if (s->sendAt == 0) s->sendAt = now + METRIC_HISTOGRAM_MS; // First call
+    if (now < s->sendAt) return;
+
+    metric_histogram(HISTOGRAM_PEER_RTT_US, &s->rtt);
+    metric_histogram(HISTOGRAM_PEER_RETRANSMITS, &s->retransmits);
+    histogram_reset(&s->rtt);
+    histogram_reset(&s->retransmits);
+    s->sendAt = now + METRIC_HISTOGRAM_MS;
+}
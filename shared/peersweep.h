@@ -0,0 +1,68 @@
+#ifndef PEERSWEEP_H
+#define PEERSWEEP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "histogram.h"
+
+// Finds trapped peers that are gone before their next message would. A slice of the
+// sockets is checked with TCP_INFO every PEER_SWEEP_TICK_MS, so a full pass takes
+// PEER_SWEEP_MS, and every socket gets TCP_USER_TIMEOUT and keepalive so the kernel gives
+// up on a silent peer too. A peer counts as dead when its side is closed or data it was
+// sent has not been acknowledged for PEER_TIMEOUT_MS. A peer holding a zero window still
+// answers the window probes, so a stalled bot is not mistaken for a dead one.
+//
+// Every loop has its own sweep, only the thread running the loop may use it.
+
+#define PEER_SWEEP_TICK_MS 1000       // How often a slice is checked
+#define DEFAULT_PEER_SWEEP_MS 60000   // How long a pass over every socket takes
+
+struct peerSweep {
+    int timeoutMs;                // 0 turns the sweep and the socket options off
+    int passMs;
+    uint32_t cursor;              // First slot of the next slice
+    struct histogram rtt;         // Smoothed round trip time of the swept peers in us
+    struct histogram retransmits; // Segments retransmitted to each swept peer in total
+    long long sendAt;             // When the histograms are sent next
+};
+
+/**
+ * @brief Reads PEER_TIMEOUT_MS and PEER_SWEEP_MS from the environment. An unset or 0
+ * timeout turns everything off.
+ * @param s Pointer to the sweep to initialize.
+ */
+void peersweep_init(struct peerSweep *s);
+
+/**
+ * @brief Sets TCP_USER_TIMEOUT and keepalive on a newly trapped socket, nothing if the sweep is off.
+ * @param s Pointer to the sweep.
+ * @param fd Socket of the client.
+ */
+void peersweep_configure(const struct peerSweep *s, int fd);
+
+/**
+ * @brief Picks the slots to check this tick and moves the cursor past them.
+ * @param s Pointer to the sweep.
+ * @param capacity Number of slots, e.g. of a client table.
+ * @param first Set to the first slot to check.
+ * @return Number of slots to check from first on, wrapping around at capacity.
+ */
+uint32_t peersweep_slice(struct peerSweep *s, uint32_t capacity, uint32_t *first);
+
+/**
+ * @brief Checks a socket with TCP_INFO and records its round trip time and retransmits.
+ * Sockets that are not TCP, like the socketpairs of the simulation, are always alive.
+ * @param s Pointer to the sweep.
+ * @param fd Socket of the client.
+ * @return false if the peer is gone and the client can be dropped.
+ */
+bool peersweep_alive(struct peerSweep *s, int fd);
+
+/**
+ * @brief Queues the round trip time and retransmit histograms and resets them, once every METRIC_HISTOGRAM_MS.
+ * @param s Pointer to the sweep.
+ * @param now Current time in ms.
+ */
+void peersweep_report(struct peerSweep *s, long long now);
+
+#endif
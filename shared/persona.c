@@ -0,0 +1,191 @@
+#define _DEFAULT_SOURCE // scandir, alphasort
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "persona.h"
+
+#define PERSONA_SUFFIX ".persona"
+#define CHUNK_MARKER "<!-- chunk -->"
+
+#define FIELD(f) (int)(f).length, (f).text
+
+#define SSDP_FORMAT \
+    "HTTP/1.1 200 OK\r\n" \
+    "CACHE-CONTROL: max-age=1800\r\n" \
+    "EXT:\r\n" \
+    "LOCATION: http://%s:%d%.*s\r\n" \
+    "SERVER: %.*s\r\n" \
+    "ST: %.*s\r\n" \
+    "USN: %.*s\r\n" \
+    "BOOTID.UPNP.ORG: 1\r\n" \
+    "CONFIGID.UPNP.ORG: 1337\r\n" \
+    "\r\n"
+
+// Size line, chunk and CRLF in one frame each, so every frame is a single send
+#define HEAD_FORMAT \
+    "HTTP/1.1 200 OK\r\n" \
+    "Transfer-Encoding: chunked\r\n" \
+    "Trailer: X-Checksum\r\n" \
+    "\r\n" \
+    "%X\r\n%.*s\r\n"
+#define CHUNK_FORMAT "%X\r\n%.*s\r\n"
+
+int persona_add(struct personaSet *s, const struct personaSource *source, const char *host, int port) {
+    if (s->count >= PERSONA_MAX) return -1;
+
+    int ssdpLength = snprintf(NULL, 0, SSDP_FORMAT, host, port, FIELD(source->path), FIELD(source->server),
+        FIELD(source->st), FIELD(source->usn));
+    int headLength = snprintf(NULL, 0, HEAD_FORMAT, (unsigned)source->description.length, FIELD(source->description));
+    int chunkLength = snprintf(NULL, 0, CHUNK_FORMAT, (unsigned)source->chunk.length, FIELD(source->chunk));
+    if (ssdpLength < 0 || headLength > PERSONA_FRAME_MAX || chunkLength > PERSONA_FRAME_MAX) return -1;
+
+    // One block per persona, never written again once compiled, so sends can point into it
+    size_t size = ssdpLength + 1 + headLength + 1 + chunkLength + 1 + source->path.length + 1 + source->name.length + 1;
+    char *block = malloc(size);
+    if (block == NULL) {
+        fprintf(stderr, "Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    struct persona *p = &s->personas[s->count++];
+    char *next = block;
+    snprintf(next, ssdpLength + 1, SSDP_FORMAT, host, port, FIELD(source->path), FIELD(source->server),
+        FIELD(source->st), FIELD(source->usn));
+    p->ssdpReply.iov_base = next;
+    p->ssdpReply.iov_len = ssdpLength;
+    next += ssdpLength + 1;
+
+    snprintf(next, headLength + 1, HEAD_FORMAT, (unsigned)source->description.length, FIELD(source->description));
+    p->head = next;
+    p->headLength = headLength;
+    next += headLength + 1;
+
+    snprintf(next, chunkLength + 1, CHUNK_FORMAT, (unsigned)source->chunk.length, FIELD(source->chunk));
+    p->chunk = next;
+    p->chunkLength = chunkLength;
+    next += chunkLength + 1;
+
+    memcpy(next, source->path.text, source->path.length);
+    next[source->path.length] = '\0';
+    p->path = next;
+    next += source->path.length + 1;
+
+    memcpy(next, source->name.text, source->name.length);
+    next[source->name.length] = '\0';
+    p->name = next;
+    return 0;
+}
+
+// Cuts the next line off a mapped file, without its line ending. Returns false at the end
+static bool nextLine(const char **cursor, const char *end, struct personaField *line) {
+    if (*cursor >= end) return false;
+    const char *start = *cursor;
+    const char *newline = memchr(start, '\n', end - start);
+    const char *stop = newline != NULL ? newline : end;
+    *cursor = newline != NULL ? newline + 1 : end;
+    if (stop > start && stop[-1] == '\r') stop--;
+    line->text = start;
+    line->length = stop - start;
+    return true;
+}
+
+static bool isKey(struct personaField key, const char *name) {
+    return key.length == strlen(name) && strncasecmp(key.text, name, key.length) == 0;
+}
+
+// Splits a mapped persona file into its fields, which point into the mapping
+static int parseSource(const char *text, size_t length, struct personaSource *source) {
+    const char *cursor = text;
+    const char *end = text + length;
+    struct personaField line;
+    for (;;) {
+        if (!nextLine(&cursor, end, &line)) return -1; // No description
+        if (line.length == 0) break;
+        if (line.text[0] == '#') continue;
+
+        const char *colon = memchr(line.text, ':', line.length);
+        if (colon == NULL) return -1;
+        struct personaField key = {line.text, colon - line.text};
+        struct personaField value = {colon + 1, line.length - (colon + 1 - line.text)};
+        while (key.length > 0 && key.text[key.length - 1] == ' ') key.length--;
+        while (value.length > 0 && value.text[0] == ' ') {
+            value.text++;
+            value.length--;
+        }
+        if (isKey(key, "SERVER")) source->server = value;
+        else if (isKey(key, "ST")) source->st = value;
+        else if (isKey(key, "USN")) source->usn = value;
+        else if (isKey(key, "LOCATION")) source->path = value;
+        else return -1;
+    }
+
+    source->description.text = cursor;
+    while (nextLine(&cursor, end, &line)) {
+        if (line.length == strlen(CHUNK_MARKER) && memcmp(line.text, CHUNK_MARKER, line.length) == 0) {
+            source->description.length = line.text - source->description.text;
+            source->chunk.text = cursor;
+            source->chunk.length = end - cursor;
+            break;
+        }
+    }
+
+    bool absolute = source->path.length > 0 && source->path.text[0] == '/';
+    if (source->server.length == 0 || source->st.length == 0 || source->usn.length == 0 || !absolute) return -1;
+    return source->description.length > 0 && source->chunk.length > 0 ? 0 : -1;
+}
+
+static int isPersonaFile(const struct dirent *entry) {
+    size_t length = strlen(entry->d_name);
+    size_t suffix = strlen(PERSONA_SUFFIX);
+    return entry->d_name[0] != '.' && length > suffix && strcmp(entry->d_name + length - suffix, PERSONA_SUFFIX) == 0;
+}
+
+// Maps one file, compiles it and unmaps it again, the compiled persona owns its bytes
+static void loadFile(struct personaSet *s, const char *dir, const char *file, const char *host, int port) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0) {
+        fprintf(stderr, "Cannot read persona %s: %s\n", path, fd == -1 ? strerror(errno) : "empty");
+        if (fd != -1) close(fd);
+        return;
+    }
+    void *text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) {
+        fprintf(stderr, "mmap of persona %s failed with error %s\n", path, strerror(errno));
+        return;
+    }
+
+    struct personaSource source = {0};
+    source.name.text = file;
+    source.name.length = strlen(file) - strlen(PERSONA_SUFFIX);
+    if (parseSource(text, st.st_size, &source) == -1) {
+        fprintf(stderr, "Skipping persona %s, it is malformed\n", path);
+    } else if (persona_add(s, &source, host, port) == -1) {
+        fprintf(stderr, "Skipping persona %s, too many personas or its frames are too long\n", path);
+    }
+    munmap(text, st.st_size);
+}
+
+int persona_load(struct personaSet *s, const char *dir, const char *host, int port) {
+    struct dirent **entries;
+    int n = scandir(dir, &entries, isPersonaFile, alphasort);
+    if (n == -1) return -1;
+
+    uint32_t before = s->count;
+    for (int i = 0; i < n; i++) {
+        loadFile(s, dir, entries[i]->d_name, host, port);
+        free(entries[i]);
+    }
+    free(entries);
+    return (int)(s->count - before);
+}
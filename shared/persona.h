@@ -0,0 +1,96 @@
+#ifndef PERSONA_H
+#define PERSONA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Devices the UPnP pit impersonates. A persona is compiled once at startup into the bytes
+// it sends: the SSDP answer, the response head with the description as its first chunk,
+// and the chunk it trickles, each with its size line and CRLF. Nothing is formatted per
+// request, so more device types cost memory and no time.
+//
+// Personas are read from the *.persona files of a directory, each memory mapped and parsed
+// in place. A file starts with SSDP fields, one per line, then an empty line, the start of
+// the description up to a line reading <!-- chunk -->, and the chunk:
+//
+//   # Comments are allowed among the fields
+//   SERVER: Linux/3.14 UPnP/1.0 PhilipsHue/2.1
+//   ST: urn:Philips:device:Basic:1
+//   USN: uuid:bd752e88-91a9-49e4-8297-8433e05d1c22::urn:Philips:device:Basic:1
+//   LOCATION: /hue-device.xml
+//
+//   <?xml version="1.0"?> ... <serviceList>
+//   <!-- chunk -->
+//   <service> ... </service>
+//
+// LOCATION is the path of the description on the pit. The files are sorted by name, so the
+// same directory always hands a source the same persona.
+
+#define PERSONA_MAX 64          // Personas loaded from a directory, the rest are skipped
+#define PERSONA_FRAME_MAX 65535 // Longest frame, a client tracks how much of one it sent in 16 bits
+
+struct personaField {
+    const char *text;     // Not NUL terminated
+    size_t length;
+};
+
+// A persona before it is compiled, pointing into a mapped file or at constants
+struct personaSource {
+    struct personaField name;
+    struct personaField server;
+    struct personaField st;
+    struct personaField usn;
+    struct personaField path;
+    struct personaField description;
+    struct personaField chunk;
+};
+
+struct persona {
+    const char *name;
+    const char *path;       // NUL terminated, compared with the URL of requests
+    struct iovec ssdpReply; // Shared by every answer, never written after compiling
+    const char *head;
+    size_t headLength;
+    const char *chunk;
+    size_t chunkLength;
+};
+
+struct personaSet {
+    struct persona personas[PERSONA_MAX];
+    uint32_t count;
+};
+
+/**
+ * @brief Compiles a persona and adds it to a set.
+ * @param s Pointer to the set.
+ * @param source Fields of the persona, copied so they need not outlive the call.
+ * @param host Address the SSDP answer sends clients to.
+ * @param port HTTP port of the pit.
+ * @return Returns 0 on success, -1 if the set is full or a frame is too long.
+ */
+int persona_add(struct personaSet *s, const struct personaSource *source, const char *host, int port);
+
+/**
+ * @brief Maps, parses and compiles every *.persona file of a directory. Files that cannot
+ * be read or parsed are skipped with a message.
+ * @param s Pointer to the set.
+ * @param dir Path of the directory.
+ * @param host Address the SSDP answers send clients to.
+ * @param port HTTP port of the pit.
+ * @return Number of personas added, -1 if the directory cannot be read.
+ */
+int persona_load(struct personaSet *s, const char *dir, const char *host, int port);
+
+/**
+ * @brief Picks the persona of a source, the same one for SSDP and HTTP.
+ * @param s Pointer to a set with at least one persona.
+ * @param address IPv4 address of the source in host byte order.
+ * @return The persona.
+ */
+static inline struct persona *persona_for(struct personaSet *s, uint32_t address) {
+    uint32_t hash = address * 2654435761u;
+    return &s->personas[((uint64_t)hash * s->count) >> 32];
+}
+
+#endif
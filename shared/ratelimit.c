@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ratelimit.h"
+
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define CAS(field, expected, desired) \
+    __atomic_compare_exchange_n(&(field), &(expected), (desired), false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+
+static uint64_t intervalOf(uint32_t rate) {
+    if (rate == 0) return 0;
+    uint64_t interval = 1000000 / rate;
+    return interval > 0 ? interval : 1;
+}
+
+// A token is there while due is at most tolerance ahead of now. Taking it moves due on by
+// one interval, from now if the bucket had filled up
+static bool take(uint64_t *due, uint64_t interval, uint64_t tolerance, uint64_t now) {
+    uint64_t current = LOAD(*due);
+    for (;;) {
+        uint64_t start = current > now ? current : now;
+        if (start - now > tolerance) return false;
+        if (CAS(*due, current, start + interval)) return true;
+    }
+}
+
+// Gives a token back. Another worker may have reset the slot for a different prefix in
+// between, so due is never moved below 0
+static void refund(uint64_t *due, uint64_t interval) {
+    uint64_t current = LOAD(*due);
+    while (current >= interval && !CAS(*due, current, current - interval)) {
+    }
+}
+
+void ratelimit_init(struct rateLimiter *r, uint32_t rate, uint32_t burst, uint32_t totalRate) {
+    memset(r, 0, sizeof(*r));
+    if (burst == 0) burst = 1;
+    r->interval = intervalOf(rate);
+    r->tolerance = r->interval * (burst - 1);
+    r->totalInterval = intervalOf(totalRate);
+    r->totalTolerance = totalRate > 0 ? r->totalInterval * (totalRate - 1) : 0;
+    if (rate == 0) return;
+
+    r->buckets = calloc(RATELIMIT_SLOTS, sizeof(struct rateBucket));
+    if (r->buckets == NULL) {
+        fprintf(stderr, "Out of memory");
+        exit(EXIT_FAILURE);
+    }
+}
+
+bool ratelimit_allow(struct rateLimiter *r, uint32_t key, long long now) {
+    uint64_t us = (uint64_t)now * 1000;
+    struct rateBucket *b = NULL;
+    if (r->interval > 0) {
+        b = &r->buckets[(key * 2654435761u) % RATELIMIT_SLOTS];
+        if (LOAD(b->key) != key) {
+            __atomic_store_n(&b->key, key, __ATOMIC_RELAXED);
+            __atomic_store_n(&b->due, 0, __ATOMIC_RELAXED);
+        }
+        if (!take(&b->due, r->interval, r->tolerance, us)) {
+            __atomic_fetch_add(&r->limited, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+    }
+    if (r->totalInterval > 0 && !take(&r->totalDue, r->totalInterval, r->totalTolerance, us)) {
+        // The prefix gets its token back, only the flood as a whole was over
+        if (b != NULL) refund(&b->due, r->interval);
+        __atomic_fetch_add(&r->limited, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
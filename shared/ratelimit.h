@@ -0,0 +1,53 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Rate limits for answering datagrams. Every source prefix gets a bucket that refills at
+// rate tokens per second up to burst, and all sources together share one more bucket of
+// totalRate, so spoofed floods from many prefixes are bounded too. A prefix whose slot
+// is taken by another prefix starts over with a full bucket, which at worst lets a few
+// more answers through.
+//
+// A bucket is kept as the time its next token is due, in us, so taking a token is one
+// compare and swap and all workers of a pit share one limiter. Two workers claiming the
+// same slot for different prefixes at once can mix their buckets, which only makes the
+// limit a little lax or strict for a moment.
+
+#define RATELIMIT_SLOTS 4096 // Buckets of prefixes, hashed
+
+struct rateBucket {
+    uint32_t key;         // Prefix the bucket belongs to, 0 for none
+    uint64_t due;         // When the bucket is empty again, in us, 0 while full
+};
+
+struct rateLimiter {
+    uint64_t interval;      // us per token of a prefix, 0 for no limit
+    uint64_t tolerance;     // How far ahead due may run, burst - 1 tokens
+    uint64_t totalInterval; // us per token over all prefixes, 0 for no limit
+    uint64_t totalTolerance;
+    uint64_t totalDue;
+    struct rateBucket *buckets;
+    unsigned long limited; // Datagrams that found a bucket empty, read with relaxed atomics
+};
+
+/**
+ * @brief Sets up a limiter. A rate of 0 lets everything through.
+ * @param r Pointer to the limiter to initialize.
+ * @param rate Tokens per second per prefix.
+ * @param burst Most tokens a prefix can save up, at least 1.
+ * @param totalRate Tokens per second over all prefixes, its burst is one second of it.
+ */
+void ratelimit_init(struct rateLimiter *r, uint32_t rate, uint32_t burst, uint32_t totalRate);
+
+/**
+ * @brief Takes a token for a prefix. Safe to call from several threads.
+ * @param r Pointer to the limiter.
+ * @param key Prefix of the source, not 0.
+ * @param now Current time in ms.
+ * @return Returns true if the datagram may be answered.
+ */
+bool ratelimit_allow(struct rateLimiter *r, uint32_t key, long long now);
+
+#endif
@@ -0,0 +1,99 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "slab.h"
+
+#define SLAB_ALIGN 16 // Enough for any field of the client structs
+
+// Counters have a single writer, relaxed atomics let another thread report them
+#define SLAB_SET(field, v) __atomic_store_n(&(field), (v), __ATOMIC_RELAXED)
+#define SLAB_GET(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static size_t roundUp(size_t value, size_t multiple) {
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+static size_t headerSize() {
+    return roundUp(sizeof(struct slabChunk), SLAB_ALIGN);
+}
+
+void slab_init(struct slabPool *pool, const char *name, size_t objectSize, size_t objectsPerChunk) {
+    memset(pool, 0, sizeof(*pool));
+    pool->name = name;
+
+    if (objectSize < sizeof(void *)) objectSize = sizeof(void *);
+    pool->objectSize = roundUp(objectSize, SLAB_ALIGN);
+
+    if (objectsPerChunk == 0) objectsPerChunk = SLAB_CHUNK_OBJECTS;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (pageSize <= 0) pageSize = 4096;
+    pool->chunkSize = roundUp(headerSize() + pool->objectSize * objectsPerChunk, (size_t)pageSize);
+}
+
+// Maps a new chunk whose objects are handed out in order, so untouched pages cost no memory
+static int grow(struct slabPool *pool) {
+    void *mem = mmap(NULL, pool->chunkSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return -1;
+
+    struct slabChunk *chunk = mem;
+    chunk->bytes = pool->chunkSize;
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+    SLAB_SET(pool->chunkCount, pool->chunkCount + 1);
+
+    size_t objects = (pool->chunkSize - headerSize()) / pool->objectSize;
+    pool->bump = (char *)mem + headerSize();
+    pool->bumpEnd = pool->bump + objects * pool->objectSize;
+    SLAB_SET(pool->capacity, pool->capacity + objects);
+
+    slab_report(pool);
+    return 0;
+}
+
+void *slab_alloc(struct slabPool *pool) {
+    void *object;
+    if (pool->freeList != NULL) {
+        object = pool->freeList;
+        pool->freeList = *(void **)object;
+    } else {
+        if (pool->bump == pool->bumpEnd && grow(pool) == -1) return NULL;
+        object = pool->bump;
+        pool->bump += pool->objectSize;
+    }
+
+    SLAB_SET(pool->inUse, pool->inUse + 1);
+    if (pool->highWater < pool->inUse) SLAB_SET(pool->highWater, pool->inUse);
+    return object;
+}
+
+void slab_free(struct slabPool *pool, void *object) {
+    if (object == NULL) return;
+    *(void **)object = pool->freeList;
+    pool->freeList = object;
+    SLAB_SET(pool->inUse, pool->inUse - 1);
+}
+
+void slab_report(const struct slabPool *pool) {
+    size_t chunks = SLAB_GET(pool->chunkCount);
+    printf("%s slab: %zu in use, high water %zu, %zu objects in %zu chunks (%zu bytes)\n",
+        pool->name, SLAB_GET(pool->inUse), SLAB_GET(pool->highWater), SLAB_GET(pool->capacity),
+        chunks, chunks * pool->chunkSize);
+}
+
+void slab_destroy(struct slabPool *pool) {
+    struct slabChunk *chunk = pool->chunks;
+    while (chunk != NULL) {
+        struct slabChunk *next = chunk->next;
+        munmap(chunk, chunk->bytes);
+        chunk = next;
+    }
+    const char *name = pool->name;
+    size_t objectSize = pool->objectSize;
+    size_t chunkSize = pool->chunkSize;
+    memset(pool, 0, sizeof(*pool));
+    pool->name = name;
+    pool->objectSize = objectSize;
+    pool->chunkSize = chunkSize;
+}
@@ -0,0 +1,66 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+#define SLAB_CHUNK_OBJECTS 256 // Default number of objects a pool grows by
+
+// Header at the start of every chunk, objects follow it
+struct slabChunk {
+    struct slabChunk *next;
+    size_t bytes;
+};
+
+// Fixed-size object pool. Only the owning thread may allocate and free,
+// give every thread its own pool
+struct slabPool {
+    const char *name;
+    size_t objectSize; // Rounded up so every object is suitably aligned
+    size_t chunkSize;  // Bytes per chunk, a multiple of the page size
+    void *freeList;    // Freed objects, linked through their first bytes
+    char *bump;        // Next never used object in the newest chunk
+    char *bumpEnd;
+    struct slabChunk *chunks;
+    size_t chunkCount;
+    size_t capacity;   // Objects in all chunks
+    size_t inUse;
+    size_t highWater;  // Most objects in use at once
+};
+
+/**
+ * @brief Initializes an empty pool. No memory is allocated until the first slab_alloc.
+ * @param pool Pointer to the pool to initialize.
+ * @param name Name used when reporting, e.g. the client type.
+ * @param objectSize Size of every object handed out.
+ * @param objectsPerChunk Minimum number of objects the pool grows by.
+ */
+void slab_init(struct slabPool *pool, const char *name, size_t objectSize, size_t objectsPerChunk);
+
+/**
+ * @brief Hands out an uninitialized object, reusing freed ones first.
+ * @param pool Pointer to the pool.
+ * @return Pointer to the object, or NULL if a new chunk could not be mapped.
+ */
+void *slab_alloc(struct slabPool *pool);
+
+/**
+ * @brief Returns an object to the pool it was allocated from.
+ * @param pool Pointer to the pool.
+ * @param object Pointer returned by slab_alloc, or NULL.
+ */
+void slab_free(struct slabPool *pool, void *object);
+
+/**
+ * @brief Prints the usage and high-water mark of a pool. Also called when the pool grows.
+ * Safe to call from another thread than the owner.
+ * @param pool Pointer to the pool.
+ */
+void slab_report(const struct slabPool *pool);
+
+/**
+ * @brief Unmaps all chunks. Every object of the pool becomes invalid.
+ * @param pool Pointer to the pool.
+ */
+void slab_destroy(struct slabPool *pool);
+
+#endif
@@ -0,0 +1,162 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include "sourcetable.h"
+#include "structs.h"
+
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define ADD(field, n) __atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+#define CAS(field, expected, desired) \
+    __atomic_compare_exchange_n(&(field), &(expected), (desired), false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)
+
+#define CLIENTS_MASK ((1ULL << 24) - 1)
+
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static void *mapZeroed(size_t size) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "mmap for source table failed with error %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+void sourcetable_init(struct sourceTable *t, uint32_t capacity) {
+    memset(t, 0, sizeof(*t));
+    t->maxClients = (uint32_t)configInt("SOURCE_MAX_CLIENTS", 0);
+    t->maxRecent = (uint32_t)configInt("SOURCE_MAX_RECENT", 0);
+    t->byPrefix = configInt("SOURCE_BY_PREFIX", 0) != 0;
+    if (t->maxClients == 0 && t->maxRecent == 0) return;
+    if (t->maxRecent > 0xffff) t->maxRecent = 0xffff;
+
+    uint32_t size = 1024;
+    while (size < capacity * 2 && size < (1u << 24)) size <<= 1; // Admitted keys hold the slot in 24 bits
+    t->mask = size - 1;
+    t->slots = mapZeroed(size * sizeof(uint64_t));
+    t->recent = mapZeroed(size * sizeof(uint32_t));
+}
+
+uint64_t sourcetable_key(const struct sourceTable *t, const struct sockaddr *addr) {
+    if (t->slots == NULL) return 0;
+
+    // IPv4 is keyed as its IPv4 mapped IPv6 address, so both families share the table
+    unsigned char bytes[16] = {0};
+    if (addr->sa_family == AF_INET) {
+        bytes[10] = bytes[11] = 0xff;
+        memcpy(bytes + 12, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+        if (t->byPrefix) bytes[15] = 0;
+    } else if (addr->sa_family == AF_INET6) {
+        memcpy(bytes, &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
+        bool mapped = memcmp(bytes, "\0\0\0\0\0\0\0\0\0\0\xff\xff", 12) == 0;
+        if (t->byPrefix && mapped) bytes[15] = 0;
+        else if (t->byPrefix) memset(bytes + 6, 0, 10);
+    } else {
+        return 0;
+    }
+
+    uint64_t high, low;
+    memcpy(&high, bytes, 8);
+    memcpy(&low, bytes + 8, 8);
+    uint64_t key = mix(high ^ mix(low));
+    if ((key >> 24) == 0) key |= 1ULL << 24; // A tag of 0 marks an unused slot
+    return key;
+}
+
+// A slot can go to another source once its own has no clients and nothing recent
+static bool reusable(const struct sourceTable *t, uint32_t i, uint64_t slot, long long now) {
+    if ((slot & CLIENTS_MASK) != 0) return false;
+    uint32_t window = (uint32_t)(now / SOURCE_WINDOW_MS) & 0xffff;
+    return (LOAD(t->recent[i]) >> 16) != window;
+}
+
+// Index of the slot of a source, claiming one if there is none yet, or -1 if there is no room
+static int64_t findSlot(struct sourceTable *t, uint64_t key, long long now) {
+    uint64_t tag = key >> 24;
+    int64_t reuse = -1;
+    uint64_t reuseSlot = 0;
+    for (uint32_t probe = 0; probe < SOURCE_PROBES; probe++) {
+        uint32_t i = (uint32_t)(key + probe) & t->mask;
+        uint64_t slot = LOAD(t->slots[i]);
+        if ((slot >> 24) == tag) return i;
+        if (slot == 0) {
+            // Slots are never emptied again, the source is not further on
+            if (CAS(t->slots[i], slot, tag << 24)) return i;
+            if ((slot >> 24) == tag) return i; // Claimed by another worker for the same source
+            continue;
+        }
+        if (reuse < 0 && reusable(t, i, slot, now)) {
+            reuse = i;
+            reuseSlot = slot;
+        }
+    }
+    if (reuse < 0) return -1;
+    if (!CAS(t->slots[reuse], reuseSlot, tag << 24)) return -1;
+    __atomic_store_n(&t->recent[reuse], 0, __ATOMIC_RELAXED);
+    return reuse;
+}
+
+// Counts a connection this window, false once the source is over its cap
+static bool countRecent(struct sourceTable *t, uint32_t i, long long now) {
+    uint32_t window = (uint32_t)(now / SOURCE_WINDOW_MS) & 0xffff;
+    uint32_t recent = LOAD(t->recent[i]);
+    for (;;) {
+        uint32_t count = (recent >> 16) == window ? recent & 0xffff : 0;
+        if (count < 0xffff) count++;
+        if (CAS(t->recent[i], recent, window << 16 | count)) {
+            return t->maxRecent == 0 || count <= t->maxRecent;
+        }
+    }
+}
+
+bool sourcetable_admit(struct sourceTable *t, uint64_t *key, long long now) {
+    if (*key == 0) return true;
+
+    uint64_t tag = *key >> 24;
+    int64_t i = findSlot(t, *key, now);
+    uint64_t slot = i < 0 ? 0 : LOAD(t->slots[i]);
+    for (;;) {
+        if (i < 0 || (slot >> 24) != tag) {
+            // No slot, or it went to another source between finding and counting
+            ADD(t->untracked, 1);
+            *key = 0;
+            return true;
+        }
+        if (t->maxClients > 0 && (slot & CLIENTS_MASK) >= t->maxClients) break;
+        if ((slot & CLIENTS_MASK) == CLIENTS_MASK) break;
+        if (CAS(t->slots[i], slot, slot + 1)) {
+            if (countRecent(t, (uint32_t)i, now)) {
+                *key = tag << 24 | (uint64_t)i;
+                return true;
+            }
+            __atomic_fetch_sub(&t->slots[i], 1, __ATOMIC_RELAXED);
+            ADD(t->refusals, 1);
+            return false;
+        }
+    }
+    countRecent(t, (uint32_t)i, now);
+    ADD(t->refusals, 1);
+    return false;
+}
+
+void sourcetable_release(struct sourceTable *t, uint64_t key) {
+    if (key == 0) return;
+
+    // The slot cannot change hands while the client is counted in it
+    __atomic_fetch_sub(&t->slots[key & CLIENTS_MASK], 1, __ATOMIC_RELAXED);
+}
+
+void sourcetable_report(const struct sourceTable *t, const char *name) {
+    if (t->slots == NULL) return;
+    printf("%s sources: %lu refused over a cap, %lu let in untracked\n", name, LOAD(t->refusals), LOAD(t->untracked));
+}
@@ -0,0 +1,77 @@
+#ifndef SOURCETABLE_H
+#define SOURCETABLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Connections per source, so one scanner cannot fill a pit on its own. A source is an
+// address, or its /24 (/48 for IPv6) with SOURCE_BY_PREFIX=1. Each source holds:
+//   - the clients it has trapped right now, capped by SOURCE_MAX_CLIENTS
+//   - the connections it opened this SOURCE_WINDOW_MS, capped by SOURCE_MAX_RECENT.
+//     Refused attempts count too, so a source hammering the pit stays refused
+// A cap of 0 is no cap, and with both at 0 nothing is tracked.
+//
+// The table is open addressing and lock free, so the workers of a pit share one. A slot is
+// a single 64 bit word holding a 40 bit tag of the source and its clients, so a slot is
+// claimed, counted and handed to another source with one compare and swap each. A slot is
+// only handed over once its source has no clients and nothing recent. Two workers letting
+// in the same new source at once can each claim a slot for it, which only makes the caps
+// a little lax. A source that finds no slot within SOURCE_PROBES is let in untracked.
+
+#define SOURCE_PROBES 16          // Slots looked at before a source is let in untracked
+#define SOURCE_WINDOW_MS 60000    // How long connections count as recent
+
+struct sourceTable {
+    uint64_t *slots;          // tag << 24 | clients, 0 when never used
+    uint32_t *recent;         // window << 16 | connections in it
+    uint32_t mask;
+    uint32_t maxClients;
+    uint32_t maxRecent;
+    bool byPrefix;
+    unsigned long refusals;
+    unsigned long untracked;
+};
+
+/**
+ * @brief Reads SOURCE_MAX_CLIENTS, SOURCE_MAX_RECENT and SOURCE_BY_PREFIX from the
+ * environment and sizes the table for a pit.
+ * @param t Pointer to the table to initialize.
+ * @param capacity Most clients the pit holds at once, the table gets at least twice the slots.
+ */
+void sourcetable_init(struct sourceTable *t, uint32_t capacity);
+
+/**
+ * @brief Hashes the source of a connection.
+ * @param t Pointer to the table.
+ * @param addr IPv4 or IPv6 address of the peer.
+ * @return Key of the source, 0 if the table is off and nothing needs to be counted.
+ */
+uint64_t sourcetable_key(const struct sourceTable *t, const struct sockaddr *addr);
+
+/**
+ * @brief Counts a new connection of a source against its caps.
+ * @param t Pointer to the table.
+ * @param key Key of the source from sourcetable_key. Set to the key to release the client
+ * with, 0 if it was let in untracked.
+ * @param now Current time in ms.
+ * @return Returns true if the connection was let in, its key has to be released again.
+ * false if the source is over a cap and the connection has to be closed.
+ */
+bool sourcetable_admit(struct sourceTable *t, uint64_t *key, long long now);
+
+/**
+ * @brief Stops counting a client that was let in, whether it left or was evicted.
+ * @param t Pointer to the table.
+ * @param key Key sourcetable_admit left for the client.
+ */
+void sourcetable_release(struct sourceTable *t, uint64_t key);
+
+/**
+ * @brief Prints the connections refused over a cap and the sources that went untracked. Safe to call from another thread.
+ * @param t Pointer to the table.
+ * @param name Name of the pit.
+ */
+void sourcetable_report(const struct sourceTable *t, const char *name);
+
+#endif
@@ -1,122 +1,39 @@
-#define _POSIX_C_SOURCE 199309L
+#define _GNU_SOURCE // accept4
 
 #include <stdlib.h>
 #include <syslog.h>
 #include <errno.h>
 #include <unistd.h>
 #include <limits.h>
-#include <time.h>
 #include <sys/resource.h>
-#include <sys/un.h>
+#include <arpa/inet.h>
 #include <stdio.h>
 #include "structs.h"
 
-struct queue clientQueueTelnet;
-struct queue clientQueueUpnp;
-struct priorityQueue clientQueueCoap;
+struct timerWheel clientQueueUpnp;
+struct timerWheel clientQueueCoap;
+struct timerWheel clientQueueMqtt;
 struct telnetStatistics statsTelnet;
 struct upnpStatistics statsUpnp;
 struct mqttStatistics statsMqtt;
 
-void queue_init(struct queue *q) {
-    q->head = q->tail = NULL;
-    q->length = 0;
+void client_schedule(struct timerWheel *w, struct baseClient *c, long long sendNext) {
+    timerwheel_schedule(w, &c->timer, sendNext);
 }
 
-void queue_append(struct queue *q, struct baseClient *c) {
-    c->next = NULL; // Removes old next value
-    if (q->tail != NULL) {
-        q->tail->next = c; // Update next pointer correctly
-    } else {
-        q->head = c;
-    }
-    q->tail = c;
-    q->length++;
-}
-
-struct baseClient *queue_pop(struct queue *q) {
-    if (q->head == NULL) return NULL;
-    struct baseClient *c = q->head;
-    q->head = c->next;
-    if (!q->head) {
-        q->tail = NULL; // Remove tail if only one element in queue
-    }
-    q->length--;
-    return c;
-}
-
-void heap_init(struct priorityQueue *pq, int capacity) {
-    pq->heapArray = malloc(sizeof(struct baseClient *) * capacity);
-    if (!pq->heapArray) {
-        fprintf(stderr, "malloc for priority queue failed\n");
-        exit(EXIT_FAILURE);
-    }
-    pq->capacity = capacity;
-    pq->size = 0;
-}
-
-void swap(struct baseClient **a, struct baseClient **b) {
-    struct baseClient *temp = *a;
-    *a = *b;
-    *b = temp;
+struct baseClient *client_pop(struct timerWheel *w, long long now) {
+    struct timerNode *node = timerwheel_pop(w, now);
+    if (node == NULL) return NULL;
+    return timer_entry(node, struct baseClient, timer);
 }
 
-void heap_insert(struct priorityQueue *pq, struct baseClient *c) {
-    if (pq->size >= pq->capacity) {
-        fprintf(stderr, "Priority queue has hit capacity. Can't add any more clients\n");
-        return;
-    }
-
-    int i = pq->size;
-    pq->heapArray[i] = c;
-
-    // Bubble up
-    while (i > 0) {
-        int parent = (i - 1) / 2;
-        if (pq->heapArray[parent]->sendNext <= pq->heapArray[i]->sendNext) {
-            break;
-        }
-        swap(&pq->heapArray[i], &pq->heapArray[parent]);
-        i = parent;
-    }
-
-    pq->size += 1;
-}
-
-struct baseClient *heap_pop(struct priorityQueue *pq) {
-    if (pq->size == 0) return NULL;
-    struct baseClient *root = pq->heapArray[0];
-    pq->heapArray[0] = pq->heapArray[pq->size-1];
-    pq->size -= 1;
-
-    // Heapify down
-    int i = 0;
-    while (1) {
-        int left = 2 * i + 1;
-        int right = 2 * i + 2;
-        int smallest = i;
-
-        if (left < pq->size && pq->heapArray[left]->sendNext < pq->heapArray[smallest]->sendNext)
-            smallest = left;
-        if (right < pq->size && pq->heapArray[right]->sendNext < pq->heapArray[smallest]->sendNext)
-            smallest = right;
-
-        if (smallest == i) break;
-
-        swap(&pq->heapArray[i], &pq->heapArray[smallest]);
-        i = smallest;
-    }
-
-    return root;
-}
-
-int createServer(int port) {
+static int openServer(int port, bool reusePort) {
     int r; 
     int sockfd;
     int value;
 
-    // IPv4 TCP socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    // IPv4 TCP socket. Non-blocking so the backlog can be drained until EAGAIN
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (sockfd == -1) {
         syslog(LOG_ERR,"Socket creation failed");
         exit(EXIT_FAILURE);
@@ -129,6 +46,16 @@ int createServer(int port) {
         syslog(LOG_ERR,"setsockopt failed");
     }
 
+    // Let several listeners share the port, the kernel spreads new connections over them
+    if (reusePort) {
+        r = setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value));
+        if (r == -1) {
+            syslog(LOG_ERR,"setsockopt SO_REUSEPORT failed");
+            close(sockfd);
+            exit(EXIT_FAILURE);
+        }
+    }
+
     // Set TCP receive window
     int winSize = 256; // Doubled
     setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &winSize, sizeof(winSize));
@@ -159,33 +86,79 @@ int createServer(int port) {
     return sockfd;
 }
 
-long long currentTimeMs() {
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000LL;
+int createServer(int port) {
+    return openServer(port, false);
 }
 
-void setFdLimit(int limit) {
-    struct rlimit rl;
-    rl.rlim_cur = limit;
-    rl.rlim_max = limit;
-    if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
-        fprintf(stderr, "setrlimit failed"); 
+int createReusePortServer(int port) {
+    return openServer(port, true);
+}
+
+int acceptClient(int serverFd, struct sockaddr_in *addr) {
+    socklen_t addrLen = sizeof(*addr);
+    int fd;
+    do {
+        fd = accept4(serverFd, (struct sockaddr *)addr, &addrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    } while (fd == -1 && errno == EINTR);
+    return fd;
+}
+
+int configInt(const char *name, int defaultValue) {
+    const char *value = getenv(name);
+    if (value == NULL || *value == '\0') return defaultValue;
+
+    char *end;
+    errno = 0;
+    long parsed = strtol(value, &end, 10);
+    if (errno || *end || parsed < 0 || parsed > INT_MAX) {
+        fprintf(stderr, "Invalid value for %s: %s. Using %d\n", name, value, defaultValue);
+        return defaultValue;
     }
+    return (int)parsed;
 }
 
-void sendMetric(const char* message) {
-    int sock = socket(AF_UNIX, SOCK_DGRAM, 0);
-    if (sock < 0) return;
+int jitterDelay(int delay, int jitter, unsigned int *seed) {
+    if (jitter <= 0) return delay;
+    return delay + rand_r(seed) % (jitter + 1);
+}
 
-    struct sockaddr_un addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", "/tmp/tarpit_exporter.sock");
+int backoffDelay(int delay, unsigned stalls) {
+    long long wait = delay > 0 ? delay : 1;
+    for (unsigned k = 0; k < stalls && wait < BACKOFF_MAX_MS; k++) wait *= 2;
+    return wait < BACKOFF_MAX_MS ? (int)wait : BACKOFF_MAX_MS;
+}
+
+static uint32_t ipv4Prefix(const unsigned char *bytes) {
+    return ((uint32_t)bytes[0] << 16 | (uint32_t)bytes[1] << 8 | bytes[2]) + 1;
+}
 
-    ssize_t sent = sendto(sock, message, strlen(message), 0, (struct sockaddr*)&addr, sizeof(addr));
-    if (sent < 0) {
-        perror("sendto failed");
+uint32_t addressPrefix(const char *ipaddr) {
+    unsigned char bytes[4];
+    if (inet_pton(AF_INET, ipaddr, bytes) == 1) return ipv4Prefix(bytes);
+
+    struct in6_addr v6;
+    if (inet_pton(AF_INET6, ipaddr, &v6) == 1) {
+        // A dual-stack socket sees IPv4 peers as ::ffff:a.b.c.d, they keep their /24
+        if (IN6_IS_ADDR_V4MAPPED(&v6)) return ipv4Prefix(v6.s6_addr + 12);
+        uint32_t hash = 2166136261u; // FNV-1a
+        for (int i = 0; i < 6; i++) {
+            hash = (hash ^ v6.s6_addr[i]) * 16777619u;
+        }
+        return hash | 0x80000000u;
     }
-    close(sock);
-}
\ No newline at end of file
+    return 1;
+}
+
+void setFdLimit(int limit) {
+    struct rlimit rl;
+    rl.rlim_cur = limit + FD_RESERVE; // Clients can use the whole limit
+    rl.rlim_max = limit + FD_RESERVE;
+    if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+        // Not allowed to raise the hard limit, e.g. a container ulimit, use what is there
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+            rl.rlim_cur = rl.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &rl);
+        }
+        fprintf(stderr, "setrlimit failed"); 
+    }
+}
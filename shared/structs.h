@@ -4,22 +4,45 @@
 #include <netinet/in.h>
 #include <stdbool.h>
 #include "uthash.h"
+#include "clock.h"
+#include "timerwheel.h"
+#include "eventloop.h"
+#include "slab.h"
+#include "clienttable.h"
+#include "metrics.h"
+#include "pacing.h"
+#include "peersweep.h"
+#include "admission.h"
+#include "sourcetable.h"
+#include "httpparser.h"
+#include "ratelimit.h"
+#include "persona.h"
 
 enum Request { CONNECT, PING, SUBSCRIBE, PUBREC, DISCONNECT, PUBLISH, UNSUBSCRIBE, PUBCOMP, UNSUPPORTED_REQUEST };
 enum MqttVersion { V5, V311, V31 };
 enum ClientType { TELNET_CLIENT, COAP_CLIENT };
 
+#define DEFAULT_ACCEPT_BUDGET 256 // Connections accepted per wakeup before other work runs again
+#define DEFAULT_DISPATCH_BUDGET 1024 // Due clients served per wakeup before accepts get a turn again
+#define BACKOFF_MAX_MS 120000 // Longest wait before trying a client whose send buffer stayed full again
+
 struct baseClient {
     enum ClientType type;
-    long long sendNext;
-    struct baseClient *next;
+    struct timerNode timer; // timer.expires is when the client is due next
     long long timeConnected;
     char ipaddr[INET_ADDRSTRLEN];
 };
 
-struct telnetAndUpnpClient {
-    struct baseClient base;
-    int fd;
+#define CLIENT_TRICKLING 1 // Client table state of a telnet or UPnP client being sent data
+
+// Cold record of a telnet or UPnP client in a clientTable
+struct trickleClient {
+    char ipaddr[INET_ADDRSTRLEN];
+    uint32_t prefix;          // addressPrefix of ipaddr, for admission control
+    uint64_t source;          // Key the per source caps counted the client under
+    struct pacingClient pacing;
+    uint8_t stalls;           // Sends in a row that found the send buffer full
+    long long stalledSince;   // When the first of them failed, 0 while the client reads
 };
 
 struct coapClient {
@@ -34,6 +57,7 @@ struct coapClient {
     uint8_t tkl;
     struct sockaddr_in clientAddr;
     socklen_t addrLen;
+    uint32_t prefix; // addressPrefix of base.ipaddr, for admission control
     UT_hash_handle hh;
 };
 
@@ -46,30 +70,27 @@ struct mqttClient {
     uint64_t lastActivityMs;
     uint64_t lastPubrelMs;
     long long timeOfConnection;
+    uint64_t source;        // Key the per source caps counted the client under
+    uint32_t prefix;        // Prefix the admission budget counted the client under
     enum MqttVersion version;
+    struct timerNode timer; // Next keep alive / PUBREL check
+    struct eventHandler handler;
     UT_hash_handle hh;
 };
 
-struct queue {
-    struct baseClient *head;
-    struct baseClient *tail;
-    int length;
-};
-
-struct priorityQueue {
-    struct baseClient **heapArray; // array of pointers
-    int size;
-    int capacity;
-};
-
-extern struct queue clientQueueTelnet;
-extern struct queue clientQueueUpnp;
-extern struct priorityQueue clientQueueCoap;
+extern struct timerWheel clientQueueUpnp;
+extern struct timerWheel clientQueueCoap;
+extern struct timerWheel clientQueueMqtt;
 
 struct telnetStatistics {
     unsigned long totalConnects;
     unsigned long long totalWastedTime;
     int mostConcurrentConnections;
+    int connectedClients;
+    unsigned long long inputBytes; // Read from clients and thrown away or kept
+    unsigned long negotiationReplies; // Client answers the negotiation engine reacted to
+    unsigned long long stalledTime; // ms clients had a full send buffer, not part of totalWastedTime
+    unsigned long deadPeers; // Clients dropped by the dead-peer sweep
 };
 
 struct upnpStatistics {
@@ -79,6 +100,8 @@ struct upnpStatistics {
     unsigned long otherHttpRequests;
     unsigned long ssdpResponses;
     int mostConcurrentConnections;
+    unsigned long long stalledTime; // ms clients had a full send buffer, not part of totalWastedTime
+    unsigned long deadPeers; // Clients dropped by the dead-peer sweep
 };
 
 struct mqttStatistics {
@@ -92,51 +115,78 @@ extern struct upnpStatistics statsUpnp;
 extern struct mqttStatistics statsMqtt;
 
 /**
- * @brief Initializes a queue.
- * @param q Pointer to the queue to initialize.
+ * @brief Schedules a client to be handled again at the given time.
+ * @param w Pointer to the wheel the client lives in.
+ * @param c Pointer to the client.
+ * @param sendNext Time in milliseconds the client is due.
  */
-void queue_init(struct queue *q);
+void client_schedule(struct timerWheel *w, struct baseClient *c, long long sendNext);
 
 /**
- * @brief Appends a client to the queue.
- * @param q Pointer to the queue.
- * @param c Pointer to the client to append.
+ * @brief Removes and returns the next client that is due.
+ * @param w Pointer to the wheel.
+ * @param now Current time in milliseconds.
+ * @return Pointer to the client or NULL if no client is due.
  */
-void queue_append(struct queue *q, struct baseClient *c);
+struct baseClient *client_pop(struct timerWheel *w, long long now);
 
 /**
- * @brief Removes and returns the first client from the queue.
- * @param q Pointer to the queue.
- * @return Pointer to the removed client or NULL if the queue is empty.
+ * @brief Creates a standard TCP server with very large backlog
+ * @param port What port the server should be assigned
+ * @return File descriptor for the server
  */
-struct baseClient *queue_pop(struct queue *q);
+int createServer(int port);
 
-void heap_init(struct priorityQueue *pq, int capacity);
+/**
+ * @brief Like createServer, but with SO_REUSEPORT so every worker can own a listener on the same port
+ * @param port What port the server should be assigned
+ * @return File descriptor for the server
+ */
+int createReusePortServer(int port);
 
-void heap_insert(struct priorityQueue *pq, struct baseClient *c);
+/**
+ * @brief Accepts a pending connection as a non-blocking, close-on-exec socket
+ * @param serverFd Listening socket
+ * @param addr Filled with the address of the client
+ * @return File descriptor for the client, or -1 with errno set. EAGAIN means the backlog is empty
+ */
+int acceptClient(int serverFd, struct sockaddr_in *addr);
 
-struct baseClient *heap_pop(struct priorityQueue *pq);
+/**
+ * @brief Reads an optional non-negative integer setting from the environment
+ * @param name Name of the environment variable
+ * @param defaultValue Value used when the variable is unset or invalid
+ * @return The configured value
+ */
+int configInt(const char *name, int defaultValue);
 
 /**
- * @brief Creates a standard TCP server with very large backlog
- * @param port What port the server should be assigned
- * @return File descriptor for the server
+ * @brief Adds a random share to a delay, so clients accepted in the same burst do not stay due in the same millisecond
+ * @param delay Delay in ms
+ * @param jitter Most ms added, 0 returns the delay unchanged without drawing a random number
+ * @param seed State for rand_r
+ * @return delay plus 0 to jitter ms
  */
-int createServer(int port);
+int jitterDelay(int delay, int jitter, unsigned int *seed);
 
 /**
- * @return Returns the current time in milliseconds
+ * @brief Doubles a delay for every send in a row that found the client's send buffer full
+ * @param delay Delay in ms
+ * @param stalls Failed sends in a row
+ * @return delay times 2^stalls, at most BACKOFF_MAX_MS
  */
-long long currentTimeMs();
+int backoffDelay(int delay, unsigned stalls);
 
 /**
- * @return Sets the maximum number of fd's
+ * @brief Identifies the network a client comes from
+ * @param ipaddr Address in text form, IPv4 or IPv6
+ * @return Key of the /24 for IPv4, also when IPv4 mapped, or a hash of the /48 for IPv6, never 0
  */
-void setFdLimit(int limit);
+uint32_t addressPrefix(const char *ipaddr);
 
 /**
- * @brief Sends a metric to a Unix domain socket
+ * @return Sets the maximum number of fd's, plus FD_RESERVE for the pit's own
  */
-void sendMetric(const char* message);
+void setFdLimit(int limit);
 
 #endif
\ No newline at end of file
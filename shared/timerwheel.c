@@ -0,0 +1,192 @@
+#include <limits.h>
+#include <string.h>
+#include "timerwheel.h"
+
+// Level l holds timers that share the current level l+1 block but not the current
+// level l block. Level 0 therefore only holds timers due within the current 256 ms,
+// and a timer never has to be compared with anything other than the current time.
+
+static long long levelShift(int level) {
+    return (long long)level * WHEEL_BITS;
+}
+
+static void slotAppend(struct timerSlot *s, struct timerNode *node) {
+    node->next = NULL;
+    node->prev = s->tail;
+    if (s->tail != NULL) {
+        s->tail->next = node;
+    } else {
+        s->head = node;
+    }
+    s->tail = node;
+}
+
+static void setOccupied(struct timerWheel *w, int level, int index) {
+    w->occupied[level][index / 64] |= 1ULL << (index % 64);
+}
+
+static void clearOccupied(struct timerWheel *w, int level, int index) {
+    w->occupied[level][index / 64] &= ~(1ULL << (index % 64));
+}
+
+// Returns the first non-empty slot at or after start on the given level, or -1
+static int nextOccupied(struct timerWheel *w, int level, int start) {
+    for (int word = start / 64; word < WHEEL_SIZE / 64; word++) {
+        uint64_t bits = w->occupied[level][word];
+        if (word == start / 64) {
+            bits &= ~0ULL << (start % 64);
+        }
+        if (bits) {
+            return word * 64 + __builtin_ctzll(bits);
+        }
+    }
+    return -1;
+}
+
+static void place(struct timerWheel *w, struct timerNode *node) {
+    long long due = node->expires < w->current ? w->current : node->expires;
+
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        long long parentShift = levelShift(level + 1);
+        if ((due >> parentShift) == (w->current >> parentShift)) {
+            int index = (due >> levelShift(level)) & WHEEL_MASK;
+            node->slot = level * WHEEL_SIZE + index;
+            slotAppend(&w->slots[level][index], node);
+            setOccupied(w, level, index);
+            return;
+        }
+    }
+
+    node->slot = WHEEL_OVERFLOW;
+    slotAppend(&w->overflow, node);
+}
+
+void timerwheel_init(struct timerWheel *w, long long now) {
+    memset(w, 0, sizeof(*w));
+    w->current = now;
+}
+
+void timerwheel_node_init(struct timerNode *node) {
+    node->next = node->prev = NULL;
+    node->expires = 0;
+    node->slot = WHEEL_UNSCHEDULED;
+}
+
+void timerwheel_cancel(struct timerWheel *w, struct timerNode *node) {
+    if (node->slot == WHEEL_UNSCHEDULED) return;
+
+    struct timerSlot *s;
+    int level = -1, index = 0;
+    if (node->slot == WHEEL_OVERFLOW) {
+        s = &w->overflow;
+    } else {
+        level = node->slot / WHEEL_SIZE;
+        index = node->slot % WHEEL_SIZE;
+        s = &w->slots[level][index];
+    }
+
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
+    } else {
+        s->head = node->next;
+    }
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
+    } else {
+        s->tail = node->prev;
+    }
+    if (s->head == NULL && level >= 0) {
+        clearOccupied(w, level, index);
+    }
+
+    node->next = node->prev = NULL;
+    node->slot = WHEEL_UNSCHEDULED;
+    w->length--;
+}
+
+void timerwheel_schedule(struct timerWheel *w, struct timerNode *node, long long expires) {
+    timerwheel_cancel(w, node);
+    node->expires = expires;
+    place(w, node);
+    w->length++;
+}
+
+// Moves every timer in a slot down to the level it now belongs to
+static void cascade(struct timerWheel *w, struct timerSlot *s, int level, int index) {
+    struct timerNode *node = s->head;
+    s->head = s->tail = NULL;
+    if (level >= 0) {
+        clearOccupied(w, level, index);
+    }
+    while (node != NULL) {
+        struct timerNode *next = node->next;
+        place(w, node);
+        node = next;
+    }
+}
+
+// Called when current has just reached a new slot boundary
+static void cascadeBoundaries(struct timerWheel *w) {
+    long long topMask = (1LL << levelShift(WHEEL_LEVELS)) - 1;
+    if ((w->current & topMask) == 0) {
+        cascade(w, &w->overflow, -1, 0);
+    }
+    for (int level = WHEEL_LEVELS - 1; level >= 1; level--) {
+        long long mask = (1LL << levelShift(level)) - 1;
+        if ((w->current & mask) == 0) {
+            int index = (w->current >> levelShift(level)) & WHEEL_MASK;
+            cascade(w, &w->slots[level][index], level, index);
+        }
+    }
+}
+
+// Returns the time of the next non-empty slot after the current one. For slots above
+// level 0 this is the start of the slot, where its timers have to be cascaded.
+static long long nextEvent(struct timerWheel *w) {
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        int currentIndex = (w->current >> levelShift(level)) & WHEEL_MASK;
+        int index = nextOccupied(w, level, currentIndex + (level == 0 ? 0 : 1));
+        if (index >= 0) {
+            long long parentShift = levelShift(level + 1);
+            return ((w->current >> parentShift) << parentShift) | ((long long)index << levelShift(level));
+        }
+    }
+    long long topShift = levelShift(WHEEL_LEVELS);
+    return ((w->current >> topShift) + 1) << topShift;
+}
+
+struct timerNode *timerwheel_pop(struct timerWheel *w, long long now) {
+    while (1) {
+        int index = w->current & WHEEL_MASK;
+        struct timerSlot *s = &w->slots[0][index];
+        if (s->head != NULL) {
+            if (w->current > now) return NULL;
+            struct timerNode *node = s->head;
+            timerwheel_cancel(w, node);
+            return node;
+        }
+
+        if (w->length == 0) {
+            if (now > w->current) w->current = now;
+            return NULL;
+        }
+
+        long long next = nextEvent(w);
+        if (next > now) {
+            if (now > w->current) w->current = now;
+            return NULL;
+        }
+        w->current = next;
+        cascadeBoundaries(w);
+    }
+}
+
+int timerwheel_timeout(struct timerWheel *w, long long now) {
+    if (w->length == 0) return -1;
+    if (w->slots[0][w->current & WHEEL_MASK].head != NULL) return 0;
+
+    long long wait = nextEvent(w) - now;
+    if (wait < 0) return 0;
+    if (wait > INT_MAX) return INT_MAX;
+    return (int)wait;
+}
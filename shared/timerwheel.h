@@ -0,0 +1,91 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WHEEL_BITS 8
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4 // 4 levels of 256 slots at 1 ms resolution covers ~49 days
+#define WHEEL_UNSCHEDULED -1
+#define WHEEL_OVERFLOW -2
+
+/**
+ * @brief Gets the struct a timer node is embedded in.
+ */
+#define timer_entry(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+struct timerNode {
+    struct timerNode *next;
+    struct timerNode *prev;
+    long long expires;
+    int slot; // level * WHEEL_SIZE + index, WHEEL_UNSCHEDULED or WHEEL_OVERFLOW
+};
+
+struct timerSlot {
+    struct timerNode *head;
+    struct timerNode *tail;
+};
+
+struct timerWheel {
+    struct timerSlot slots[WHEEL_LEVELS][WHEEL_SIZE];
+    uint64_t occupied[WHEEL_LEVELS][WHEEL_SIZE / 64]; // One bit per non-empty slot
+    struct timerSlot overflow; // Timers beyond the range of the top level
+    long long current; // Time in ms the wheel has been advanced to
+    int length;
+};
+
+/**
+ * @brief Initializes an empty timing wheel.
+ * @param w Pointer to the wheel to initialize.
+ * @param now Current time in milliseconds.
+ */
+void timerwheel_init(struct timerWheel *w, long long now);
+
+/**
+ * @brief Initializes a timer node so it can be scheduled and cancelled.
+ * @param node Pointer to the node.
+ */
+void timerwheel_node_init(struct timerNode *node);
+
+/**
+ * @brief Schedules (or reschedules) a node to expire at the given time in O(1).
+ * Times in the past expire on the next call to timerwheel_pop.
+ * @param w Pointer to the wheel.
+ * @param node Pointer to the node.
+ * @param expires Expiry time in milliseconds.
+ */
+void timerwheel_schedule(struct timerWheel *w, struct timerNode *node, long long expires);
+
+/**
+ * @brief Removes a node from the wheel in O(1). Does nothing if it is not scheduled.
+ * @param w Pointer to the wheel.
+ * @param node Pointer to the node.
+ */
+void timerwheel_cancel(struct timerWheel *w, struct timerNode *node);
+
+/**
+ * @brief Advances the wheel to now and removes the next expired node.
+ * @param w Pointer to the wheel.
+ * @param now Current time in milliseconds.
+ * @return Pointer to the expired node or NULL if no node is due.
+ */
+struct timerNode *timerwheel_pop(struct timerWheel *w, long long now);
+
+/**
+ * @brief Calculates how long a poll can sleep before the wheel needs to be advanced.
+ * @param w Pointer to the wheel.
+ * @param now Current time in milliseconds.
+ * @return Timeout in milliseconds, or -1 if the wheel is empty.
+ */
+int timerwheel_timeout(struct timerWheel *w, long long now);
+
+/**
+ * @return Returns true if the node is currently scheduled.
+ */
+static inline int timerwheel_pending(const struct timerNode *node) {
+    return node->slot != WHEEL_UNSCHEDULED;
+}
+
+#endif
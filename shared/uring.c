@@ -0,0 +1,163 @@
+#define _DEFAULT_SOURCE // syscall, MAP_POPULATE
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+#ifdef URING_SUPPORTED
+
+static int ioUringSetup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static void *mapRing(int fd, size_t size, off_t offset) {
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return mem == MAP_FAILED ? NULL : mem;
+}
+
+int uring_init(struct uring *u, unsigned entries) {
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+
+    // SUBMIT_ALL keeps a failing send from holding back the rest of the batch
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SUBMIT_ALL;
+    int fd = ioUringSetup(entries, &params);
+    if (fd == -1 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params)); // Kernel older than 5.18
+        fd = ioUringSetup(entries, &params);
+    }
+    if (fd == -1) return -1;
+    u->fd = fd;
+    u->entries = params.sq_entries;
+
+    u->ringSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    u->cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && u->cqSize > u->ringSize) u->ringSize = u->cqSize;
+
+    u->ringMem = mapRing(fd, u->ringSize, IORING_OFF_SQ_RING);
+    u->cqMem = single ? u->ringMem : mapRing(fd, u->cqSize, IORING_OFF_CQ_RING);
+    u->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mapRing(fd, u->sqesSize, IORING_OFF_SQES);
+    if (u->ringMem == NULL || u->cqMem == NULL || u->sqes == NULL) {
+        int error = errno;
+        uring_destroy(u);
+        errno = error;
+        return -1;
+    }
+
+    char *sq = u->ringMem;
+    u->sqHead = (unsigned *)(sq + params.sq_off.head);
+    u->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    u->sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    u->sqArray = (unsigned *)(sq + params.sq_off.array);
+    u->sqTailLocal = *u->sqTail;
+
+    char *cq = u->cqMem;
+    u->cqHead = (unsigned *)(cq + params.cq_off.head);
+    u->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    u->cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+bool uring_send(struct uring *u, int fd, const void *buf, size_t len, uint64_t userData) {
+    if (u->sqTailLocal - __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE) >= u->entries) return false;
+
+    unsigned index = u->sqTailLocal & u->sqMask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL; // A full socket completes with -EAGAIN instead of waiting
+    sqe->user_data = userData;
+    u->sqArray[index] = index;
+    u->sqTailLocal++;
+    u->queued++;
+    return true;
+}
+
+int uring_submit(struct uring *u) {
+    if (u->queued == 0) return 0;
+
+    __atomic_store_n(u->sqTail, u->sqTailLocal, __ATOMIC_RELEASE);
+    int submitted;
+    do {
+        submitted = ioUringEnter(u->fd, u->queued, 0, 0);
+    } while (submitted == -1 && errno == EINTR);
+    if (submitted > 0) {
+        u->queued -= submitted;
+        u->inFlight += submitted;
+    }
+    return submitted;
+}
+
+unsigned uring_complete(struct uring *u, uringCallback callback, void *context) {
+    unsigned handled = 0;
+    unsigned head = *u->cqHead;
+    while (head != __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &u->cqes[head & u->cqMask];
+        uint64_t userData = cqe->user_data;
+        int result = cqe->res;
+
+        // Hand the entry back first, the callback may queue more work
+        __atomic_store_n(u->cqHead, ++head, __ATOMIC_RELEASE);
+        u->inFlight--;
+        handled++;
+        callback(context, userData, result);
+    }
+    return handled;
+}
+
+#else
+
+int uring_init(struct uring *u, unsigned entries) {
+    (void)entries;
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+    errno = ENOSYS;
+    return -1;
+}
+
+bool uring_send(struct uring *u, int fd, const void *buf, size_t len, uint64_t userData) {
+    (void)u;
+    (void)fd;
+    (void)buf;
+    (void)len;
+    (void)userData;
+    return false;
+}
+
+int uring_submit(struct uring *u) {
+    (void)u;
+    return 0;
+}
+
+unsigned uring_complete(struct uring *u, uringCallback callback, void *context) {
+    (void)u;
+    (void)callback;
+    (void)context;
+    return 0;
+}
+
+#endif
+
+void uring_destroy(struct uring *u) {
+    if (u->sqes != NULL) munmap(u->sqes, u->sqesSize);
+    if (u->cqMem != NULL && u->cqMem != u->ringMem) munmap(u->cqMem, u->cqSize);
+    if (u->ringMem != NULL) munmap(u->ringMem, u->ringSize);
+    if (u->fd != -1) close(u->fd);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
@@ -0,0 +1,87 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Builds without the kernel header, the endlessh image has none, get a ring that never
+// initializes and the event loop sends with plain send
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define URING_SUPPORTED 1
+#endif
+#endif
+
+// Minimal io_uring for batching sends, on the raw system calls so no library is needed.
+// Only the thread that owns a ring may use it.
+struct uring {
+    int fd; // -1 when io_uring is not used
+    unsigned entries;
+    // Submission queue, shared with the kernel
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned sqTailLocal; // Tail including queued entries not yet published
+    unsigned queued;      // Entries queued since the last submit
+    // Completion queue, shared with the kernel
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+    // Mappings
+    void *ringMem;
+    size_t ringSize;
+    void *cqMem; // Same as ringMem when the kernel maps both rings at once
+    size_t cqSize;
+    size_t sqesSize;
+    unsigned long inFlight; // Submitted, not completed yet
+};
+
+typedef void (*uringCallback)(void *context, uint64_t userData, int result);
+
+/**
+ * @brief Sets up a ring.
+ * @param u Pointer to the ring to initialize.
+ * @param entries Size of the submission queue, rounded up to a power of two by the kernel.
+ * @return 0 on success, -1 with errno set if io_uring is unavailable. u->fd is -1 then.
+ */
+int uring_init(struct uring *u, unsigned entries);
+
+/**
+ * @brief Queues a send with MSG_DONTWAIT. Nothing reaches the kernel before uring_submit.
+ * @param u Pointer to the ring.
+ * @param fd Socket to send on.
+ * @param buf Data, it must stay unchanged until the send completed.
+ * @param len Length of the data.
+ * @param userData Passed back with the completion.
+ * @return true if queued, false if the submission queue is full.
+ */
+bool uring_send(struct uring *u, int fd, const void *buf, size_t len, uint64_t userData);
+
+/**
+ * @brief Hands all queued entries to the kernel with one io_uring_enter.
+ * @param u Pointer to the ring.
+ * @return Number of entries submitted, or -1 with errno set.
+ */
+int uring_submit(struct uring *u);
+
+/**
+ * @brief Calls the callback for every completion that is ready, without waiting.
+ * @param u Pointer to the ring.
+ * @param callback Called with the user data and the result, bytes sent or -errno.
+ * @param context Passed to the callback.
+ * @return Number of completions handled.
+ */
+unsigned uring_complete(struct uring *u, uringCallback callback, void *context);
+
+/**
+ * @brief Unmaps the rings and closes the ring fd.
+ * @param u Pointer to the ring.
+ */
+void uring_destroy(struct uring *u);
+
+#endif
@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "sim.h"
+
+#define SIM_START_MS 1000000 // Virtual time the simulation starts at
+
+// A scripted client, the pit's end of its socketpair belongs to the pit
+struct simClient {
+    struct timerNode timer; // Departure, not scheduled for clients that stay until the end
+    int fd;
+    int index;              // Position in clients
+    long long arrived;
+};
+
+// Options
+static long long duration = 3600 * 1000LL;
+static int clientsTotal = 1000;
+static double arrivalRate;  // Clients per second, 0 connects all at the start
+static double meanLifetime; // Seconds, 0 keeps clients until the end
+static const char *scriptPath;
+static int delay = 1000;
+static int maxClients;
+static unsigned long long seed = 1;
+static long long drainInterval = SIM_DRAIN_INTERVAL_MS;
+static bool verbose;
+
+// State
+static const struct simPit *pit;
+static struct eventLoop *loop;
+static timerCallback pitOnTimer;
+static struct timerWheel departures;
+static struct slabPool clientPool;
+static struct simClient **clients;
+static int connected;
+static int clientsCapacity;
+static long long now;
+static FILE *script;
+static unsigned long scriptLine; // Line being read, for errors
+
+// Next arrival, read ahead so the clock can jump to it
+static bool havePending;
+static long long pendingAt;
+static long long pendingLifetime; // -1 stays until the end
+static int pendingCount;           // Clients left in the current script line
+
+// Results
+static unsigned long arrived;
+static unsigned long refused;
+static unsigned long left;
+static unsigned long closedByPit;
+static int peak;
+static unsigned long long timersRun;
+static unsigned long long latenessTotal;
+static long long latenessMax;
+static unsigned long long wakeups;
+static unsigned long long events;
+static unsigned long long bytesRead;
+static long long clientTime; // ms all clients spent connected
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [-t seconds] [-n clients] [-r per second] [-l seconds] [-f script]\n"
+        "          [-d delay ms] [-m max clients] [-s seed] [-i seconds] [-v]\n"
+        "  -t  Simulated time (default 3600)\n"
+        "  -n  Clients that connect in total (default 1000)\n"
+        "  -r  Poisson arrival rate, 0 connects everyone at the start (default 0)\n"
+        "  -l  Mean of the exponential time clients stay, 0 until the end (default 0)\n"
+        "  -f  Script with lines '<at seconds> <clients> <stay seconds, -1 until the end>'\n"
+        "      in time order, replaces -n, -r and -l\n"
+        "  -d  Delay of the pit (default 1000)\n"
+        "  -m  Clients the pit can hold, more are refused (default -n or the script total)\n"
+        "  -s  Seed for arrivals, lifetimes and the pit (default 1)\n"
+        "  -i  How often clients read what they were sent (default %d)\n"
+        "  -v  Keep the pit's log lines\n",
+        name, SIM_DRAIN_INTERVAL_MS / 1000);
+}
+
+// xorshift64*, the same seed always gives the same run
+static double randomUnit() {
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return (double)((seed * 0x2545F4914F6CDD1DULL) >> 11) / (double)(1ULL << 53);
+}
+
+static long long randomExponential(double meanMs) {
+    return (long long)(-meanMs * log(1.0 - randomUnit()));
+}
+
+static bool readScriptLine() {
+    char line[256];
+    while (fgets(line, sizeof(line), script) != NULL) {
+        scriptLine++;
+        double at, stay;
+        int count;
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0') continue;
+        if (sscanf(line, "%lf %d %lf", &at, &count, &stay) != 3 || at < 0 || count < 0) {
+            fprintf(stderr, "Invalid line %lu in %s\n", scriptLine, scriptPath);
+            exit(EXIT_FAILURE);
+        }
+        long long atMs = SIM_START_MS + (long long)(at * 1000);
+        if (atMs < pendingAt) {
+            fprintf(stderr, "Line %lu in %s is out of time order\n", scriptLine, scriptPath);
+            exit(EXIT_FAILURE);
+        }
+        if (count == 0) continue;
+        pendingAt = atMs;
+        pendingLifetime = stay < 0 ? -1 : (long long)(stay * 1000);
+        pendingCount = count;
+        return true;
+    }
+    return false;
+}
+
+// Reads ahead to the next client that will arrive
+static void nextArrival() {
+    if (script != NULL) {
+        if (pendingCount > 0) pendingCount--;
+        havePending = pendingCount > 0 || readScriptLine();
+        return;
+    }
+
+    if (arrived + refused >= (unsigned long)clientsTotal) {
+        havePending = false;
+        return;
+    }
+    if (havePending && arrivalRate > 0) pendingAt += randomExponential(1000.0 / arrivalRate);
+    pendingLifetime = meanLifetime > 0 ? randomExponential(meanLifetime * 1000) : -1;
+    havePending = true;
+}
+
+// Reads everything the pit sent. Returns false if the pit closed the connection
+static bool drainClient(struct simClient *c) {
+    char buffer[65536];
+    for (;;) {
+        ssize_t n = read(c->fd, buffer, sizeof(buffer));
+        if (n > 0) {
+            bytesRead += n;
+            continue;
+        }
+        return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+}
+
+static void removeClient(struct simClient *c) {
+    timerwheel_cancel(&departures, &c->timer);
+    close(c->fd);
+    clientTime += now - c->arrived;
+
+    clients[c->index] = clients[--connected];
+    clients[c->index]->index = c->index;
+    slab_free(&clientPool, c);
+}
+
+static void arrive() {
+    if (connected >= maxClients) {
+        refused++;
+        return;
+    }
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) == -1) {
+        fprintf(stderr, "socketpair failed with error %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    struct simClient *c = slab_alloc(&clientPool);
+    if (c == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    if (connected == clientsCapacity) {
+        clientsCapacity = clientsCapacity ? clientsCapacity * 2 : 1024;
+        clients = realloc(clients, sizeof(*clients) * clientsCapacity);
+        if (clients == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    c->fd = sv[1];
+    c->index = connected;
+    c->arrived = now;
+    timerwheel_node_init(&c->timer);
+    if (pendingLifetime >= 0) timerwheel_schedule(&departures, &c->timer, now + pendingLifetime);
+    clients[connected++] = c;
+    if (peak < connected) peak = connected;
+    arrived++;
+
+    if (pit->request != NULL && write(c->fd, pit->request, strlen(pit->request)) == -1) {
+        fprintf(stderr, "Failed writing request with error %s\n", strerror(errno));
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(SIM_FIRST_ADDRESS + (uint32_t)(arrived - 1));
+    pit->connect(sv[0], &addr);
+}
+
+static void drainAll() {
+    for (int i = 0; i < connected;) {
+        struct simClient *c = clients[i];
+        if (drainClient(c)) {
+            i++;
+        } else {
+            closedByPit++;
+            removeClient(c); // Moves the last client to i
+        }
+    }
+}
+
+// Wraps the pit's timer callback to see how late timers run
+static void countTimer(struct eventLoop *timerLoop, struct timerNode *node, long long t) {
+    long long lateness = t - node->expires;
+    timersRun++;
+    latenessTotal += lateness;
+    if (latenessMax < lateness) latenessMax = lateness;
+    pitOnTimer(timerLoop, node, t);
+}
+
+static void parseOptions(int argc, char *argv[]) {
+    int option;
+    while ((option = getopt(argc, argv, "t:n:r:l:f:d:m:s:i:vh")) != -1) {
+        switch (option) {
+            case 't': duration = (long long)(atof(optarg) * 1000); break;
+            case 'n': clientsTotal = atoi(optarg); break;
+            case 'r': arrivalRate = atof(optarg); break;
+            case 'l': meanLifetime = atof(optarg); break;
+            case 'f': scriptPath = optarg; break;
+            case 'd': delay = atoi(optarg); break;
+            case 'm': maxClients = atoi(optarg); break;
+            case 's': seed = strtoull(optarg, NULL, 10); break;
+            case 'i': drainInterval = (long long)(atof(optarg) * 1000); break;
+            case 'v': verbose = true; break;
+            default:
+                usage(argv[0]);
+                exit(option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if (duration <= 0 || clientsTotal < 0 || arrivalRate < 0 || meanLifetime < 0 || delay < 0 ||
+        maxClients < 0 || drainInterval <= 0) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (seed == 0) seed = 1; // xorshift never leaves 0
+}
+
+// Adds up the clients of a script to size the pit
+static int scriptTotal() {
+    long long total = 0;
+    while (readScriptLine()) total += pendingCount;
+    rewind(script);
+    scriptLine = 0;
+    pendingAt = 0;
+    pendingCount = 0;
+    return total > INT_MAX ? INT_MAX : (int)total;
+}
+
+static double wallSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(FILE *out, double wall) {
+    double simulated = (now - SIM_START_MS) / 1000.0;
+    for (int i = 0; i < connected; i++) {
+        clientTime += now - clients[i]->arrived;
+    }
+
+    fprintf(out, "Simulated %.0f s of %s in %.2f s (%.0fx)\n", simulated, pit->name, wall,
+        wall > 0 ? simulated / wall : 0);
+    fprintf(out, "Clients: %lu arrived, %lu refused, %lu left, %lu closed by the pit, %d still connected, peak %d\n",
+        arrived, refused, left, closedByPit, connected, peak);
+    fprintf(out, "Timers: %llu run, lateness mean %.3f ms, max %lld ms\n", timersRun,
+        timersRun ? (double)latenessTotal / timersRun : 0, latenessMax);
+    fprintf(out, "Wakeups: %llu with %llu events\n", wakeups, events);
+    fprintf(out, "Bytes read by clients: %llu, %.2f per client second\n", bytesRead,
+        clientTime > 0 ? bytesRead * 1000.0 / clientTime : 0);
+}
+
+int sim_main(const struct simPit *p, int argc, char *argv[]) {
+    pit = p;
+    parseOptions(argc, argv);
+
+    if (scriptPath != NULL) {
+        script = fopen(scriptPath, "r");
+        if (script == NULL) {
+            fprintf(stderr, "Failed opening %s with error %s\n", scriptPath, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        clientsTotal = scriptTotal();
+    }
+    if (maxClients == 0) maxClients = clientsTotal > 0 ? clientsTotal : 1;
+
+    // The report goes to the real stdout, the pit's log lines usually nowhere
+    FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+    if (out == NULL || (!verbose && freopen("/dev/null", "w", stdout) == NULL)) {
+        fprintf(stderr, "Failed redirecting stdout\n");
+        return EXIT_FAILURE;
+    }
+
+    clock_use_virtual(SIM_START_MS);
+    now = SIM_START_MS;
+    signal(SIGPIPE, SIG_IGN); // Like the pits, clients that left are noticed by write
+    setFdLimit(2 * maxClients + 64);
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)2 * maxClients + 64) {
+        maxClients = rl.rlim_cur > 128 ? (rl.rlim_cur - 64) / 2 : 32;
+        fprintf(stderr, "\nOnly %llu fds available, more than %d clients are refused\n",
+            (unsigned long long)rl.rlim_cur, maxClients);
+    }
+    timerwheel_init(&departures, now);
+    slab_init(&clientPool, "Simulated clients", sizeof(struct simClient), SLAB_CHUNK_OBJECTS);
+    loop = pit->init(delay, maxClients, (unsigned int)seed);
+    pitOnTimer = loop->onTimer;
+    loop->onTimer = countTimer;
+
+    pendingAt = SIM_START_MS;
+    nextArrival();
+
+    long long end = SIM_START_MS + duration;
+    long long nextDrain = now + drainInterval;
+    double start = wallSeconds();
+    for (;;) {
+        loop->now = now;
+
+        struct timerNode *node;
+        while ((node = timerwheel_pop(&departures, now)) != NULL) {
+            struct simClient *c = timer_entry(node, struct simClient, timer);
+            if (drainClient(c)) {
+                left++;
+            } else {
+                closedByPit++;
+            }
+            removeClient(c);
+        }
+        while (havePending && pendingAt <= now) {
+            arrive();
+            nextArrival();
+        }
+        if (now >= nextDrain) {
+            drainAll();
+            nextDrain = now + drainInterval;
+        }
+
+        // Let the pit catch up with everything that happened at this time
+        int n;
+        do {
+            n = eventloop_run_once(loop);
+            wakeups++;
+            events += n;
+        } while (n == loop->maxEvents);
+
+        if (now >= end) break;
+
+        // Jump to whatever happens next
+        long long next = end;
+        int timeout = timerwheel_timeout(loop->timers, now);
+        if (timeout >= 0 && now + timeout < next) next = now + timeout;
+        timeout = timerwheel_timeout(&departures, now);
+        if (timeout >= 0 && now + timeout < next) next = now + timeout;
+        if (havePending && pendingAt < next) next = pendingAt;
+        if (nextDrain < next) next = nextDrain;
+        if (next <= now) next = now + 1;
+        now = next;
+        clock_set_virtual(now);
+    }
+
+    drainAll();
+    report(out, wallSeconds() - start);
+    fclose(out);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,40 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <netinet/in.h>
+#include "../shared/structs.h"
+
+// Runs a pit in-process on the virtual clock. Scripted clients are connected through
+// socketpairs and the clock jumps straight to the next thing that happens, so hours
+// of tarpitting take as long as the work the pit actually does.
+
+#define SIM_DRAIN_INTERVAL_MS 10000 // How often clients read what the pit sent them
+#define SIM_FIRST_ADDRESS 0x0A000001 // 10.0.0.1, clients get consecutive addresses
+
+struct simPit {
+    const char *name;
+    const char *request; // Sent by every client before the pit sees the connection, or NULL
+
+    /**
+     * @brief Sets up the pit without listeners or threads.
+     * @param delay Delay between messages in ms.
+     * @param maxClients Maximum number of clients.
+     * @param seed Seed for anything random in the pit.
+     * @return The loop of the pit, it must run on the calling thread.
+     */
+    struct eventLoop *(*init)(int delay, int maxClients, unsigned int seed);
+
+    /**
+     * @brief Hands over the pit's end of a new connection, as if it had been accepted.
+     */
+    void (*connect)(int fd, struct sockaddr_in *addr);
+};
+
+/**
+ * @brief Parses the command line, runs the simulation and prints a report.
+ * Run with -h for the options.
+ * @return Exit code for main.
+ */
+int sim_main(const struct simPit *pit, int argc, char *argv[]);
+
+#endif
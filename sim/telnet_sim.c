@@ -0,0 +1,36 @@
+// Builds the real telnet pit without its main and drives one worker in the simulation
+#define main telnetPitMain
+#include "../servers/telnet_pit.c"
+#undef main
+#include "sim.h"
+
+static struct eventLoop *initTelnet(int simDelay, int maxClients, unsigned int seed) {
+    delay = simDelay;
+    delayJitter = configInt("DELAY_JITTER", 0);
+    wakeOnWritable = configInt("WAKE_ON_WRITABLE", 0);
+    maxNoClients = maxClients;
+    workerCount = 1;
+    acceptBudget = DEFAULT_ACCEPT_BUDGET;
+    initializeStats();
+    initNegotiation();
+    admission_init(&admission, SERVER_ID, maxClients);
+    sourcetable_init(&sources, maxClients);
+
+    workers = calloc(1, sizeof(struct telnetWorker));
+    if (!workers) {
+        fprintf(stderr, "Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    initWorker(&workers[0], 0);
+    workers[0].seed = seed;
+    return &workers[0].loop;
+}
+
+static void connectTelnet(int fd, struct sockaddr_in *addr) {
+    acceptNewClient(&workers[0], fd, addr);
+}
+
+int main(int argc, char *argv[]) {
+    struct simPit pit = { SERVER_ID, NULL, initTelnet, connectTelnet };
+    return sim_main(&pit, argc, argv);
+}
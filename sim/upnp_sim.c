@@ -0,0 +1,33 @@
+// Builds the real UPnP pit without its main and drives its HTTP side in the simulation
+#define main upnpPitMain
+#include "../servers/upnp_pit.c"
+#undef main
+#include "sim.h"
+
+static struct eventLoop *initUpnp(int simDelay, int maxClients, unsigned int seed) {
+    delay = simDelay;
+    delayJitter = configInt("DELAY_JITTER", 0);
+    wakeOnWritable = configInt("WAKE_ON_WRITABLE", 0);
+    responseChunks = configInt("RESPONSE_CHUNKS", 0);
+    jitterSeed = seed;
+    maxNoClients = maxClients;
+    acceptBudget = DEFAULT_ACCEPT_BUDGET;
+    initializeStats();
+    loadPersonas();
+    initHttpServer();
+    return &httpLoop;
+}
+
+static void connectUpnp(int fd, struct sockaddr_in *addr) {
+    acceptHttpClient(&httpLoop, fd, *addr);
+}
+
+int main(int argc, char *argv[]) {
+    struct simPit pit = {
+        SERVER_ID,
+        "GET /hue-device.xml HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n",
+        initUpnp,
+        connectUpnp
+    };
+    return sim_main(&pit, argc, argv);
+}